@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+# Writes a synthetic ANSI PB90 library with one object, n_bench.udo, whose first script is nothing but
+# branches: if statements, and try blocks that each jump to their end. A script's code is limited to 64KB,
+# so this is about as many as one script can hold.
+#
+# Resolving each jump, and the jumps that end each try, used to scan every statement of the script.
+# Compare builds with:
+#   bench/branches.py /tmp/bench.pbl --ifs 1000 --tries 1300
+#   time ./pb_thingy /tmp/bench.pbl n_bench.udo > /dev/null
+import argparse, struct
+
+PB90 = 193
+
+# pcode instruction numbers for PB90
+RETURN = 0
+JUMPFALSE = 2
+JUMP = 3
+PUSH_LOCAL_VAR = 27
+CONST_LONG = 49
+ASSIGN_LONG = 127
+GT_LONG = 197
+PUSH_LOCAL_VAR_LV = 282
+PUSH_TRY = 485
+POP_TRY = 486
+
+# offsets are 16 bits, leave room for the final return
+LIMIT = 0xFFFF - 6
+
+def u16(*v): return struct.pack('<%dH' % len(v), *v)
+def u32(*v): return struct.pack('<%dI' % len(v), *v)
+
+def table(data=b'', meta=()):
+    m = b''.join(struct.pack('<IHH', *x) for x in meta)
+    return u32(len(data), len(m)) + data + m
+
+def type_defs(names_types):
+    data = b'\0'
+    defs = b''
+    for name, t in names_types:
+        defs += struct.pack('<HHII', 0, 0, 0, len(data)) + struct.pack('<IHH', 0, 0, t)
+        data += name.encode() + b'\0'
+    return table(data) + u16(len(defs)) + defs
+
+def assign(var, value):
+    return u16(PUSH_LOCAL_VAR_LV, var) + u16(CONST_LONG) + u32(value) + u16(ASSIGN_LONG, 0)
+
+def branches(ifs, tries):
+    # function long of_test(long al_x)
+    code = bytearray(); lines = []
+    line = 2
+    for k in range(ifs):
+        # if al_x > k then ll_i = k
+        lines.append((line, len(code)))
+        code += u16(PUSH_LOCAL_VAR, 0) + u16(CONST_LONG) + u32(k) + u16(GT_LONG)
+        jump = len(code)
+        code += u16(JUMPFALSE, 0)
+        lines.append((line + 1, len(code)))
+        code += assign(1, k)
+        if len(code) > LIMIT:
+            raise SystemExit('too much pcode for one script, use fewer branches')
+        code[jump+2:jump+4] = u16(len(code))
+        line += 3
+    for k in range(tries):
+        # try; ll_i = k; end try
+        lines.append((line, len(code)))
+        push = len(code)
+        code += u16(PUSH_TRY, 0, 0)
+        lines.append((line + 1, len(code)))
+        code += assign(1, k)
+        jump = len(code)
+        code += u16(JUMP, 0)
+        end = len(code)
+        lines.append((line + 2, len(code)))
+        code += u16(POP_TRY)
+        if len(code) > LIMIT:
+            raise SystemExit('too much pcode for one script, use fewer branches')
+        # no catch blocks, so they start where the try ends
+        code[push+2:push+6] = u16(end, end)
+        code[jump+2:jump+4] = u16(end)
+        line += 4
+    lines.append((line, len(code)))
+    code += u16(RETURN, 0, 0)
+    return bytes(code), lines, [('al_x', 2), ('ll_i', 2)]
+
+def empty():
+    # subroutine of_empty()
+    return u16(RETURN, 0, 0), [(2, 0)], []
+
+def class_group(name, ifs, tries):
+    out = struct.pack('<HHHHHHIIHH', PB90, 3, 1, 0, 0, 0, 0, 0, 0, 0)
+    # one external reference, to the ancestor system type
+    out += u16(1)
+    out += struct.pack('<IHHHH', 1, 0, 0x4005, 0x4005, 0)
+    out += table(b'\0nonvisualobject\0')
+    out += u16(0x10, 0x32, 0x08)
+    out += type_defs([])  # globals
+    out += u16(1, 1)  # type_count, class_count
+    names = b'\0'
+    n_test = len(names); names += b'of_test\0'
+    n_alx = len(names); names += b'al_x\0'
+    n_empty = len(names); names += b'of_empty\0'
+    out += table(names)
+    out += table(b'\0' * 4 + struct.pack('<IIHH', n_alx, 0, 2, 0), [(4, 4, 1)])
+    out += u16(0x0a, 0x78, 0x11)
+    out += type_defs([(name, 0)])
+    out += u16(0x14, 0xf0, 0x11)
+    out += type_defs([])  # enum values
+    out += struct.pack('<HHHHII', 0x0001, 0x8000, 0, 0, 0, 0)
+    # class header
+    out += struct.pack('<16H', 0x4005, 0, 2, 0, 0, 0, 0, 0, 2, 2, 0, 0, 0, 0, 1, 0)
+    # implemented scripts
+    out += u16(2) + u16(1, 0, 1, 1)
+    for code, lines, locals_ in (branches(ifs, tries), empty()):
+        out += u16(len(code), len(lines), 0) + code
+        out += b''.join(u16(*l) for l in lines)
+        out += u16(16, 100, 8)
+        out += type_defs(locals_)
+        out += table()
+    # short headers, by id
+    out += u16(1, 0, 0x8000, 2, 1, 0x8000)
+    out += u16(16, 50, 11) + type_defs([])  # imports
+    out += u16(16, 50, 11) + type_defs([])  # instance variables
+    out += struct.pack('<IHH', 0, 0, 1)  # instance values
+    # script headers, by number
+    out += struct.pack('<IIIIIHHHHHHHBBHHHHI', n_test, 0, 4, 0, 0, 1, 0, 0, 0, 2, 0, 0xFFFF, 0, 0, 0, 0, 0, 0, 0)
+    out += struct.pack('<IIIIIHHHHHHHBBHHHHI', n_empty, 0, 0xFFFF, 0, 0, 2, 1, 0, 0, 0, 0, 0xFFFF, 0, 0, 0, 0, 0, 0, 0)
+    return out
+
+def pbl(name, payload, timestamp=1000):
+    block = 512
+    data = b''
+    first = 0x1000
+    chunks = [payload[i:i+502] for i in range(0, len(payload), 502)]
+    for i, chunk in enumerate(chunks):
+        next_offset = first + (i + 1) * block if i < len(chunks) - 1 else 0
+        data += b'DAT*' + u32(next_offset) + u16(len(chunk)) + chunk.ljust(502, b'\0')
+    header = b'HDR*' + b'PowerBuilder\0\0' + b'0600'.ljust(14, b'\0') + u32(timestamp) + u16(0) \
+        + b'benchmark'.ljust(256, b'\0') + u32(0, 0)
+    # a single directory node, with a single entry
+    node = bytearray(b'NOD*' + u32(0, 0, 0) + u16(0, 0, 0, 0)) + bytearray(3072 - 24)
+    entry_name = name.encode() + b'\0'
+    node[32:56] = b'ENT*' + b'0600' + u32(first, len(payload), timestamp) + u16(0, len(entry_name))
+    node[56:56+len(entry_name)] = entry_name
+    end = 56 + len(entry_name)
+    node[16:24] = u16(3072 - end, 56, 1, 56)
+    out = header.ljust(0x400, b'\0') + bytes(node)
+    assert len(out) == first
+    return out + data
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='write a library with one heavily branching script')
+    parser.add_argument('path')
+    parser.add_argument('--ifs', type=int, default=1000)
+    parser.add_argument('--tries', type=int, default=1300)
+    args = parser.parse_args()
+    with open(args.path, 'wb') as f:
+        f.write(pbl('n_bench.udo', class_group('n_bench', args.ifs, args.tries)))
@@ -0,0 +1,386 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include "cfg.h"
+#include "disassembly.h"
+#include "debug.h"
+#include "pool_alloc.h"
+
+// a graph in compressed adjacency form
+struct graph{
+  unsigned node_count;
+  unsigned *start;
+  unsigned *edges;
+};
+
+struct dom_tree{
+  unsigned *idom;
+  unsigned *pre;
+  unsigned *post;
+};
+
+static int ends_block(struct statement *statement){
+  switch(statement->end->definition->id){
+    case SM_JUMP_1:
+    case SM_JUMPTRUE_1:
+    case SM_JUMPFALSE_1:
+    case SM_GOSUB_1:
+    case SM_PUSH_TRY_2:
+    case SM_RETURN_0:
+    case SM_RETURN_2:
+    case SM_RETURN_SUB_0:
+      return 1;
+  }
+  return 0;
+}
+
+// branch destinations of the last statement in a block, other than falling through
+static unsigned destinations(struct disassembly *disassembly, struct statement *statement, struct statement **dest, int *falls_through){
+  struct instruction *inst = statement->end;
+  unsigned count = 0;
+  *falls_through = 1;
+  switch(inst->definition->id){
+    case SM_JUMP_1:
+      *falls_through = 0;
+      // fallthrough
+    case SM_JUMPTRUE_1:
+    case SM_JUMPFALSE_1:
+    case SM_GOSUB_1:
+      dest[count++] = statement_at(disassembly, inst->args[0]);
+      break;
+    case SM_PUSH_TRY_2:
+      // catch & end of the try block
+      dest[count++] = statement_at(disassembly, inst->args[0]);
+      dest[count++] = statement_at(disassembly, inst->args[1]);
+      break;
+    case SM_RETURN_0:
+    case SM_RETURN_2:
+    case SM_RETURN_SUB_0:
+      *falls_through = 0;
+      break;
+  }
+  return count;
+}
+
+static void add_edge(struct cfg_block *block, unsigned to){
+  unsigned i;
+  for (i=0;i<block->succ_count;i++)
+    if (block->succ[i] == to)
+      return;
+  assert(block->succ_count < 3);
+  block->succ[block->succ_count++] = to;
+}
+
+static void build_graph(struct pool *pool, struct cfg *cfg, struct graph *succ, struct graph *pred){
+  unsigned n = cfg->block_count;
+  unsigned i, j;
+  succ->node_count = pred->node_count = n;
+  succ->start = pool_alloc_array(pool, unsigned, n + 1);
+  pred->start = pool_alloc_array(pool, unsigned, n + 1);
+  memset(succ->start, 0, (n + 1) * sizeof(unsigned));
+  memset(pred->start, 0, (n + 1) * sizeof(unsigned));
+
+  unsigned edge_count = 0;
+  for (i=0;i<cfg->block_count;i++){
+    struct cfg_block *block = &cfg->blocks[i];
+    succ->start[i+1] = block->succ_count;
+    edge_count += block->succ_count;
+    for (j=0;j<block->succ_count;j++)
+      pred->start[block->succ[j]+1]++;
+  }
+  for (i=0;i<n;i++){
+    succ->start[i+1] += succ->start[i];
+    pred->start[i+1] += pred->start[i];
+  }
+  succ->edges = pool_alloc_array(pool, unsigned, edge_count);
+  pred->edges = pool_alloc_array(pool, unsigned, edge_count);
+
+  unsigned *fill = pool_alloc_array(pool, unsigned, n);
+  memcpy(fill, pred->start, n * sizeof(unsigned));
+  for (i=0;i<cfg->block_count;i++){
+    struct cfg_block *block = &cfg->blocks[i];
+    unsigned *out = &succ->edges[succ->start[i]];
+    for (j=0;j<block->succ_count;j++){
+      out[j] = block->succ[j];
+      pred->edges[fill[block->succ[j]]++] = i;
+    }
+  }
+}
+
+static unsigned intersect(const unsigned *idom, const unsigned *order, unsigned a, unsigned b){
+  while (a != b){
+    while (order[a] < order[b])
+      a = idom[a];
+    while (order[b] < order[a])
+      b = idom[b];
+  }
+  return a;
+}
+
+// Cooper, Harvey & Kennedy, "A Simple, Fast Dominance Algorithm", rooted at the entry block
+static void dominators(struct pool *pool, const struct graph *succ, const struct graph *pred, struct dom_tree *tree){
+  unsigned n = succ->node_count;
+  unsigned root = 0;
+  unsigned i;
+  // post order number of each node, NO_BLOCK if unreachable
+  unsigned *order = pool_alloc_array(pool, unsigned, n);
+  unsigned *postorder = pool_alloc_array(pool, unsigned, n);
+  unsigned *stack = pool_alloc_array(pool, unsigned, n);
+  unsigned *next_edge = pool_alloc_array(pool, unsigned, n);
+  uint8_t *seen = pool_alloc_array(pool, uint8_t, n);
+  memset(seen, 0, n);
+  for (i=0;i<n;i++)
+    order[i] = NO_BLOCK;
+
+  unsigned count = 0, depth = 0;
+  stack[depth++] = root;
+  seen[root] = 1;
+  next_edge[root] = succ->start[root];
+  while(depth){
+    unsigned node = stack[depth-1];
+    if (next_edge[node] < succ->start[node+1]){
+      unsigned to = succ->edges[next_edge[node]++];
+      if (!seen[to]){
+	seen[to] = 1;
+	next_edge[to] = succ->start[to];
+	stack[depth++] = to;
+      }
+      continue;
+    }
+    depth--;
+    order[node] = count;
+    postorder[count++] = node;
+  }
+
+  unsigned *idom = tree->idom = pool_alloc_array(pool, unsigned, n);
+  for (i=0;i<n;i++)
+    idom[i] = NO_BLOCK;
+  idom[root] = root;
+
+  int changed = 1;
+  while(changed){
+    changed = 0;
+    // reverse post order, skipping the root
+    for (i=count-1;i>0;i--){
+      unsigned node = postorder[i-1];
+      unsigned new_idom = NO_BLOCK;
+      unsigned e;
+      for (e=pred->start[node];e<pred->start[node+1];e++){
+	unsigned p = pred->edges[e];
+	if (idom[p] == NO_BLOCK)
+	  continue;
+	new_idom = new_idom == NO_BLOCK ? p : intersect(idom, order, p, new_idom);
+      }
+      if (new_idom != idom[node]){
+	idom[node] = new_idom;
+	changed = 1;
+      }
+    }
+  }
+
+  // number the tree, so dominance is an interval test
+  unsigned *child_start = pool_alloc_array(pool, unsigned, n + 1);
+  unsigned *children = pool_alloc_array(pool, unsigned, n);
+  memset(child_start, 0, (n + 1) * sizeof(unsigned));
+  for (i=0;i<n;i++)
+    if (i != root && idom[i] != NO_BLOCK)
+      child_start[idom[i]+1]++;
+  for (i=0;i<n;i++)
+    child_start[i+1] += child_start[i];
+  memcpy(next_edge, child_start, n * sizeof(unsigned));
+  for (i=0;i<n;i++)
+    if (i != root && idom[i] != NO_BLOCK)
+      children[next_edge[idom[i]]++] = i;
+
+  tree->pre = pool_alloc_array(pool, unsigned, n);
+  tree->post = pool_alloc_array(pool, unsigned, n);
+  for (i=0;i<n;i++)
+    tree->pre[i] = tree->post[i] = NO_BLOCK;
+
+  unsigned pre = 0, post = 0;
+  depth = 0;
+  stack[depth++] = root;
+  tree->pre[root] = pre++;
+  next_edge[root] = child_start[root];
+  while(depth){
+    unsigned node = stack[depth-1];
+    if (next_edge[node] < child_start[node+1]){
+      unsigned child = children[next_edge[node]++];
+      tree->pre[child] = pre++;
+      next_edge[child] = child_start[child];
+      stack[depth++] = child;
+      continue;
+    }
+    depth--;
+    tree->post[node] = post++;
+  }
+  idom[root] = NO_BLOCK;
+}
+
+static int tree_contains(const unsigned *pre, const unsigned *post, unsigned a, unsigned b){
+  if (a == NO_BLOCK || b == NO_BLOCK || pre[a] == NO_BLOCK || pre[b] == NO_BLOCK)
+    return 0;
+  return pre[a] <= pre[b] && post[b] <= post[a];
+}
+
+struct back_edge{
+  unsigned from;
+  unsigned header;
+  unsigned depth;
+};
+
+static int compare_back_edge(const void *a, const void *b){
+  const struct back_edge *x = a, *y = b;
+  // deepest headers first, so inner loops claim their blocks before outer loops
+  if (x->depth != y->depth)
+    return x->depth < y->depth ? 1 : -1;
+  return 0;
+}
+
+static void find_loops(struct pool *pool, struct cfg *cfg, const struct graph *pred){
+  unsigned i, j;
+  unsigned edge_count = 0;
+  for (i=0;i<cfg->block_count;i++)
+    for (j=0;j<cfg->blocks[i].succ_count;j++)
+      if (tree_contains(cfg->dom_pre, cfg->dom_post, cfg->blocks[i].succ[j], i))
+	edge_count++;
+  if (!edge_count)
+    return;
+
+  struct back_edge *edges = pool_alloc_array(pool, struct back_edge, edge_count);
+  edge_count = 0;
+  for (i=0;i<cfg->block_count;i++)
+    for (j=0;j<cfg->blocks[i].succ_count;j++){
+      unsigned header = cfg->blocks[i].succ[j];
+      if (tree_contains(cfg->dom_pre, cfg->dom_post, header, i)){
+	edges[edge_count].from = i;
+	edges[edge_count].header = header;
+	edges[edge_count].depth = cfg->dom_pre[header];
+	edge_count++;
+      }
+    }
+  qsort(edges, edge_count, sizeof *edges, compare_back_edge);
+
+  // the natural loop of each back edge, walking predecessors from the latch up to the header
+  unsigned *visited = pool_alloc_array(pool, unsigned, cfg->block_count);
+  unsigned *work = pool_alloc_array(pool, unsigned, cfg->block_count);
+  memset(visited, 0, cfg->block_count * sizeof(unsigned));
+  for (i=0;i<edge_count;i++){
+    unsigned header = edges[i].header;
+    unsigned mark = i + 1;
+    unsigned work_count = 0;
+    visited[header] = mark;
+    if (cfg->blocks[header].loop_header == NO_BLOCK)
+      cfg->blocks[header].loop_header = header;
+    if (visited[edges[i].from] != mark){
+      visited[edges[i].from] = mark;
+      work[work_count++] = edges[i].from;
+    }
+    while(work_count){
+      unsigned block = work[--work_count];
+      if (cfg->blocks[block].loop_header == NO_BLOCK)
+	cfg->blocks[block].loop_header = header;
+      unsigned e;
+      for (e=pred->start[block];e<pred->start[block+1];e++){
+	unsigned p = pred->edges[e];
+	if (visited[p] == mark || cfg->dom_pre[p] == NO_BLOCK)
+	  continue;
+	visited[p] = mark;
+	work[work_count++] = p;
+      }
+    }
+  }
+}
+
+struct cfg *cfg_build(struct disassembly *disassembly){
+  struct pool *pool = disassembly->pool;
+  struct cfg *cfg = pool_alloc_type(pool, struct cfg);
+  memset(cfg, 0, sizeof *cfg);
+  unsigned count = disassembly->statement_count;
+  if (!count)
+    return cfg;
+
+  // statements that begin a block
+  unsigned i, j;
+  uint8_t *leader = pool_alloc_array(pool, uint8_t, count);
+  memset(leader, 0, count);
+  for (i=0;i<count;i++)
+    disassembly->statements[i]->block = i;
+  leader[0] = 1;
+  for (i=0;i<count;i++){
+    struct statement *statement = disassembly->statements[i];
+    if (!ends_block(statement))
+      continue;
+    if (i+1 < count)
+      leader[i+1] = 1;
+    struct statement *dest[2];
+    int falls_through;
+    unsigned dest_count = destinations(disassembly, statement, dest, &falls_through);
+    for (j=0;j<dest_count;j++)
+      if (dest[j])
+	leader[dest[j]->block] = 1;
+  }
+
+  for (i=0;i<count;i++)
+    if (leader[i])
+      cfg->block_count++;
+  cfg->blocks = pool_alloc_array(pool, struct cfg_block, cfg->block_count);
+  memset(cfg->blocks, 0, cfg->block_count * sizeof(struct cfg_block));
+
+  unsigned block = 0;
+  for (i=0;i<count;i++){
+    if (i && leader[i])
+      block++;
+    struct cfg_block *b = &cfg->blocks[block];
+    if (!b->first)
+      b->first = disassembly->statements[i];
+    b->last = disassembly->statements[i];
+    disassembly->statements[i]->block = block;
+  }
+
+  for (i=0;i<cfg->block_count;i++){
+    struct cfg_block *b = &cfg->blocks[i];
+    b->loop_header = NO_BLOCK;
+    struct statement *dest[2];
+    int falls_through;
+    unsigned dest_count = destinations(disassembly, b->last, dest, &falls_through);
+    if (falls_through && i+1 < cfg->block_count)
+      add_edge(b, i+1);
+    for (j=0;j<dest_count;j++)
+      if (dest[j])
+	add_edge(b, dest[j]->block);
+  }
+
+  struct graph succ, pred;
+  build_graph(pool, cfg, &succ, &pred);
+
+  struct dom_tree dom;
+  dominators(pool, &succ, &pred, &dom);
+  cfg->dom_pre = dom.pre;
+  cfg->dom_post = dom.post;
+
+  find_loops(pool, cfg, &pred);
+
+  if (IFDEBUG(DISASSEMBLY))
+    cfg_dump(stderr, cfg);
+  return cfg;
+}
+
+struct statement *cfg_loop_header(struct cfg *cfg, struct statement *statement){
+  if (!cfg->block_count)
+    return NULL;
+  unsigned header = cfg->blocks[statement->block].loop_header;
+  return header == NO_BLOCK ? NULL : cfg->blocks[header].first;
+}
+
+void cfg_dump(FILE *fd, struct cfg *cfg){
+  unsigned i, j;
+  for (i=0;i<cfg->block_count;i++){
+    struct cfg_block *b = &cfg->blocks[i];
+    fprintf(fd, "block %u [%04x - %04x] loop %d ->",
+      i, b->first->start_offset, b->last->end_offset, (int)b->loop_header);
+    for (j=0;j<b->succ_count;j++)
+      fprintf(fd, " %u", b->succ[j]);
+    fprintf(fd, "\n");
+  }
+}
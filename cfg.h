@@ -0,0 +1,44 @@
+
+#ifndef cfg_header
+#define cfg_header
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Control flow graph over the statements of a disassembly, only used to find loops.
+ * Statements are grouped into basic blocks, then a dominator tree is built
+ * (Cooper, Harvey & Kennedy's iterative algorithm over reverse post order) and natural loops found from back edges.
+ * Blocks that can't be reached from the entry aren't part of any loop.
+ */
+
+struct disassembly;
+struct statement;
+
+#define NO_BLOCK ((unsigned)-1)
+
+struct cfg_block{
+  struct statement *first;
+  struct statement *last;
+  unsigned succ_count;
+  unsigned succ[3];
+  // innermost loop containing this block, or NO_BLOCK
+  unsigned loop_header;
+};
+
+struct cfg{
+  unsigned block_count;
+  struct cfg_block *blocks;
+  // dominator tree intervals, for constant time dominance tests while finding loops
+  unsigned *dom_pre;
+  unsigned *dom_post;
+};
+
+// statements must already be linked to their branch destinations
+struct cfg *cfg_build(struct disassembly *disassembly);
+
+// the first statement of the innermost loop containing this statement, or NULL
+struct statement *cfg_loop_header(struct cfg *cfg, struct statement *statement);
+
+void cfg_dump(FILE *fd, struct cfg *cfg);
+
+#endif
@@ -1,11 +1,18 @@
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <inttypes.h>
+#include <sys/mman.h>
 #include "pool_alloc.h"
 #include "lib.h"
 #include "pb_class_types.h"
 #include "debug.h"
 #include "class_private.h"
+#include "workers.h"
+#include "recover.h"
+#include "hash.h"
 
 #define read_type(E,S) assert(lib_entry_read(E, (uint8_t *)&S, sizeof S)==sizeof S)
 
@@ -31,6 +38,12 @@ static void read_table(struct lib_entry *entry, struct class_group_private *clas
   //DUMP(table->data, table->data_length);
   table->metadata_count = metadata_length / sizeof(struct pbtable_info);
   table->metadata = (struct pbtable_info*)read_block(entry, class_group, metadata_length);
+  table->records = NULL;
+  table->sorted = 1;
+  unsigned i;
+  for (i=1;i<table->metadata_count;i++)
+    if (table->metadata[i-1].offset >= table->metadata[i].offset)
+      table->sorted = 0;
   //DUMP_ARRAY(*table->metadata, count);
 
   // TODO use metadata to detect the gaps between structures (where unicode strings are located)
@@ -64,11 +77,23 @@ const struct pbtable_info *get_table_info(struct class_group_private *class_grou
   if (offset == 0xFFFF)
     return NULL;
   assert(offset < table->data_length);
-  // TODO binary search?
-  unsigned i;
-  for (i=0;i<table->metadata_count;i++)
-    if (table->metadata[i].offset == offset)
-      return &table->metadata[i];
+  if (!table->sorted){
+    unsigned i;
+    for (i=0;i<table->metadata_count;i++)
+      if (table->metadata[i].offset == offset)
+	return &table->metadata[i];
+    return NULL;
+  }
+  unsigned low = 0, high = table->metadata_count;
+  while(low < high){
+    unsigned mid = low + (high - low)/2;
+    if (table->metadata[mid].offset < offset)
+      low = mid+1;
+    else
+      high = mid;
+  }
+  if (low < table->metadata_count && table->metadata[low].offset == offset)
+    return &table->metadata[low];
   return NULL;
 }
 
@@ -201,41 +226,171 @@ static const char *get_indirect_func(struct class_group_private *class_group, co
   return  pool_dupn(class_group->pool, buff, len);
 }
 
-const char *get_table_resource(struct class_group_private *class_group, struct data_table *table, uint32_t offset){
-  if (offset & 0x80000000){
-    table = &class_group->main_table;
-    offset = offset & ~0x80000000;
+// the size of one structure, for dumping tables
+static uint32_t record_size(struct class_group_private *class_group, const struct table_record *record){
+  switch(record->structure_type){
+    case pbstruct_int:
+      return 2;
+    case pbstruct_double:
+      return sizeof(double);
+    case pbstruct_decimal:
+      return class_group->header.compiler_version <= PB100 ? sizeof(struct pb_old_decimal) : sizeof(struct pb_decimal);
+    case pbstruct_datetime:
+      return sizeof(struct pb_datetime);
+    case pbstruct_sql:
+      return sizeof(struct pb_sql);
+    case pbstruct_prop_ref:
+      return sizeof(struct pbprop_ref);
+    case pbstruct_method_ref:
+      return sizeof(struct pbmethod_ref);
+    case pbstruct_indirect_arg:
+      return sizeof(struct pbindirect_arg);
+    case pbstruct_indirect_func:
+      return sizeof(struct pbindirect_func);
+    case pbstruct_create_ref:
+      return sizeof(struct pbcreate_ref);
+    case pbstruct_array:
+      return sizeof(struct pbarray_values) + sizeof(struct pbarray_dimension) * record->array.dimension_count
+	+ sizeof(struct pbvalue) * record->array.value_count;
+    case pbstruct_longlong:
+      return sizeof(int64_t);
+    // seen, but not understood yet
+    case 7: case 8:
+      return 12;
+    case 10: case 22:
+      return 2;
+    case 11:
+      return 6;
+    case 20:
+      return 4;
   }
-  const void *ptr = get_table_ptr(class_group, table, offset);
-  if (!ptr)
-    return NULL;
+  return 0;
+}
 
-  const struct pbtable_info *info = get_table_info(class_group, table, offset);
-  if (!info)
-    return NULL;
+static void decode_record(struct class_group_private *class_group, struct data_table *table,
+  const struct pbtable_info *info, struct table_record *record){
+  memset(record, 0, sizeof *record);
+  record->offset = info->offset;
+  record->structure_type = info->structure_type;
+  record->count = info->count;
+  const void *ptr = record->data = &table->data[info->offset];
 
   switch(info->structure_type){
-    case 1:
-      return pool_sprintf(class_group->pool, "%d", *(const int*)ptr);
-    case 4:
-      return pool_sprintf(class_group->pool, "%f", *(const double*)ptr);
-    case 5:{
-      // decimal
-      intmax_t magnitude=0; // probably not big enough, but should work for smaller constants.
-      uint8_t sign;
-      uint8_t exponent;
+    case pbstruct_int:
+      memcpy(&record->int_value, ptr, sizeof record->int_value);
+      break;
+    case pbstruct_double:
+      memcpy(&record->double_value, ptr, sizeof record->double_value);
+      break;
+    case pbstruct_decimal:
+      // probably not big enough, but should work for smaller constants.
       if (class_group->header.compiler_version <= PB100){
-	struct pb_old_decimal *dec = (struct pb_old_decimal *)ptr;
-	sign = dec->sign;
-	exponent = dec->exponent;
-	memcpy(&magnitude, dec->magnitude, sizeof magnitude > sizeof dec->magnitude ? sizeof dec->magnitude : sizeof magnitude);
+	const struct pb_old_decimal *dec = ptr;
+	record->decimal.sign = dec->sign;
+	record->decimal.exponent = dec->exponent;
+	memcpy(&record->decimal.magnitude, dec->magnitude, sizeof record->decimal.magnitude > sizeof dec->magnitude ? sizeof dec->magnitude : sizeof record->decimal.magnitude);
       }else{
-	struct pb_decimal *dec = (struct pb_decimal *)ptr;
-	sign = dec->sign;
-	exponent = dec->exponent;
-	memcpy(&magnitude, dec->magnitude, sizeof magnitude > sizeof dec->magnitude ? sizeof dec->magnitude : sizeof magnitude);
+	const struct pb_decimal *dec = ptr;
+	record->decimal.sign = dec->sign;
+	record->decimal.exponent = dec->exponent;
+	memcpy(&record->decimal.magnitude, dec->magnitude, sizeof record->decimal.magnitude > sizeof dec->magnitude ? sizeof dec->magnitude : sizeof record->decimal.magnitude);
       }
-      if (sign)
+      break;
+    case pbstruct_datetime:
+      memcpy(&record->datetime, ptr, sizeof record->datetime);
+      break;
+    case pbstruct_longlong:
+      memcpy(&record->longlong_value, ptr, sizeof record->longlong_value);
+      break;
+    case pbstruct_sql:{
+      const struct pb_sql *sql = ptr;
+      record->sql.sql_offset = sql->sql_offset;
+      record->sql.related_sql_offset = sql->related_sql_offset;
+      record->sql.cursor_name_offset = sql->cursor_name_offset;
+      record->sql.fetch_direction = sql->fetch_direction;
+      break;
+    }
+    case pbstruct_prop_ref:{
+      const struct pbprop_ref *ref = ptr;
+      record->ref.name_offset = ref->name_offset;
+      record->ref.number = ref->prop_number;
+      record->ref.type = ref->type;
+      break;
+    }
+    case pbstruct_method_ref:{
+      const struct pbmethod_ref *ref = ptr;
+      record->ref.name_offset = ref->name_offset;
+      record->ref.number = ref->method_number;
+      record->ref.type = ref->type;
+      break;
+    }
+    case pbstruct_create_ref:{
+      const struct pbcreate_ref *ref = ptr;
+      record->ref.name_offset = ref->name_offset;
+      record->ref.type = ref->type;
+      break;
+    }
+    case pbstruct_array:{
+      const struct pbarray_values *definition = ptr;
+      record->array.dimension_count = definition->dimensions;
+      record->array.dimensions = ptr + sizeof(*definition);
+      record->array.values = ptr + sizeof(*definition) + sizeof(struct pbarray_dimension) * definition->dimensions;
+      unsigned i;
+      record->array.value_count = 1;
+      for (i=0;i<definition->dimensions;i++)
+	record->array.value_count *= record->array.dimensions[i].upper - record->array.dimensions[i].lower + 1;
+      break;
+    }
+  }
+  record->size = record_size(class_group, record);
+}
+
+static int record_compare(const void *a, const void *b){
+  const struct table_record *x = a, *y = b;
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// decode every structure in a table, so resources can be looked up without re-parsing them
+static void decode_table(struct class_group_private *class_group, struct data_table *table){
+  if (!table->metadata_count)
+    return;
+  struct table_record *records = pool_alloc_array(class_group->pool, struct table_record, table->metadata_count);
+  unsigned i;
+  for (i=0;i<table->metadata_count;i++){
+    assert(table->metadata[i].offset < table->data_length);
+    decode_record(class_group, table, &table->metadata[i], &records[i]);
+  }
+  // the records are our own copy, so they can always be searched
+  if (!table->sorted)
+    qsort(records, table->metadata_count, sizeof(struct table_record), record_compare);
+  table->records = records;
+}
+
+static struct table_record *get_table_record(struct data_table *table, uint32_t offset){
+  unsigned low = 0, high = table->metadata_count;
+  while(low < high){
+    unsigned mid = low + (high - low)/2;
+    if (table->records[mid].offset < offset)
+      low = mid+1;
+    else
+      high = mid;
+  }
+  if (low < table->metadata_count && table->records[low].offset == offset)
+    return &table->records[low];
+  return NULL;
+}
+
+static const char *format_record(struct class_group_private *class_group, struct data_table *table, const struct table_record *record){
+  const void *ptr = record->data;
+  switch(record->structure_type){
+    case pbstruct_int:
+      return pool_sprintf(class_group->pool, "%d", record->int_value);
+    case pbstruct_double:
+      return pool_sprintf(class_group->pool, "%f", record->double_value);
+    case pbstruct_decimal:{
+      intmax_t magnitude = record->decimal.magnitude;
+      uint8_t exponent = record->decimal.exponent;
+      if (record->decimal.sign)
 	magnitude = -magnitude;
       char buff[32];
       int chars = snprintf(buff, sizeof buff, "%"PRIdMAX, magnitude);
@@ -248,8 +403,8 @@ const char *get_table_resource(struct class_group_private *class_group, struct d
       }
       return pool_dup(class_group->pool, buff);
     }
-    case 6: {
-      const struct pb_datetime *datetime = ptr;
+    case pbstruct_datetime: {
+      const struct pb_datetime *datetime = &record->datetime;
       // probably enough to distinguish dates and times...
       if (datetime->year == 63636 && datetime->month == 255){
 	return pool_sprintf(class_group->pool, "%02d:%02d:%02d.%06d",
@@ -265,16 +420,15 @@ const char *get_table_resource(struct class_group_private *class_group, struct d
       }
     }
 
-    case 9:{
-      const struct pb_sql *ref = (struct pb_sql *)ptr;
-      const char *sql = get_table_string(class_group, table, ref->sql_offset);
+    case pbstruct_sql:{
+      const char *sql = get_table_string(class_group, table, record->sql.sql_offset);
       if (sql)
 	return sql;
-      if (ref->related_sql_offset)
-	return get_table_resource(class_group, table, ref->related_sql_offset);
-      if (ref->cursor_name_offset!=0xFFFF)
-	return get_table_string(class_group, table, ref->cursor_name_offset); // "dynamic" ??
-      switch(ref->fetch_direction){
+      if (record->sql.related_sql_offset)
+	return get_table_resource(class_group, table, record->sql.related_sql_offset);
+      if (record->sql.cursor_name_offset!=0xFFFF)
+	return get_table_string(class_group, table, record->sql.cursor_name_offset); // "dynamic" ??
+      switch(record->sql.fetch_direction){
 	case fetch_next:
 	  return "fetch next";
 	case fetch_first:
@@ -287,42 +441,30 @@ const char *get_table_resource(struct class_group_private *class_group, struct d
       return "";
     }
 
-    case 12:{ // property reference
-      const struct pbprop_ref *ref = (struct pbprop_ref *)ptr;
-      const char *name = get_table_string(class_group, table, ref->name_offset);
+    case pbstruct_prop_ref:
+    case pbstruct_method_ref:{
+      const char *name = get_table_string(class_group, table, record->ref.name_offset);
       if (name)
 	return name;
       else
-	return pool_sprintf(class_group->pool, "%s_prop_%u", get_type_name(class_group, ref->type), ref->prop_number);
+	return pool_sprintf(class_group->pool, "%s_%s_%u", get_type_name(class_group, record->ref.type),
+	  record->structure_type == pbstruct_prop_ref ? "prop" : "method", record->ref.number);
     }
-    case 13:{ // method reference
-      const struct pbmethod_ref *ref = (struct pbmethod_ref *)ptr;
-      const char *name = get_table_string(class_group, table, ref->name_offset);
-      if (name)
-	return name;
-      else
-	return pool_sprintf(class_group->pool, "%s_method_%u", get_type_name(class_group, ref->type), ref->method_number);
-    }
-    case 16:
+    case pbstruct_indirect_arg:
       return get_indirect_arg_name(class_group, ptr);
-    case 17:
+    case pbstruct_indirect_func:
       return get_indirect_func(class_group, ptr);
-    case 18:{
-      const struct pbcreate_ref *ref = (struct pbcreate_ref *)ptr;
-      const char *name = get_table_string(class_group, table, ref->name_offset);
+    case pbstruct_create_ref:{
+      const char *name = get_table_string(class_group, table, record->ref.name_offset);
       if (name)
 	return name;
       else
-	return get_type_name(class_group, ref->type);
+	return get_type_name(class_group, record->ref.type);
     }
-    case 19:{
-      const struct pbarray_values *definition = ptr;
-      const struct pbarray_dimension *dimensions = ptr+sizeof(*definition);
-      const struct pbvalue *values = ptr+sizeof(*definition)+(sizeof(*dimensions) * definition->dimensions);
+    case pbstruct_array:{
+      const struct pbvalue *values = record->array.values;
       unsigned i;
-      unsigned count=1;
-      for (i=0;i<definition->dimensions;i++)
-	count*=dimensions[i].upper - dimensions[i].lower + 1;
+      unsigned count = record->array.value_count;
 
       const char *svalues[count];
       size_t len=2;
@@ -346,30 +488,60 @@ const char *get_table_resource(struct class_group_private *class_group, struct d
       *p++=0;
       return pool_dupn(class_group->pool, buff, len);
     }
-    case 23:
-      return pool_sprintf(class_group->pool, "%"PRId64, *(uint64_t*)ptr);
+    case pbstruct_longlong:
+      return pool_sprintf(class_group->pool, "%"PRId64, record->longlong_value);
   }
-  return pool_sprintf(class_group->pool, "%02x_%04x", info->structure_type, offset);
+  return pool_sprintf(class_group->pool, "%02x_%04x", record->structure_type, record->offset);
 }
 
-static unsigned record_sizes[]={0,2,0,0,8,16,12,12,12,56,2,6,8,8,0,0,8,16,8,24,4,0,2,8};
+const char *get_table_resource(struct class_group_private *class_group, struct data_table *table, uint32_t offset){
+  if (offset & 0x80000000){
+    table = &class_group->main_table;
+    offset = offset & ~0x80000000;
+  }
+  const void *ptr = get_table_ptr(class_group, table, offset);
+  if (!ptr)
+    return NULL;
+
+  if (table->records){
+    struct table_record *record = get_table_record(table, offset);
+    if (!record)
+      return NULL;
+    // the class group may be shared between threads, at worst a record is formatted twice
+    const char *text = __atomic_load_n(&record->text, __ATOMIC_ACQUIRE);
+    if (!text){
+      text = format_record(class_group, table, record);
+      __atomic_store_n(&record->text, text, __ATOMIC_RELEASE);
+    }
+    return text;
+  }
+
+  const struct pbtable_info *info = get_table_info(class_group, table, offset);
+  if (!info)
+    return NULL;
+  struct table_record record;
+  decode_record(class_group, table, info, &record);
+  return format_record(class_group, table, &record);
+}
 
 static void dump_table(FILE *fd, struct class_group_private *class_group, struct data_table *table){
+  // tables parsed without pcode weren't decoded
+  if (!table->records)
+    decode_table(class_group, table);
   unsigned offset = 0;
   unsigned entry = 0;
   while(offset < table->data_length){
-    if (entry < table->metadata_count && offset == table->metadata[entry].offset){
-      assert(table->metadata[entry].structure_type >=1 && table->metadata[entry].structure_type <=23);
-      unsigned record_size = record_sizes[table->metadata[entry].structure_type];
-      assert(record_size);
-      fprintf(fd, "%04x %u * [type_%u]:\n", offset, table->metadata[entry].count, table->metadata[entry].structure_type);
+    if (entry < table->metadata_count && offset == table->records[entry].offset){
+      const struct table_record *record = &table->records[entry];
+      assert(record->size);
+      fprintf(fd, "%04x %u * [type_%u]:\n", offset, record->count, record->structure_type);
       unsigned i;
       unsigned j;
-      for(i=0; i<table->metadata[entry].count; i++){
+      for(i=0; i<record->count; i++){
 	fprintf(fd, "   [%u]:",i);
-	for (j=0;j<record_size;j++)
+	for (j=0;j<record->size && offset < table->data_length;j++)
 	  fprintf(fd, " %02x", table->data[offset++]);
-	fprintf(fd, "    [%s]\n", get_table_resource(class_group, table, table->metadata[entry].offset));
+	fprintf(fd, "    [%s]\n", get_table_resource(class_group, table, record->offset));
       }
       entry++;
       continue;
@@ -379,10 +551,10 @@ static void dump_table(FILE *fd, struct class_group_private *class_group, struct
     if (class_group->header.compiler_version<PB100){
       const char *str = (const char *)&table->data[offset];
       data_len = strlen(str)+1;
-      if (entry < table->metadata_count && offset + data_len > table->metadata[entry].offset){
+      if (entry < table->metadata_count && offset + data_len > table->records[entry].offset){
 	// bad string? alignment?
-	fprintf(fd, "[Skipped %04x]\n", table->metadata[entry].offset - offset);
-	offset = table->metadata[entry].offset;
+	fprintf(fd, "[Skipped %04x]\n", table->records[entry].offset - offset);
+	offset = table->records[entry].offset;
 	continue;
       }
       fprintf(fd, "%04x \"%s\"\n", offset, str);
@@ -393,10 +565,10 @@ static void dump_table(FILE *fd, struct class_group_private *class_group, struct
       int len = u_strlen(src);
       data_len = (len+1)*2;
 
-      if (entry < table->metadata_count && offset + data_len > table->metadata[entry].offset){
+      if (entry < table->metadata_count && offset + data_len > table->records[entry].offset){
 	// bad string? alignment?
-	fprintf(fd, "[Skipped %04x]\n", table->metadata[entry].offset - offset);
-	offset = table->metadata[entry].offset;
+	fprintf(fd, "[Skipped %04x]\n", table->records[entry].offset - offset);
+	offset = table->records[entry].offset;
 	continue;
       }
 
@@ -423,7 +595,14 @@ struct class_def_private *get_class_by_type(struct class_group_private *group, u
   if (type==0 || type == 0xC000)
     return NULL;
 
+  if ((type & 0xC000) == 0x8000){
+    unsigned index = type & 0x7FFF;
+    if (group->class_index && index < group->type_list.count && group->class_index[index])
+      return group->class_index[index];
+  }
+
   if (type & 0x8000){
+    // not indexed, should be rare
     unsigned i;
     for (i=0;i<group->pub.type_count;i++){
       if (group->pub.types[i].type == class_type){
@@ -432,7 +611,6 @@ struct class_def_private *get_class_by_type(struct class_group_private *group, u
 	  return class_def;
       }
     }
-
     return NULL;
   }
 
@@ -440,6 +618,40 @@ struct class_def_private *get_class_by_type(struct class_group_private *group, u
   return NULL;
 }
 
+static const char *find_sys_type_ref(struct class_group_private *class_group, uint16_t type){
+  unsigned i;
+  for (i=0;i<class_group->ext_ref_count;i++)
+    if (type == class_group->external_refs[i].system_type
+    && type == class_group->external_refs[i].type
+    && class_group->external_refs[i].unnamed1 == 0)
+      return class_group->ref_names[i];
+  return NULL;
+}
+
+// index external references to system types, so type names can be resolved without a scan
+// the first matching reference wins, same as a linear search would
+static void index_sys_types(struct class_group_private *class_group){
+  unsigned i;
+  unsigned count=0;
+  for (i=0;i<class_group->ext_ref_count;i++){
+    const struct pbext_reference *ref = &class_group->external_refs[i];
+    if ((ref->type & 0xC000) == 0x4000 && ref->type == ref->system_type && ref->unnamed1 == 0
+      && (unsigned)(ref->type & 0x3FFF) >= count)
+      count = (ref->type & 0x3FFF)+1;
+  }
+  class_group->sys_type_count = count;
+  if (!count)
+    return;
+  class_group->sys_type_names = pool_alloc_array(class_group->pool, const char *, count);
+  memset(class_group->sys_type_names, 0, sizeof(const char *)*count);
+  for (i=0;i<class_group->ext_ref_count;i++){
+    const struct pbext_reference *ref = &class_group->external_refs[i];
+    if ((ref->type & 0xC000) == 0x4000 && ref->type == ref->system_type && ref->unnamed1 == 0
+      && !class_group->sys_type_names[ref->type & 0x3FFF])
+      class_group->sys_type_names[ref->type & 0x3FFF] = class_group->ref_names[i];
+  }
+}
+
 const char *get_type_name(struct class_group_private *class_group, uint16_t type){
   if (type==0 || type == 0xC000)
     return NULL;
@@ -452,13 +664,18 @@ const char *get_type_name(struct class_group_private *class_group, uint16_t type
 
     // cheating a bit, look for an external reference to this type
     // covers a lot of basic cases
-    unsigned i;
-    for (i=0;i<class_group->ext_ref_count;i++)
-      if (type == class_group->external_refs[i].system_type
-      && type == class_group->external_refs[i].type
-      && class_group->external_refs[i].unnamed1 == 0)
-	return class_group->ref_names[i];
-    return "TODO_SYS_TYPE";
+    const char *name = NULL;
+    if ((type & 0xC000) == 0x4000){
+      if ((unsigned)(type & 0x3FFF) < class_group->sys_type_count)
+	name = class_group->sys_type_names[type & 0x3FFF];
+    }else
+      name = find_sys_type_ref(class_group, type);
+    if (name)
+      return name;
+    if ((type & 0xC000) == 0x4000 && (unsigned)(type & 0x3FFF) < class_group->linked_type_count
+      && class_group->linked_type_names[type & 0x3FFF])
+      return class_group->linked_type_names[type & 0x3FFF];
+    return TODO_SYS_TYPE;
   }
   if (type & 0x8000){
     // the main type list *MUST* already be parsed
@@ -788,8 +1005,40 @@ static void read_ignore(struct lib_entry *entry, unsigned count){
   assert(lib_entry_read(entry, data, sizeof(data))==sizeof(data));
 }
 
+// (key, index) pairs, sorted so we can binary search while linking script tables
+struct script_key{
+  uint16_t key;
+  uint16_t index;
+};
+
+static int compare_script_key(const void *a, const void *b){
+  const struct script_key *ka = a, *kb = b;
+  if (ka->key != kb->key)
+    return ka->key < kb->key ? -1 : 1;
+  return ka->index < kb->index ? -1 : ka->index > kb->index;
+}
+
+// index of the first key that is not less than key
+static unsigned lower_bound_script_key(const struct script_key *keys, unsigned count, unsigned key){
+  unsigned lo=0, hi=count;
+  while(lo < hi){
+    unsigned mid = lo + (hi - lo)/2;
+    if (keys[mid].key < key)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
 struct class_group *class_parse(struct lib_entry *entry){
+  return class_parse_flags(entry, 0);
+}
+
+struct class_group *class_parse_flags(struct lib_entry *entry, unsigned flags){
   unsigned i;
+  // the entry may have been read before
+  lib_entry_rewind(entry);
   struct pool *pool = pool_create();
   struct class_group_private *class_group = pool_alloc_type(pool, struct class_group_private);
   memset(class_group, 0, sizeof(*class_group));
@@ -812,10 +1061,13 @@ struct class_group *class_parse(struct lib_entry *entry){
     DEBUGF(PARSE, "%u references", class_group->ext_ref_count);
     read_type_array(entry, class_group, class_group->external_refs, class_group->ext_ref_count);
     read_table(entry, class_group, &class_group->main_table);
+    if (!(flags & CLASS_PARSE_NO_PCODE))
+      decode_table(class_group, &class_group->main_table);
 
     class_group->ref_names = pool_alloc_array(class_group->pool, const char *, class_group->ext_ref_count);
     for (i=0;i<class_group->ext_ref_count;i++)
       class_group->ref_names[i]=get_table_string(class_group, &class_group->main_table, class_group->external_refs[i].name_offset);
+    index_sys_types(class_group);
   }
 
   static uint16_t expect1[] = {0x10,0x32,0x08};
@@ -885,6 +1137,8 @@ struct class_group *class_parse(struct lib_entry *entry){
   // now the hard(-ish) part....
   unsigned j=0;
   class_group->pub.types = pool_alloc_array(class_group->pool, struct type_definition, type_count);
+  class_group->class_index = pool_alloc_array(class_group->pool, struct class_def_private *, class_group->type_list.count);
+  memset(class_group->class_index, 0, sizeof(struct class_def_private *) * class_group->type_list.count);
 
   for (i=0;i<type_count;i++){
     class_group->pub.types[i].name = get_type_name(class_group, class_group->type_headers[i].type);
@@ -936,6 +1190,9 @@ struct class_group *class_parse(struct lib_entry *entry){
       class_group->pub.types[i].class_definition = (struct class_definition *)class_def;
 
       class_def->type_header = &class_group->type_headers[i];
+      if ((class_def->type_header->type & 0xC000) == 0x8000
+	&& (unsigned)(class_def->type_header->type & 0x7FFF) < class_group->type_list.count)
+	class_group->class_index[class_def->type_header->type & 0x7FFF] = class_def;
       const struct pbclass_header *cls_header = class_def->header = &class_headers[j++];
 
       class_def->pub.ancestor = get_type_name(class_group, cls_header->ancestor_type);
@@ -986,9 +1243,19 @@ struct class_group *class_parse(struct lib_entry *entry){
 	read_type(entry, ignored);
 
 	DEBUGF(PARSE, "Pcode len = %u", implementation->code_size);
-	implementation->code = read_block(entry, class_group, implementation->code_size);
 	DEBUGF(PARSE, "Debug line numbers = %u", implementation->debugline_count);
-	read_type_array(entry, class_group, implementation->debug_lines, implementation->debugline_count);
+	if (flags & CLASS_PARSE_NO_PCODE){
+	  size_t length = implementation->code_size + implementation->debugline_count * sizeof(struct pbdebug_line_num);
+	  assert(lib_entry_skip(entry, length)==length);
+	  // nothing may go looking for code that wasn't read
+	  implementation->code = NULL;
+	  implementation->code_size = 0;
+	  implementation->debugline_count = 0;
+	  implementation->debug_lines = NULL;
+	}else{
+	  implementation->code = read_block(entry, class_group, implementation->code_size);
+	  read_type_array(entry, class_group, implementation->debug_lines, implementation->debugline_count);
+	}
 
 	static uint16_t expect4[] = {16,100,8};
 	read_expecting(entry, expect4, 3);
@@ -997,6 +1264,8 @@ struct class_group *class_parse(struct lib_entry *entry){
 	debug_type_names("local variables", class_group, &implementation->local_variables);
 	DEBUGF(PARSE, "References");
 	read_table(entry, class_group, &implementation->resources);
+	if (!(flags & CLASS_PARSE_NO_PCODE))
+	  decode_table(class_group, &implementation->resources);
       }
 
       if (cls_header->script_count)
@@ -1039,22 +1308,33 @@ struct class_group *class_parse(struct lib_entry *entry){
       class_def->pub.scripts = pool_alloc_array(class_group->pool, struct script_definition *, cls_header->script_count+1);
 
       struct script_def_private *script_definitions = pool_alloc_array(class_group->pool, struct script_def_private, cls_header->script_count);
+      // pool memory may be recycled, not every field is set below
+      memset(script_definitions, 0, sizeof(struct script_def_private) * cls_header->script_count);
+
+      // sort both lookup tables once, so linking is O(n log n) instead of O(n^2)
+      struct script_key id_keys[cls_header->script_count];
+      for (k=0;k<cls_header->script_count;k++){
+	id_keys[k].key = short_headers[k].method_id;
+	id_keys[k].index = k;
+      }
+      qsort(id_keys, cls_header->script_count, sizeof(struct script_key), compare_script_key);
+
+      struct script_key number_keys[implemented_count];
+      for (k=0;k<implemented_count;k++){
+	number_keys[k].key = implementations[k].number;
+	number_keys[k].index = k;
+      }
+      qsort(number_keys, implemented_count, sizeof(struct script_key), compare_script_key);
 
       for (k=0;k<cls_header->script_count;k++){
 	class_def->pub.scripts[k]=&script_definitions[k].pub;
 
 	script_definitions[k].short_header = &short_headers[k];
 
-	// TODO faster with a binary search, but is it worth the hastle?
-	unsigned l=0;
-	struct script_def_private *script_def=NULL;
-	for (l=0;l<cls_header->script_count;l++){
-	  if (script_headers[k].method_id == short_headers[l].method_id){
-	    script_def = &script_definitions[l];
-	    break;
-	  }
-	}
-	assert(script_def);
+	unsigned l = lower_bound_script_key(id_keys, cls_header->script_count, script_headers[k].method_id);
+	assert(l < cls_header->script_count && id_keys[l].key == script_headers[k].method_id);
+	l = id_keys[l].index;
+	struct script_def_private *script_def = &script_definitions[l];
 
 	script_def->header = &script_headers[k];
 	script_def->pub.implemented = 0;
@@ -1062,14 +1342,13 @@ struct class_group *class_parse(struct lib_entry *entry){
 	script_def->body = NULL;
 	script_def->pub.local_variables = NULL;
 
-	unsigned m=0;
-	for (m=0;m<implemented_count;m++){
-	  if (implementations[m].number == short_headers[l].method_number){
-	    script_def->body = &implementations[m];
-	    script_def->pub.implemented = 1;
-	    script_def->pub.local_variable_count = script_def->body->local_variables.count;
-	    script_def->pub.local_variables = type_defs_to_variables(class_group, &script_def->body->local_variables, &script_def->body->resources);
-	  }
+	// if a method number is implemented more than once, the last one wins
+	unsigned m = lower_bound_script_key(number_keys, implemented_count, short_headers[l].method_number+1);
+	if (m>0 && number_keys[m-1].key == short_headers[l].method_number){
+	  script_def->body = &implementations[number_keys[m-1].index];
+	  script_def->pub.implemented = 1;
+	  script_def->pub.local_variable_count = script_def->body->local_variables.count;
+	  script_def->pub.local_variables = type_defs_to_variables(class_group, &script_def->body->local_variables, &script_def->body->resources);
 	}
 
 	script_def->pub.name = get_table_string(class_group, &class_group->function_name_table, script_headers[k].name_offset);
@@ -1085,7 +1364,8 @@ struct class_group *class_parse(struct lib_entry *entry){
 	script_def->pub.hidden = (script_headers[k].more_flags & 1)?1:0;
 	script_def->pub.system = (script_headers[k].flags & 0x0200)?1:0;
 	script_def->pub.rpc = (script_headers[k].flags & 0x0800)?1:0;
-	script_def->pub.in_ancestor = 0; // not sure how to work this out yet....
+	// set by universe_link, when the ancestor libraries are known
+	script_def->pub.in_ancestor = 0;
 
 	script_def->pub.throws_count = script_headers[k].throws_count;
 	script_def->pub.throws = pool_alloc_array(class_group->pool, const char *, script_def->pub.throws_count+1);
@@ -1131,7 +1411,170 @@ struct class_group *class_parse(struct lib_entry *entry){
   return (struct class_group *)class_group;
 }
 
+static void relink_type_name(struct class_group_private *class_group, const char **name, uint16_t type){
+  if (*name && strcmp(*name, TODO_SYS_TYPE)==0)
+    *name = get_type_name(class_group, type);
+}
+
+static void relink_variables(struct class_group_private *class_group, struct variable_definition **variables){
+  unsigned i;
+  for (i=0;variables && variables[i];i++){
+    struct variable_def_private *variable = (struct variable_def_private *)variables[i];
+    relink_type_name(class_group, &variable->pub.type, variable->type->value.type);
+  }
+}
+
+void class_link_system_types(struct class_group *group, const char * const *names, unsigned count){
+  struct class_group_private *class_group = (struct class_group_private *)group;
+  class_group->linked_type_names = names;
+  class_group->linked_type_count = count;
+
+  // re-resolve any names we couldn't find while parsing
+  relink_variables(class_group, class_group->pub.global_variables);
+  unsigned i;
+  for (i=0;i<class_group->pub.type_count;i++){
+    struct type_definition *type_def = &class_group->pub.types[i];
+    relink_type_name(class_group, &type_def->name, class_group->type_headers[i].type);
+    if (type_def->type != class_type)
+      continue;
+
+    struct class_def_private *class_def = (struct class_def_private *)type_def->class_definition;
+    relink_type_name(class_group, &class_def->pub.ancestor, class_def->header->ancestor_type);
+    relink_type_name(class_group, &class_def->pub.parent, class_def->header->parent_type);
+    relink_variables(class_group, class_def->pub.instance_variables);
+
+    unsigned j;
+    for (j=0;j<class_def->pub.script_count;j++){
+      struct script_def_private *script_def = (struct script_def_private *)class_def->pub.scripts[j];
+      relink_type_name(class_group, &script_def->pub.return_type, script_def->header->return_type);
+      unsigned k;
+      // raw argument and throw tables are gone from a compacted group
+      for (k=0;script_def->throw_types && k<script_def->pub.throws_count;k++)
+	relink_type_name(class_group, &script_def->pub.throws[k], script_def->throw_types[k]);
+      for (k=0;script_def->arguments && k<script_def->pub.argument_count && script_def->pub.arguments[k];k++)
+	relink_type_name(class_group, &script_def->pub.arguments[k]->type, script_def->arguments[k].type);
+      relink_variables(class_group, script_def->pub.local_variables);
+    }
+  }
+}
+
+uint64_t class_script_hash(struct script_definition *script){
+  struct script_def_private *script_def = (struct script_def_private *)script;
+  if (!script_def->body || !script_def->body->code)
+    return 0;
+  struct hash_state state;
+  hash_init(&state, 0);
+  hash_update(&state, script_def->body->code, script_def->body->code_size);
+  hash_update(&state, script_def->body->resources.data, script_def->body->resources.data_length);
+  hash_update(&state, script_def->body->resources.metadata,
+    script_def->body->resources.metadata_count * sizeof(struct pbtable_info));
+  // pcode refers to locals by index, their names and types are only here
+  struct type_defs *locals = &script_def->body->local_variables;
+  hash_update(&state, locals->table.data, locals->table.data_length);
+  hash_update(&state, locals->table.metadata, locals->table.metadata_count * sizeof(struct pbtable_info));
+  hash_update(&state, locals->types, locals->count * sizeof(struct pbtype_def));
+  return hash_final(&state);
+}
+
+void class_share(struct class_group *group){
+  struct class_group_private *class_group = (struct class_group_private *)group;
+  pool_share(class_group->pool);
+}
+
+// compiled entries, as opposed to source (.sr?) or datawindow entries, and the extension of their source
+static const char *compiled_extensions[][2]={
+  {".apl", ".sra"},
+  {".fun", ".srf"},
+  {".men", ".srm"},
+  {".prx", ".srx"},
+  {".str", ".srs"},
+  {".udo", ".sru"},
+  {".win", ".srw"},
+};
+
+const char *class_source_extension(const char *entry_name){
+  size_t len = strlen(entry_name);
+  if (len<4)
+    return NULL;
+  unsigned i;
+  for (i=0;i<sizeof(compiled_extensions)/sizeof(compiled_extensions[0]);i++)
+    if (strcasecmp(entry_name + len - 4, compiled_extensions[i][0])==0)
+      return compiled_extensions[i][1];
+  return NULL;
+}
+
+int class_is_compiled_entry(const char *entry_name){
+  return class_source_extension(entry_name) != NULL;
+}
+
+void class_collect_compiled(struct lib_entry *entry, void *context){
+  if (class_is_compiled_entry(entry->name))
+    entry_list_add(entry, context);
+}
+
 void class_free(struct class_group *class_group){
   struct class_group_private *cls = (struct class_group_private *)class_group;
+  void *mapping = cls->mapping;
+  size_t mapping_length = cls->mapping_length;
   pool_release(cls->pool);
+  if (mapping)
+    munmap(mapping, mapping_length);
+}
+
+struct parse_many{
+  struct lib_entry **entries;
+  struct class_group **results;
+  unsigned flags;
+  class_callback callback;
+  void *context;
+};
+
+struct parse_one{
+  struct parse_many *state;
+  unsigned index;
+};
+
+static void parse_one(void *context){
+  struct parse_one *work = context;
+  // each class group allocates from it's own pool, so nothing is shared between threads
+  work->state->results[work->index] = class_parse_flags(work->state->entries[work->index], work->state->flags);
+}
+
+static void parse_many_work(unsigned index, void *context){
+  struct parse_many *state = context;
+  struct parse_one work = {.state = state, .index = index};
+  char error[512];
+  if (recover_run(parse_one, &work, error, sizeof error) != 0){
+    fprintf(stderr, "%s: %s\n", state->entries[index]->name, error);
+    state->results[index] = NULL;
+  }
+}
+
+static void parse_many_deliver(unsigned index, void *context){
+  struct parse_many *state = context;
+  if (!state->results[index])
+    return;
+  state->callback(state->entries[index], state->results[index], state->context);
+  state->results[index] = NULL;
+}
+
+void class_parse_many(struct library *lib, struct lib_entry *entries[], unsigned count, unsigned thread_count,
+  unsigned flags, class_callback callback, void *context){
+  assert(lib);
+  assert(callback);
+  if (!count)
+    return;
+  if (!thread_count)
+    thread_count = workers_default_count();
+
+  struct parse_many state = {
+    .entries = entries,
+    .results = calloc(count, sizeof(struct class_group *)),
+    .flags = flags,
+    .callback = callback,
+    .context = context,
+  };
+  assert(state.results);
+  workers_run(thread_count, count, parse_many_work, parse_many_deliver, &state);
+  free(state.results);
 }
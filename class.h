@@ -95,10 +95,39 @@ struct class_group{
 };
 
 struct lib_entry;
+struct library;
+
+// skip pcode and debug line numbers, for consumers that only need declarations
+#define CLASS_PARSE_NO_PCODE 0x0001
 
 struct class_group *class_parse(struct lib_entry *entry);
+struct class_group *class_parse_flags(struct lib_entry *entry, unsigned flags);
 void class_free(struct class_group *class_group);
 
+// system type names by (type & 0x3FFF), for types with no external reference in this group.
+// names must outlive the class group
+void class_link_system_types(struct class_group *class_group, const char * const *names, unsigned count);
+
+// allow scripts to be disassembled from multiple threads at once
+void class_share(struct class_group *class_group);
+
+int class_is_compiled_entry(const char *entry_name);
+// the extension of a compiled entry's source, eg ".sru" for ".udo", or NULL if it isn't compiled
+const char *class_source_extension(const char *entry_name);
+// an entry_callback that appends each compiled entry to the entry_list in context
+void class_collect_compiled(struct lib_entry *entry, void *context);
+
+// hash of the pcode, resources and local variables of an implemented script, or 0
+uint64_t class_script_hash(struct script_definition *script);
+
+// called in submission order, the callback owns the class group
+typedef void (*class_callback) (struct lib_entry *entry, struct class_group *class_group, void *context);
+
+// parse a list of entries from the same library on a pool of worker threads.
+// an entry that fails to parse is reported on stderr and skipped
+void class_parse_many(struct library *lib, struct lib_entry *entries[], unsigned count, unsigned thread_count,
+  unsigned flags, class_callback callback, void *context);
+
 void dump_script_resources(FILE *fd, struct class_group *group, struct script_definition *script);
 
 #endif
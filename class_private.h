@@ -2,14 +2,61 @@
 #define class_private_header
 
 #include <stdint.h>
+#include <inttypes.h>
 #include "class.h"
 #include "pb_class_types.h"
 
+// a table structure, decoded once. The tag is pbtable_info.structure_type
+struct table_record{
+  uint32_t offset;
+  uint16_t structure_type;
+  uint16_t count;
+  // bytes in one structure, 0 if the type isn't known
+  uint32_t size;
+  const void *data;
+  union{
+    int32_t int_value;
+    double double_value;
+    int64_t longlong_value;
+    struct{
+      intmax_t magnitude;
+      uint8_t sign;
+      uint8_t exponent;
+    } decimal;
+    struct pb_datetime datetime;
+    struct{
+      uint32_t sql_offset;
+      uint32_t related_sql_offset;
+      uint32_t cursor_name_offset;
+      uint32_t fetch_direction;
+    } sql;
+    // property, method and create references
+    struct{
+      uint32_t name_offset;
+      // property or method number
+      uint16_t number;
+      uint16_t type;
+    } ref;
+    struct{
+      uint16_t dimension_count;
+      unsigned value_count;
+      const struct pbarray_dimension *dimensions;
+      const struct pbvalue *values;
+    } array;
+  };
+  // formatted value, filled in on first use
+  const char *text;
+};
+
 struct data_table{
   uint32_t data_length;
   unsigned metadata_count;
   const uint8_t *data;
   const struct pbtable_info *metadata;
+  // metadata is normally in offset order, lookups fall back to a scan if it isn't
+  uint8_t sorted;
+  // optional, one record per metadata entry, sorted by offset
+  struct table_record *records;
 };
 
 struct type_defs{
@@ -77,8 +124,23 @@ struct class_group_private{
   struct type_defs type_list; // main type list
   struct type_defs enum_values;
   const struct pbtype_header *type_headers;
+  // direct lookup tables, built once while parsing
+  struct class_def_private **class_index; // indexed by (type & 0x7FFF), type_list.count entries
+  unsigned sys_type_count;
+  const char **sys_type_names; // indexed by (type & 0x3FFF), from external refs
+  // system type names from a pb_type==0 group, supplied by universe_link, not owned by this group
+  unsigned linked_type_count;
+  const char * const *linked_type_names;
+  // selected by compiler version on first disassembly
+  const struct opcode_table *opcodes;
+  // set when loaded from a snapshot, everything except the pool lives in this mapping
+  void *mapping;
+  size_t mapping_length;
 };
 
+// placeholder name for system types we couldn't resolve
+#define TODO_SYS_TYPE "TODO_SYS_TYPE"
+
 const void *get_table_ptr(struct class_group_private *class_group, struct data_table *table, uint32_t offset);
 const struct pbtable_info *get_table_info(struct class_group_private *class_group, struct data_table *table, uint32_t offset);
 const char *get_table_string(struct class_group_private *class_group, struct data_table *table, uint32_t offset);
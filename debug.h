@@ -14,6 +14,9 @@ void _dump(FILE *f, const char *file, int line, const uint8_t *data, size_t len,
 #define DEBUG_PARSE 0
 #define DEBUG_OUTPUT 0
 #define DEBUG_DISASSEMBLY 0
+#define DEBUG_WORKERS 0
+#define DEBUG_SNAPSHOT 0
+#define DEBUG_RECOVER 0
 
 #define IFDEBUG(TYPE) (DEBUG_ ## TYPE)
 #define DEBUGF(TYPE, FMT, ...) if (DEBUG_ ## TYPE) fprintf(stderr, "%s:%u " #TYPE " - " FMT "\n", __FILE__, __LINE__, ##__VA_ARGS__)
@@ -0,0 +1,276 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "diff.h"
+#include "lib.h"
+#include "class.h"
+#include "output.h"
+#include "recover.h"
+#include "workers.h"
+#include "sink.h"
+#include "debug.h"
+
+struct script_ref{
+  struct type_definition *type;
+  struct script_definition *script;
+};
+
+struct script_list{
+  unsigned count;
+  struct script_ref *refs;
+};
+
+struct diff_entry{
+  // either may be NULL
+  struct lib_entry *old_entry;
+  struct lib_entry *new_entry;
+  struct sink out;
+  char error[512];
+  int failed;
+  int identical;
+  // scripts of both versions, owned here so they are freed even if parsing fails
+  struct script_list old_scripts;
+  struct script_list new_scripts;
+};
+
+struct diff{
+  struct diff_entry *entries;
+  unsigned count;
+  unsigned added;
+  unsigned removed;
+  unsigned modified;
+  unsigned failed;
+  struct sink *out;
+};
+
+static int entry_compare(const void *a, const void *b){
+  return strcmp((*(struct lib_entry * const *)a)->name, (*(struct lib_entry * const *)b)->name);
+}
+
+static int script_compare(const void *a, const void *b){
+  const struct script_ref *x = a, *y = b;
+  int ret = strcmp(x->type->name, y->type->name);
+  if (!ret)
+    ret = strcmp(x->script->name, y->script->name);
+  if (!ret)
+    ret = strcmp(x->script->signature ? x->script->signature : "", y->script->signature ? y->script->signature : "");
+  return ret;
+}
+
+// every script declared or implemented by a class in the group, sorted by class, name and signature
+static void collect_scripts(struct class_group *group, struct script_list *list){
+  unsigned i, j, count = 0;
+  for (i=0;i<group->type_count;i++)
+    if (group->types[i].type == class_type)
+      count += group->types[i].class_definition->script_count;
+  list->refs = malloc((count ? count : 1) * sizeof(struct script_ref));
+  assert(list->refs);
+  list->count = 0;
+  for (i=0;i<group->type_count;i++){
+    if (group->types[i].type != class_type)
+      continue;
+    struct class_definition *class_def = group->types[i].class_definition;
+    for (j=0;j<class_def->script_count;j++){
+      struct script_definition *script = class_def->scripts[j];
+      if (script->in_ancestor && !script->implemented)
+	continue;
+      list->refs[list->count++] = (struct script_ref){.type = &group->types[i], .script = script};
+    }
+  }
+  qsort(list->refs, list->count, sizeof(struct script_ref), script_compare);
+}
+
+static void close_sink(void *context){
+  sink_close(context);
+}
+
+static int same_header(struct script_definition *old_script, struct script_definition *new_script){
+  struct sink a, b;
+  struct recover_cleanup cleanup_a, cleanup_b;
+  sink_open_memory(&a);
+  recover_push(&cleanup_a, close_sink, &a);
+  sink_open_memory(&b);
+  recover_push(&cleanup_b, close_sink, &b);
+  write_method_header(&a, old_script);
+  write_method_header(&b, new_script);
+  int ret = a.length == b.length && memcmp(a.data, b.data, a.length) == 0;
+  recover_pop(&cleanup_b);
+  sink_close(&b);
+  recover_pop(&cleanup_a);
+  sink_close(&a);
+  return ret;
+}
+
+// type declarations, global and instance variables and prototypes
+static int diff_declarations(struct sink *out, struct class_group *old_group, struct class_group *new_group){
+  struct sink a, b;
+  struct recover_cleanup cleanup_a, cleanup_b;
+  sink_open_memory(&a);
+  recover_push(&cleanup_a, close_sink, &a);
+  sink_open_memory(&b);
+  recover_push(&cleanup_b, close_sink, &b);
+  write_declarations(&a, old_group);
+  write_declarations(&b, new_group);
+  int changed = a.length != b.length || memcmp(a.data, b.data, a.length) != 0;
+  if (changed){
+    sink_puts(out, "  M declarations\n--- declarations\n");
+    sink_write(out, a.data, a.length);
+    sink_puts(out, "+++ declarations\n");
+    sink_write(out, b.data, b.length);
+  }
+  recover_pop(&cleanup_b);
+  sink_close(&b);
+  recover_pop(&cleanup_a);
+  sink_close(&a);
+  return changed;
+}
+
+static void write_source(struct sink *out, const char *marker, struct class_group *group, struct script_ref *ref){
+  sink_printf(out, "%s %s.%s\n", marker, ref->type->name, ref->script->name);
+  write_script(out, group, ref->type->class_definition, ref->script);
+}
+
+static void diff_groups(void *context){
+  struct diff_entry *item = context;
+  struct class_group *old_group = class_parse(item->old_entry);
+  struct class_group *new_group = class_parse(item->new_entry);
+  collect_scripts(old_group, &item->old_scripts);
+  collect_scripts(new_group, &item->new_scripts);
+
+  sink_printf(&item->out, "M %s\n", item->new_entry->name);
+  int changes = diff_declarations(&item->out, old_group, new_group);
+  struct script_ref *old_ref = item->old_scripts.refs, *old_end = old_ref + item->old_scripts.count;
+  struct script_ref *new_ref = item->new_scripts.refs, *new_end = new_ref + item->new_scripts.count;
+  while(old_ref < old_end || new_ref < new_end){
+    int cmp = old_ref == old_end ? 1 : new_ref == new_end ? -1 : script_compare(old_ref, new_ref);
+    if (cmp < 0){
+      sink_printf(&item->out, "  D %s.%s\n", old_ref->type->name, old_ref->script->name);
+      changes++;
+      old_ref++;
+    }else if (cmp > 0){
+      sink_printf(&item->out, "  A %s.%s\n", new_ref->type->name, new_ref->script->name);
+      write_source(&item->out, "+++", new_group, new_ref);
+      changes++;
+      new_ref++;
+    }else{
+      // only changed scripts are decompiled
+      if (class_script_hash(old_ref->script) != class_script_hash(new_ref->script)
+	|| !same_header(old_ref->script, new_ref->script)){
+	sink_printf(&item->out, "  M %s.%s\n", new_ref->type->name, new_ref->script->name);
+	write_source(&item->out, "---", old_group, old_ref);
+	write_source(&item->out, "+++", new_group, new_ref);
+	changes++;
+      }
+      old_ref++;
+      new_ref++;
+    }
+  }
+  // eg only debug line numbers moved
+  if (!changes)
+    sink_puts(&item->out, "  compiled code changed, the source is the same\n");
+  class_free(old_group);
+  class_free(new_group);
+}
+
+static void diff_work(unsigned index, void *context){
+  struct diff *diff = context;
+  struct diff_entry *item = &diff->entries[index];
+  sink_open_memory(&item->out);
+  if (!item->old_entry || !item->new_entry)
+    return;
+  if (item->old_entry->length == item->new_entry->length
+    && lib_entry_hash(item->old_entry) == lib_entry_hash(item->new_entry)){
+    item->identical = 1;
+    return;
+  }
+  if (class_is_compiled_entry(item->new_entry->name)){
+    item->failed = recover_run(diff_groups, item, item->error, sizeof item->error) != 0;
+    // drop anything written before the failure
+    if (item->failed)
+      item->out.length = 0;
+  }else{
+    sink_printf(&item->out, "M %s\n", item->new_entry->name);
+  }
+  free(item->old_scripts.refs);
+  free(item->new_scripts.refs);
+}
+
+static void diff_deliver(unsigned index, void *context){
+  struct diff *diff = context;
+  struct diff_entry *item = &diff->entries[index];
+  if (!item->old_entry){
+    sink_printf(diff->out, "A %s\n", item->new_entry->name);
+    diff->added++;
+  }else if (!item->new_entry){
+    sink_printf(diff->out, "D %s\n", item->old_entry->name);
+    diff->removed++;
+  }else if (item->failed){
+    sink_printf(diff->out, "M %s: %s\n", item->new_entry->name, item->error);
+    diff->modified++;
+    diff->failed++;
+  }else if (!item->identical){
+    sink_write(diff->out, item->out.data, item->out.length);
+    diff->modified++;
+  }
+  sink_close(&item->out);
+}
+
+static void enumerate_sorted(struct library *lib, struct entry_list *list){
+  lib_enumerate(lib, entry_list_add, list);
+  if (list->count)
+    qsort(list->entries, list->count, sizeof(struct lib_entry *), entry_compare);
+}
+
+int diff_libraries(const char *old_filename, const char *new_filename, unsigned thread_count){
+  struct library *old_lib = lib_open(old_filename);
+  if (!old_lib){
+    fprintf(stderr, "Failed to open %s\n", old_filename);
+    return 2;
+  }
+  struct library *new_lib = lib_open(new_filename);
+  if (!new_lib){
+    fprintf(stderr, "Failed to open %s\n", new_filename);
+    lib_close(old_lib);
+    return 2;
+  }
+
+  struct entry_list old_list = {0}, new_list = {0};
+  enumerate_sorted(old_lib, &old_list);
+  enumerate_sorted(new_lib, &new_list);
+
+  // pair up the entries of both libraries by name
+  struct diff diff = {
+    .entries = calloc(old_list.count + new_list.count + 1, sizeof(struct diff_entry)),
+  };
+  assert(diff.entries);
+  unsigned i = 0, j = 0;
+  while(i < old_list.count || j < new_list.count){
+    struct diff_entry *item = &diff.entries[diff.count++];
+    int cmp = i == old_list.count ? 1 : j == new_list.count ? -1 : entry_compare(&old_list.entries[i], &new_list.entries[j]);
+    if (cmp <= 0)
+      item->old_entry = old_list.entries[i++];
+    if (cmp >= 0)
+      item->new_entry = new_list.entries[j++];
+  }
+
+  struct sink out;
+  fflush(stdout);
+  sink_open_fd(&out, STDOUT_FILENO);
+  diff.out = &out;
+  workers_run(thread_count ? thread_count : workers_default_count(), diff.count, diff_work, diff_deliver, &diff);
+  sink_close(&out);
+
+  fprintf(stderr, "%u entries added, %u removed, %u modified, %u identical\n",
+    diff.added, diff.removed, diff.modified, diff.count - diff.added - diff.removed - diff.modified);
+
+  free(diff.entries);
+  free(old_list.entries);
+  free(new_list.entries);
+  lib_close(old_lib);
+  lib_close(new_lib);
+  if (diff.failed)
+    return 2;
+  return diff.added || diff.removed || diff.modified ? 1 : 0;
+}
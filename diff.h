@@ -0,0 +1,20 @@
+
+#ifndef diff_header
+#define diff_header
+
+/* A structural diff of two versions of a library.
+ * Entries are matched by name and skipped when their hashes are the same.
+ * Compiled entries that differ are parsed, and their scripts are compared by the hash of their pcode and resources,
+ * only added and modified scripts are decompiled.
+ *
+ * Each line starts with A(dded), D(eleted) or M(odified), entries first, then the scripts within them;
+ * A n_new.udo
+ * M n_object.udo
+ *   M n_object.of_method
+ * Scripts are followed by their source, after "--- class.script" for the old version and "+++ class.script" for the new.
+ */
+
+// like diff(1), returns 0 if the libraries are the same, 1 if they differ, 2 if something failed
+int diff_libraries(const char *old_filename, const char *new_filename, unsigned thread_count);
+
+#endif
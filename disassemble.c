@@ -5,6 +5,8 @@
 #include "disassembly.h"
 #include "debug.h"
 #include "pool_alloc.h"
+#include "cfg.h"
+#include "sink.h"
 
 /* Outline of the disassembly process;
  *
@@ -15,6 +17,9 @@
  * - identify the start and end of each "statement", based on when the stack is empty
  *   (or perhaps by knowing which instructions are supposed to end a statement)
  *
+ * - when a branch could close a loop, group statements into basic blocks and compute dominators,
+ *   so only real back edges are treated as loops (cfg.c)
+ *
  * - identify control flow that has an unambiguous source code representation (if then, do until, loop (while|until), try, ... )
  *
  * - attempt to classify ambiguous control flow (for, do while, else, elseif, continue, exit, ...)
@@ -32,22 +37,49 @@ static const char *endchoose_label = "end choose";
 static const char *finally_label = "finally";
 static const char *do_label = "do";
 
-static void dump_pcode_inst(FILE *fd, struct instruction *inst);
-static void printf_instruction(FILE *fd, struct disassembly *disassembly, struct instruction *inst, uint8_t precedence);
+static void dump_pcode_inst(FILE *fd, struct disassembly *disassembly, struct instruction *inst);
+static void printf_instruction(struct sink *out, struct disassembly *disassembly, struct instruction *inst, uint8_t precedence);
+
+// operand i of an instruction, or NULL if the stack was empty
+static struct instruction *operand(struct disassembly *disassembly, const struct instruction *inst, unsigned i){
+  assert(i < inst->stack_count);
+  uint32_t index = disassembly->operands[inst->stack + i];
+  return index == NO_INSTRUCTION ? NULL : &disassembly->instructions[index];
+}
+
+// reserve count operands for this instruction, in the shared operand array
+static uint32_t *alloc_operands(struct disassembly *disassembly, struct instruction *inst, unsigned count){
+  if (disassembly->operand_count + count > disassembly->operand_allocated){
+    unsigned allocated = disassembly->operand_allocated * 2;
+    if (allocated < disassembly->operand_count + count)
+      allocated = disassembly->operand_count + count;
+    uint32_t *operands = pool_alloc_array(disassembly->pool, uint32_t, allocated);
+    if (disassembly->operand_count)
+      memcpy(operands, disassembly->operands, disassembly->operand_count * sizeof(uint32_t));
+    disassembly->operands = operands;
+    disassembly->operand_allocated = allocated;
+  }
+  inst->stack = disassembly->operand_count;
+  inst->stack_count = count;
+  disassembly->operand_count += count;
+  return &disassembly->operands[inst->stack];
+}
 
 #define PUSH(X) stack[(*stack_ptr)++]=X
-#define POP() (*stack_ptr>0 ? stack[--(*stack_ptr)] : NULL)
-#define PEEK(I) (*stack_ptr>(I) ? stack[(*stack_ptr) - (I) -1] : NULL)
+#define POP() (*stack_ptr>0 ? stack[--(*stack_ptr)] : NO_INSTRUCTION)
+#define PEEK(I) (*stack_ptr>(I) ? stack[(*stack_ptr) - (I) -1] : NO_INSTRUCTION)
 #define POKE(I,V) if (*stack_ptr>(I)) stack[(*stack_ptr) - (I) -1] = (V)
 // emulate the impact each instruction has on the stack
 // to discover how each input value is calculated
-static void init_stack(struct pool *pool, struct instruction *inst, struct instruction **stack, unsigned *stack_ptr){
+static void init_stack(struct disassembly *disassembly, struct instruction *inst, uint32_t *stack, unsigned *stack_ptr){
   inst->stack_count = 0;
-  inst->stack = NULL;
+  inst->stack = 0;
 
   unsigned i;
   unsigned stack_arg = inst->definition->stack_arg;
-  struct instruction *push_me = inst;
+  uint32_t self = inst - disassembly->instructions;
+  uint32_t push_me = self;
+  uint32_t *operands;
 
   switch(inst->definition->stack_kind){
     case stack_unknown:
@@ -70,50 +102,43 @@ stack_result_indirect:
       // fallthrough
     case stack_result:
 stack_result:
-      inst->stack_count = stack_arg;
       if (stack_arg){
-	inst->stack = pool_alloc_array(pool, struct instruction*, stack_arg);
+	operands = alloc_operands(disassembly, inst, stack_arg);
 	for (i=0;i<stack_arg;i++)
-	  inst->stack[i]=POP();
+	  operands[i]=POP();
       }
-      if (push_me)
+      if (push_me != NO_INSTRUCTION)
 	PUSH(push_me);
       break;
 
     // pop stack_arg arguments with no result
     case stack_action_indirect:
-      push_me = NULL;
+      push_me = NO_INSTRUCTION;
       goto stack_result_indirect;
     case stack_action:
-      push_me = NULL;
+      push_me = NO_INSTRUCTION;
       goto stack_result;
 
     // convert / free the value at this stack offset
     case stack_tweak_indirect:
       stack_arg = inst->args[stack_arg];
-      inst->stack = pool_alloc_type(pool, struct instruction*);
-      inst->stack_count = 1;
-      inst->stack[0] = PEEK(stack_arg -1);
-      POKE(stack_arg -1, inst);
+      alloc_operands(disassembly, inst, 1)[0] = PEEK(stack_arg -1);
+      POKE(stack_arg -1, self);
       break;
     case stack_tweak_indirect1:
       stack_arg = inst->args[stack_arg]+1;
-      inst->stack = pool_alloc_type(pool, struct instruction*);
-      inst->stack_count = 1;
-      inst->stack[0] = PEEK(stack_arg -1);
-      POKE(stack_arg -1, inst);
+      alloc_operands(disassembly, inst, 1)[0] = PEEK(stack_arg -1);
+      POKE(stack_arg -1, self);
       break;
 
     // duplicate the LHS of an expression, to reuse it on the RHS. eg string +=
     case stack_clone_indirect:
       stack_arg = inst->args[stack_arg];
-      inst->stack = pool_alloc_type(pool, struct instruction*);
-      inst->stack[0] = PEEK(stack_arg -1);
-      inst->stack_count = 1;
+      alloc_operands(disassembly, inst, 1)[0] = PEEK(stack_arg -1);
       {
 	// is this close enough?
-	struct instruction *tmp = POP();
-	PUSH(inst);
+	uint32_t tmp = POP();
+	PUSH(self);
 	PUSH(tmp);
       }
       break;
@@ -123,35 +148,32 @@ stack_result:
     case stack_peek_result_indirect:
       stack_arg = inst->args[stack_arg];
     case stack_peek_result:
-      inst->stack_count = stack_arg;
       if (stack_arg){
-	inst->stack = pool_alloc_array(pool, struct instruction*, stack_arg);
+	operands = alloc_operands(disassembly, inst, stack_arg);
 	for (i=0;i<stack_arg;i++)
-	  inst->stack[i]=PEEK(i);
+	  operands[i]=PEEK(i);
       }
-      PUSH(inst);
+      PUSH(self);
       break;
 
     // an object reference was pushed onto the stack before the argument list
     case stack_dotcall:
       stack_arg = inst->args[stack_arg];
-      inst->stack = pool_alloc_array(pool, struct instruction*, stack_arg + 1);
-      inst->stack_count = stack_arg+1;
-      inst->stack[0] = PEEK(stack_arg);
+      operands = alloc_operands(disassembly, inst, stack_arg + 1);
+      operands[0] = PEEK(stack_arg);
       for (i=0;i<stack_arg;i++)
-	inst->stack[i+1]=PEEK(i);
-      PUSH(inst);
+	operands[i+1]=PEEK(i);
+      PUSH(self);
       break;
 
     // class & function information was pushed onto the stack last
     case stack_classcall:
       stack_arg = inst->args[stack_arg];
-      inst->stack = pool_alloc_array(pool, struct instruction*, stack_arg + 1);
-      inst->stack_count = stack_arg+1;
-      inst->stack[0] = POP();
+      operands = alloc_operands(disassembly, inst, stack_arg + 1);
+      operands[0] = POP();
       for (i=0;i<stack_arg;i++)
-	inst->stack[i+1]=PEEK(i);
-      PUSH(inst);
+	operands[i+1]=PEEK(i);
+      PUSH(self);
       break;
   }
 }
@@ -247,6 +269,14 @@ static struct scope *insert_scope(struct disassembly *disassembly,
   return scope;
 }
 
+// the first statement of the innermost loop containing this one, or NULL.
+// the graph is only built for scripts with a branch that could close a loop
+static struct statement *loop_header(struct disassembly *disassembly, struct statement *statement){
+  if (!disassembly->cfg)
+    disassembly->cfg = cfg_build(disassembly);
+  return cfg_loop_header(disassembly->cfg, statement);
+}
+
 // a forwards jumpfalse might be for_next, do_while or just if_then
 static void classify_if_then(struct disassembly *disassembly, unsigned statement_number)
 {
@@ -255,7 +285,8 @@ static void classify_if_then(struct disassembly *disassembly, unsigned statement
     return;
 
   // do ... loop (while|until), the conditional branch jumps back to the start
-  if (if_test->branch->start_offset < if_test->start_offset){
+  if (if_test->branch->start_offset <= if_test->start_offset
+    && loop_header(disassembly, if_test) == if_test->branch){
     DEBUGF(DISASSEMBLY, "Inserting scope for do ... loop (while|until)");
     struct scope *scope = insert_scope(disassembly, if_test->branch, if_test->branch, if_test->prev, if_test);
     if (scope){
@@ -278,7 +309,8 @@ static void classify_if_then(struct disassembly *disassembly, unsigned statement
     && prior && prior->type == jump_goto){
 
     unsigned dest_offset = prior->end->args[0];
-    if (dest_offset == if_test->start->offset){
+    if (dest_offset == if_test->start->offset
+      && loop_header(disassembly, prior) == if_test){
       if (if_test->type == jump_false)
 	if_test->type = do_while;
       else
@@ -319,6 +351,7 @@ static void classify_if_then(struct disassembly *disassembly, unsigned statement
       && dest_offset == (step = disassembly->statements[statement_number -1])->start->offset
       && (jmp = disassembly->statements[statement_number -2])->type == jump_goto
       && jmp->end->args[0] == if_test->start->offset
+      && loop_header(disassembly, prior) == if_test
       // with a C style for loop, this would be enough. For PB's basic style we should be more explicit;
       // && statement_number -3 == SM_ASSIGN_[TYPE]
       // && statement_number -1 == SM_INCR_[TYPE] || SM_ADDASSIGN_[TYPE]
@@ -382,7 +415,7 @@ static void classify_if_then(struct disassembly *disassembly, unsigned statement
     const char *end_label = endif_label;
     if_test->type = if_then;
 
-    if (if_test->end->stack[0]->definition->id == SM_CATCH_EXCEPTION_0){
+    if (operand(disassembly, if_test->end, 0)->definition->id == SM_CATCH_EXCEPTION_0){
       if_test->type = exception_catch;
       end_label = NULL;
       if (if_test->branch->end->definition->id == SM_GOSUB_1)
@@ -398,8 +431,38 @@ static void classify_if_then(struct disassembly *disassembly, unsigned statement
   }
 }
 
+struct statement *statement_at(struct disassembly *disassembly, unsigned offset){
+  if (offset & 1 || offset/2 >= disassembly->statement_index_size)
+    return NULL;
+  return disassembly->statement_index[offset/2];
+}
+
+// statement indexes of the unconditional jumps to each offset / 2, chained through next[] and ending with ~0u
+struct jump_chains{
+  unsigned *first;
+  unsigned *next;
+};
+
+static void jump_chains_build(struct disassembly *disassembly, struct jump_chains *chains){
+  unsigned i;
+  chains->first = pool_alloc_array(disassembly->pool, unsigned, disassembly->statement_index_size);
+  chains->next = pool_alloc_array(disassembly->pool, unsigned, disassembly->statement_count);
+  memset(chains->first, 0xFF, disassembly->statement_index_size * sizeof(unsigned));
+  // backwards, so each chain is in statement order
+  for (i=disassembly->statement_count;i>0;i--){
+    struct instruction *end = disassembly->statements[i-1]->end;
+    chains->next[i-1] = ~0u;
+    if (end->definition->id != SM_JUMP_1 || end->args[0] & 1 || end->args[0]/2 >= disassembly->statement_index_size)
+      continue;
+    chains->next[i-1] = chains->first[end->args[0]/2];
+    chains->first[end->args[0]/2] = i-1;
+  }
+}
+
 static void link_destinations(struct disassembly *disassembly){
   unsigned i;
+  // only built if there is a try block
+  struct jump_chains chains = {NULL, NULL};
   // find the destination of each jump
   fflush(stdout);
   for (i=0;i<disassembly->statement_count;i++){
@@ -409,21 +472,18 @@ static void link_destinations(struct disassembly *disassembly){
 	DEBUGF(DISASSEMBLY, "Try?");
 	unsigned catch_offset = ptr->end->args[0];
 	unsigned end_offset = ptr->end->args[1];
-	struct statement *catch_block=NULL, *end=NULL;
+	struct statement *catch_block = statement_at(disassembly, catch_offset);
+	struct statement *end = statement_at(disassembly, end_offset);
 	struct statement *finally=NULL, *end_finally=NULL;
 	unsigned j;
 
-	// TODO binary search?
-	for (j=i+1;j<disassembly->statement_count;j++){
-	  if (disassembly->statements[j]->start_offset == catch_offset){
-	    catch_block = disassembly->statements[j];
-	  }
-	  if (disassembly->statements[j]->start_offset == end_offset){
-	    end = disassembly->statements[j];
-	  }
-	  if (disassembly->statements[j]->end->definition->id == SM_JUMP_1
-	   && disassembly->statements[j]->end->args[0] == end_offset)
-	     disassembly->statements[j]->type = generated;
+	// every jump to the end of the try, after it, is part of the try statement
+	if (!chains.first)
+	  jump_chains_build(disassembly, &chains);
+	if (!(end_offset & 1) && end_offset/2 < disassembly->statement_index_size){
+	  for (j=chains.first[end_offset/2]; j != ~0u; j=chains.next[j])
+	    if (j > i)
+	      disassembly->statements[j]->type = generated;
 	}
 	assert(catch_block && end);
 	struct statement *try_end = catch_block->prev;
@@ -431,16 +491,14 @@ static void link_destinations(struct disassembly *disassembly){
 	if (end->end->definition->id == SM_GOSUB_1){
 	  DEBUGF(DISASSEMBLY, "has finally?");
 	  unsigned finally_offset = end->end->args[0];
-	  for (j=i+1;j<disassembly->statement_count;j++){
-	    if (disassembly->statements[j]->start->offset == finally_offset){
-	      finally = disassembly->statements[j];
-	      end_finally = end->prev;
-
-	      if (finally_offset < catch_offset)
-		try_end = finally->prev;
-	      break;
-	    }
-	  }
+	  finally = statement_at(disassembly, finally_offset);
+	  if (finally && finally->start_offset > ptr->start_offset){
+	    end_finally = end->prev;
+
+	    if (finally_offset < catch_offset)
+	      try_end = finally->prev;
+	  }else
+	    finally = NULL;
 	  end->type = exception_gosub;
 	  end = end->next;
 	}
@@ -481,16 +539,10 @@ static void link_destinations(struct disassembly *disassembly){
 find_dest:
       {
 	unsigned dest_offset = ptr->end->args[0];
-	unsigned j;
-	// TODO binary search?
-	for (j=0;j<disassembly->statement_count;j++){
-	  if (disassembly->statements[j]->start->offset == dest_offset){
-	    ptr->branch = disassembly->statements[j];
-	    ptr->branch->destination_count++;
-	    break;
-	  }
-	}
-	if (!ptr->branch){
+	ptr->branch = statement_at(disassembly, dest_offset);
+	if (ptr->branch)
+	  ptr->branch->destination_count++;
+	else{
 	  DEBUGF(DISASSEMBLY, "Branch dest %04x is not the start of a statement (for %s @%04x)", dest_offset, ptr->end->definition->name, ptr->end->offset);
 	  continue;
 	}
@@ -671,26 +723,13 @@ struct disassembly *disassemble(struct class_group *group, struct class_definiti
   if (!script_def || !script_def->body || !script_def->body->code)
     return NULL;
 
-  struct pcode_def **opcodes = NULL;
-  unsigned max_opcode = 0;
+  pcode_steps_init();
 
-  {
-    struct class_group_private *group_def = (struct class_group_private *)group;
-    switch (group_def->header.compiler_version){
-#define CODE(X) case X: opcodes = X ## _opcodes; max_opcode = X ## _maxcode; break
-      CODE(PB50);
-      CODE(PB80);
-      CODE(PB90);
-      CODE(PB100);
-      CODE(PB105);
-      CODE(PB120);
-      default:
-      CODE(PB150);
-#undef CODE
-    }
-
-    if (!opcodes)
-      return NULL;
+  struct class_group_private *group_def = (struct class_group_private *)group;
+  const struct opcode_table *opcodes = __atomic_load_n(&group_def->opcodes, __ATOMIC_ACQUIRE);
+  if (!opcodes){
+    opcodes = opcode_table(group_def->header.compiler_version);
+    __atomic_store_n(&group_def->opcodes, opcodes, __ATOMIC_RELEASE);
   }
 
   struct pool *pool = pool_create();
@@ -703,41 +742,46 @@ struct disassembly *disassemble(struct class_group *group, struct class_definiti
   disassembly->script = script;
 
   unsigned offset=0;
+  unsigned instruction_count=0;
+
+  // count instructions first, so they can live in one array
+  while(offset < script_def->body->code_size){
+    uint16_t opcode = *(const uint16_t*)&script_def->body->code[offset];
+    assert(opcode < opcodes->count);
+    offset += (1+pcode_defs[opcodes->ids[opcode]]->args)*2;
+    instruction_count++;
+  }
+  disassembly->instructions = pool_alloc_array(pool, struct instruction, instruction_count);
+  // most instructions have one operand
+  disassembly->operand_allocated = instruction_count;
+  disassembly->operands = pool_alloc_array(pool, uint32_t, instruction_count);
+
 #define MAX_STACK 128
-  struct instruction *stack[MAX_STACK];
+  uint32_t stack[MAX_STACK];
   unsigned stack_ptr=0;
 
   struct statement *first_statement = NULL, *prev_statement = NULL, *statement = NULL;
   unsigned debug_line=0;
 
-  unsigned instruction_count=0;
-  // temp space on the stack, can't be more than this; will usually be much less.
-  struct instruction *instructions[script_def->body->code_size/2];
-
-  while(offset < script_def->body->code_size){
+  offset=0;
+  for (instruction_count=0; offset < script_def->body->code_size; instruction_count++){
 
     if (debug_line+1 < script_def->body->debugline_count
       && offset >= script_def->body->debug_lines[debug_line+1].pcode_offset)
       debug_line++;
 
     const uint16_t *pc = (const uint16_t*)&script_def->body->code[offset];
-    uint16_t opcode = pc[0];
 
-    assert(opcode < max_opcode);
-
-    struct instruction *inst = instructions[instruction_count++] = pool_alloc_type(pool, struct instruction);
-    memset(inst, 0, sizeof(struct instruction));
+    struct instruction *inst = &disassembly->instructions[instruction_count];
     inst->offset = offset;
-    inst->opcode = opcode;
-    inst->definition = opcodes[opcode];
-    assert(inst->definition);
-
+    inst->opcode = pc[0];
+    inst->definition = pcode_defs[opcodes->ids[inst->opcode]];
     inst->args = pc+1;
     inst->line_number = script_def->body->debug_lines[debug_line].line_number;
 
     offset += (1+inst->definition->args)*2;
 
-    init_stack(pool, inst, stack, &stack_ptr);
+    init_stack(disassembly, inst, stack, &stack_ptr);
 
     if (!statement){
       disassembly->statement_count++;
@@ -806,10 +850,10 @@ struct disassembly *disassemble(struct class_group *group, struct class_definiti
 	case SM_ASSIGN_STRING_1:{
 	  struct instruction *cat;
 	  if (inst->stack_count == 2
-	    && ((cat = inst->stack[0])->definition->id == SM_CAT_STRING_0
+	    && ((cat = operand(disassembly, inst, 0))->definition->id == SM_CAT_STRING_0
 	      || cat->definition->id == SM_CAT_BINARY_0)
 	    && cat->stack_count == 2
-	    && cat->stack[1]->definition->id == SM_DUP_STACKED_LVALUE_1
+	    && operand(disassembly, cat, 1)->definition->id == SM_DUP_STACKED_LVALUE_1
 	    )
 	    statement->type=mem_append;
 	}break;
@@ -825,10 +869,13 @@ struct disassembly *disassemble(struct class_group *group, struct class_definiti
 
     if (IFDEBUG(DISASSEMBLY)){
       fflush(stdout);
-      dump_pcode_inst(stderr, inst);
-      fprintf(stderr," [");
-      printf_instruction(stderr, disassembly, inst, 0);
-      fprintf(stderr,"]\n");
+      dump_pcode_inst(stderr, disassembly, inst);
+      struct sink err;
+      sink_open_fd(&err, STDERR_FILENO);
+      sink_puts(&err, " [");
+      printf_instruction(&err, disassembly, inst, 0);
+      sink_puts(&err, "]\n");
+      sink_close(&err);
     }
   }
 
@@ -838,9 +885,6 @@ struct disassembly *disassemble(struct class_group *group, struct class_definiti
   }
 
   disassembly->instruction_count = instruction_count;
-  disassembly->instructions = pool_alloc_array(pool, struct instruction *, instruction_count+1);
-  memcpy(disassembly->instructions, instructions, instruction_count * sizeof(struct instruction *));
-  disassembly->instructions[instruction_count]=NULL;
 
   // do we really want to fix this now? or insert goto destination, "do" & "end if" labels first?
   disassembly->statements = pool_alloc_array(pool, struct statement*, disassembly->statement_count+1);
@@ -855,6 +899,13 @@ struct disassembly *disassemble(struct class_group *group, struct class_definiti
     assert(!ptr);
 
     disassembly->statements[disassembly->statement_count]=NULL;
+
+    // index statements by start offset, so branches resolve without searching
+    disassembly->statement_index_size = script_def->body->code_size/2;
+    disassembly->statement_index = pool_alloc_array(pool, struct statement *, disassembly->statement_index_size);
+    memset(disassembly->statement_index, 0, disassembly->statement_index_size * sizeof(struct statement *));
+    for (i=0;i<disassembly->statement_count;i++)
+      disassembly->statement_index[disassembly->statements[i]->start_offset/2] = disassembly->statements[i];
     if (disassembly->statement_count){
       // pre 10.5, there's always an extra return at the end.
       // post 10.5, the code always sets the return value and jumps to the end
@@ -869,7 +920,7 @@ struct disassembly *disassemble(struct class_group *group, struct class_definiti
   return disassembly;
 }
 
-static void dump_pcode_inst(FILE *fd, struct instruction *inst){
+static void dump_pcode_inst(FILE *fd, struct disassembly *disassembly, struct instruction *inst){
   fprintf(fd, "%04x: %04x ", inst->offset, inst->opcode);
   unsigned arg;
   for(arg = 0; arg < inst->definition->args; arg++)
@@ -881,8 +932,9 @@ static void dump_pcode_inst(FILE *fd, struct instruction *inst){
   for (arg=0; arg < inst->stack_count; arg++){
     if (arg>0)
       fprintf(fd, ", ");
-    if (inst->stack && inst->stack[arg])
-      fprintf(fd, "%04x %s [%u]", inst->stack[arg]->offset, inst->stack[arg]->definition->name, inst->stack[arg]->definition->precedence);
+    struct instruction *op = operand(disassembly, inst, arg);
+    if (op)
+      fprintf(fd, "%04x %s [%u]", op->offset, op->definition->name, op->definition->precedence);
     else
       fprintf(fd, "NULL");
   }
@@ -896,14 +948,13 @@ static void dump_pcode_inst(FILE *fd, struct instruction *inst){
 void dump_pcode(FILE *fd, struct disassembly *disassembly){
   unsigned i;
   for(i=0;i<disassembly->instruction_count;i++){
-    struct instruction *inst = disassembly->instructions[i];
-    dump_pcode_inst(fd, inst);
+    dump_pcode_inst(fd, disassembly, &disassembly->instructions[i]);
     fprintf(fd, "\n");
   }
 }
 
 /*
-static void dump_instruction(FILE *fd, struct instruction *inst){
+static void dump_instruction(FILE *fd, struct disassembly *disassembly, struct instruction *inst){
   if (!inst){
     fprintf(fd, "***NULL***");
     return;
@@ -914,145 +965,149 @@ static void dump_instruction(FILE *fd, struct instruction *inst){
   for (i=0; i < inst->stack_count; i++){
     if (i>0)
       fprintf(fd, ", ");
-    dump_instruction(fd, inst->stack[i]);
+    dump_instruction(fd, disassembly, operand(disassembly, inst, i));
   }
   fprintf(fd, ")");
 }
 */
 
-static void printf_instruction(FILE *fd, struct disassembly *disassembly, struct instruction *inst, uint8_t precedence){
+static void printf_instruction(struct sink *out, struct disassembly *disassembly, struct instruction *inst, uint8_t precedence){
   if (!inst){
-    fprintf(fd, "***NULL***");
+    sink_puts(out, "***NULL***");
     return;
   }
   unsigned i;
-  const char **tokens=inst->definition->tokens;
+  const struct emit_step *step = inst->definition->steps;
+  const struct emit_step *last = step + inst->definition->step_count;
   struct class_group_private *group = (struct class_group_private *)disassembly->group;
   //struct class_def_private *class_def = (struct class_def_private *)disassembly->class_def;
   struct script_def_private *script = (struct script_def_private *)disassembly->script;
 
   uint8_t this_precedence = inst->definition->precedence;
 
-  if (!*tokens){
-    fputs(inst->definition->name, fd);
+  if (!inst->definition->step_count){
+    sink_puts(out, inst->definition->name);
     if (inst->definition->args){
-      fputc('[', fd);
+      sink_putc(out, '[');
       for (i=0; i < inst->definition->args; i++){
 	if (i>0)
-	  fputs(", ", fd);
-	fprintf(fd, "%04x", inst->args[i]);
+	  sink_puts(out, ", ");
+	sink_printf(out, "%04x", inst->args[i]);
       }
-      fputc(']', fd);
+      sink_putc(out, ']');
     }
-    fputc('(', fd);
+    sink_putc(out, '(');
     for (i=0; i < inst->stack_count; i++){
       if (i>0)
-	fputs(", ", fd);
-      printf_instruction(fd, disassembly, inst->stack[inst->stack_count - i - 1], this_precedence);
+	sink_puts(out, ", ");
+      printf_instruction(out, disassembly, operand(disassembly, inst, inst->stack_count - i - 1), this_precedence);
     }
-    fputc(')', fd);
+    sink_putc(out, ')');
     if (inst->end)
-      fputc(';', fd);
+      sink_putc(out, ';');
     return;
   }
 
   if (precedence && precedence < this_precedence)
-    fputs("(", fd);
+    sink_putc(out, '(');
+
+  for(;step < last;step++){
+    switch(step->kind){
+      case TEXT:
+	sink_write(out, step->text, step->length);
+	break;
 
-  while(*tokens){
-    //fprintf(fd, "\n%s %p %u\n", inst->definition->name, *tokens, inst->stack_count);
-    switch((enum token_types)(*tokens)){
       case STACK:{
-	i=(int)(*(++tokens));
+	i = step->index;
 	assert(i<inst->stack_count);
 	uint8_t p = this_precedence;
 	// decrement precendence to detect left to right rule violation, eg a - (b + c)
 	if (p && inst->stack_count==2 && i==0)
 	  p--;
-	printf_instruction(fd, disassembly, inst->stack[i], p);
+	printf_instruction(out, disassembly, operand(disassembly, inst, i), p);
 	break;
       }
 
       case STACK_CSV:
 	for (i=0; i < inst->stack_count; i++){
 	  if (i>0)
-	    fputs(", ", fd);
-	  printf_instruction(fd, disassembly, inst->stack[inst->stack_count - i - 1], this_precedence);
+	    sink_puts(out, ", ");
+	  printf_instruction(out, disassembly, operand(disassembly, inst, inst->stack_count - i - 1), this_precedence);
 	}
 	break;
 
       case STACK_DOT_CSV:
 	for (i=1; i < inst->stack_count; i++){
 	  if (i>1)
-	    fputs(", ", fd);
-	  printf_instruction(fd, disassembly, inst->stack[inst->stack_count - i], this_precedence);
+	    sink_puts(out, ", ");
+	  printf_instruction(out, disassembly, operand(disassembly, inst, inst->stack_count - i), this_precedence);
 	}
 	break;
 
       case LOCAL:{
-	i = (int)(*(++tokens));
+	i = step->index;
 	assert(i < inst->definition->args);
 	unsigned var = inst->args[i];
 	assert(var<disassembly->script->local_variable_count);
-	fputs(disassembly->script->local_variables[var]->name, fd);
+	sink_puts(out, disassembly->script->local_variables[var]->name);
       }break;
 
       case SHARED:
-	i = (int)(*(++tokens));
+	i = step->index;
 	assert(i < inst->definition->args);
 	i = inst->args[i];
 	assert(i<disassembly->group->global_variable_count);
-	fputs(disassembly->group->global_variables[i]->name, fd);
+	sink_puts(out, disassembly->group->global_variables[i]->name);
 	break;
 
       case EXT:{
-	i = (int)(*(++tokens));
+	i = step->index;
 	assert(i < inst->definition->args);
 	i = inst->args[i];
 	struct class_group_private *group = (struct class_group_private *)disassembly->group;
 	assert(i<group->ext_ref_count);
-	fputs(group->ref_names[i], fd);
+	sink_puts(out, group->ref_names[i]);
       }break;
 
       case TYPE:{
-	i = (int)(*(++tokens));
+	i = step->index;
 	assert(i < inst->definition->args);
 	uint16_t type = inst->args[i];
-	fputs(get_type_name(group, type), fd);
+	sink_puts(out, get_type_name(group, type));
       }break;
 
       case ARG_CSV:
 	for (i=0; i < inst->definition->args; i++){
 	  if (i>0)
-	    fputs(", ", fd);
-	  fprintf(fd, "%04x", inst->args[i]);
+	    sink_puts(out, ", ");
+	  sink_printf(out, "%04x", inst->args[i]);
 	}
 	break;
 
       case ARG_BOOL:
-	i = (int)(*(++tokens));
+	i = step->index;
 	assert(i < inst->definition->args);
-	fprintf(fd, "%s", inst->args[i] ? "true" : "false");
+	sink_puts(out, inst->args[i] ? "true" : "false");
 	break;
 
       case GLOBAL:
       case ARG_INT:
-	i = (int)(*(++tokens));
+	i = step->index;
 	assert(i < inst->definition->args);
-	fprintf(fd, "%d", inst->args[i]);
+	sink_printf(out, "%d", inst->args[i]);
 	break;
 
       case ARG_ENUM:
-	i = (int)(*(++tokens));
+	i = step->index;
 	assert(i+1 < inst->definition->args);
-	fprintf(fd, "%04x_%d!", inst->args[i+1], inst->args[i]);
+	sink_printf(out, "%04x_%d!", inst->args[i+1], inst->args[i]);
 	break;
 
       case ARG_CLOSE:
-	i = (int)(*(++tokens));
+	i = step->index;
 	assert(i < inst->definition->args);
 	if (inst->args[i] == 0)
-	  fprintf(fd, " CLOSE");
+	  sink_puts(out, " CLOSE");
 	break;
 
       case OPERATOR:{
@@ -1083,58 +1138,58 @@ static void printf_instruction(FILE *fd, struct disassembly *disassembly, struct
 	  default: break;
 	}
 	assert(op);
-	fputs(op, fd);
+	sink_puts(out, op);
       }break;
 
       case METHOD_FLAGS:{
-	i = (int)(*(++tokens));
+	i = step->index;
 	assert(i < inst->definition->args);
 	uint16_t flags = inst->args[i];
 	if (flags & 1)
-	  fputs("post ", fd);
+	  sink_puts(out, "post ");
 	if (flags & 2)
-	  fputs("dynamic ", fd);
+	  sink_puts(out, "dynamic ");
       }break;
 
       case RES_METHOD:
       // TODO look up system method names if the name offset is zero in the resource
       case RES:{
-	i=(int)(*(++tokens));
+	i = step->index;
 	assert(i+1 < inst->definition->args);
 	const char *value = get_table_resource(group, &script->body->resources, *(const uint32_t*)&inst->args[i]);
 	if (value)
-	  fputs(value, fd);
+	  sink_puts(out, value);
 	else
-	  fputs("**NULL**", fd);
+	  sink_puts(out, "**NULL**");
       }break;
 
       case RES_STRING_CONST:{
-	i=(int)(*(++tokens));
+	i = step->index;
 	assert(i+1 < inst->definition->args);
 	uint32_t offset = *(const uint32_t*)&inst->args[i];
 	const char *str = get_table_string(group, &script->body->resources, offset);
 	assert(str);
 	const char *quoted = quote_escape_string(group, str);
 	assert(quoted);
-	fputs(quoted, fd);
+	sink_puts(out, quoted);
       }break;
       case RES_STRING:{
-	i=(int)(*(++tokens));
+	i = step->index;
 	assert(i+1 < inst->definition->args);
 	uint32_t offset = *(const uint32_t*)&inst->args[i];
-	fputs(get_table_string(group, &script->body->resources, offset), fd);
+	sink_puts(out, get_table_string(group, &script->body->resources, offset));
       }break;
 
       case ARG_LONG_HEX:
-	i=(int)(*(++tokens));
+	i = step->index;
 	assert(i+1 < inst->definition->args);
-	fprintf(fd, "%08x", *(const uint32_t*)&inst->args[i]);
+	sink_printf(out, "%08x", *(const uint32_t*)&inst->args[i]);
 	break;
 
       case ARG_LONG:
-	i=(int)(*(++tokens));
+	i = step->index;
 	assert(i+1 < inst->definition->args);
-	fprintf(fd, "%d", *(const uint32_t*)&inst->args[i]);
+	sink_printf(out, "%d", *(const uint32_t*)&inst->args[i]);
 	break;
 
       case FUNC_CLASS:{
@@ -1144,24 +1199,19 @@ static void printf_instruction(FILE *fd, struct disassembly *disassembly, struct
 	if ((type & 0xC000) == 0x8000){
 	  struct class_def_private *class_def = (struct class_def_private *)disassembly->class_def;
 	  assert(id < class_def->imports.count);
-	  fprintf(fd, "%s", class_def->imports.names[id]);
+	  sink_puts(out, class_def->imports.names[id] ? class_def->imports.names[id] : "(null)");
 	  break;
 	}
-	fprintf(fd, "::%s_%u", get_type_name(group, type), id);
+	sink_printf(out, "::%s_%u", get_type_name(group, type), id);
       }break;
 
-      case END:
-	fputc(';', fd);
-	break;
-
       default:
-	fputs(*tokens, fd);
+	assert(0);
     }
-    tokens++;
   }
 
   if (precedence && precedence < this_precedence)
-    fputs(")", fd);
+    sink_putc(out, ')');
 }
 
 struct print_state{
@@ -1172,30 +1222,30 @@ struct print_state{
   unsigned scope_count;
 };
 
-static void fputeol(FILE *fd, struct print_state *state){
-  fputc('\n', fd);
+static void fputeol(struct sink *out, struct print_state *state){
+  sink_putc(out, '\n');
   state->line++;
 
   //assert(state->indent>=0);
   int i = state->indent;
   while(i-->0)
-    fputs("\t", fd);
+    sink_putc(out, '\t');
 }
 
 // recursive, so we can process the top parent scope first
-static unsigned begin_scope(FILE *fd, struct print_state *state, struct scope *scope){
+static unsigned begin_scope(struct sink *out, struct print_state *state, struct scope *scope){
   if (!scope)
     return 0;
 
-  unsigned i = begin_scope(fd, state, scope->parent);
+  unsigned i = begin_scope(out, state, scope->parent);
   if (i<64)
     state->scopes[i++]=scope;
 
   if (scope->start == state->statement){
     if (scope->begin_label){
       if (state->line < state->statement->start_line_number)
-	fputeol(fd, state);
-      fprintf(fd, "%s;", scope->begin_label);
+	fputeol(out, state);
+      sink_printf(out, "%s;", scope->begin_label);
     }
   }
 
@@ -1204,13 +1254,13 @@ static unsigned begin_scope(FILE *fd, struct print_state *state, struct scope *s
   return i;
 }
 
-void printf_case(FILE *fd, struct disassembly *disassembly, struct instruction *inst){
+void printf_case(struct sink *out, struct disassembly *disassembly, struct instruction *inst){
   const char *op = NULL;
   // TODO range?
 
   switch(inst->definition->operation){
     case OP_EQ:
-      printf_case(fd, disassembly, inst->stack[1]);
+      printf_case(out, disassembly, operand(disassembly, inst, 1));
       return;
 
     // flip the operator then print the lhs
@@ -1220,21 +1270,21 @@ void printf_case(FILE *fd, struct disassembly *disassembly, struct instruction *
     case OP_LE: op="is > "; break;
 
     case OP_OR:
-      printf_case(fd, disassembly, inst->stack[1]);
-      fputs(", ", fd);
-      printf_case(fd, disassembly, inst->stack[0]);
+      printf_case(out, disassembly, operand(disassembly, inst, 1));
+      sink_puts(out, ", ");
+      printf_case(out, disassembly, operand(disassembly, inst, 0));
       return;
 
     case OP_AND:{
-      struct instruction *lhs = inst->stack[1];
-      struct instruction *rhs = inst->stack[0];
+      struct instruction *lhs = operand(disassembly, inst, 1);
+      struct instruction *rhs = operand(disassembly, inst, 0);
       if (lhs->definition->operation == OP_LE
 	&& rhs->definition->operation == OP_GE){
-	lhs = lhs->stack[1];
-	rhs = rhs->stack[1];
-	printf_instruction(fd, disassembly, lhs, 0);
-	fputs(" to ", fd);
-	printf_instruction(fd, disassembly, rhs, 0);
+	lhs = operand(disassembly, lhs, 1);
+	rhs = operand(disassembly, rhs, 1);
+	printf_instruction(out, disassembly, lhs, 0);
+	sink_puts(out, " to ");
+	printf_instruction(out, disassembly, rhs, 0);
 	return;
       }
     }
@@ -1244,100 +1294,113 @@ void printf_case(FILE *fd, struct disassembly *disassembly, struct instruction *
   }
 
   if (op){
-    fputs(op, fd);
-    printf_case(fd, disassembly, inst->stack[1]);
+    sink_puts(out, op);
+    printf_case(out, disassembly, operand(disassembly, inst, 1));
     return;
   }
 
   // fall through...
-  printf_instruction(fd, disassembly, inst, 0);
+  printf_instruction(out, disassembly, inst, 0);
 }
 
-static struct statement * printf_statement(FILE *fd, struct disassembly *disassembly, struct statement *statement){
+static struct statement * printf_statement(struct sink *out, struct disassembly *disassembly, struct statement *statement){
   // special cases, mostly syntactic sugar;
   switch(statement->type){
-    case exception_try:      fputs("try;", fd); break;
-    case exception_end_try:  fputs("end try;", fd); break;
-    case jump_loop:          fputs("loop;", fd); break;
-    case jump_next:          fputs("next;", fd); break;
-    case jump_exit:          fputs("exit;", fd); break;
-    case jump_continue:      fputs("continue;", fd); break;
-    case jump_else:          fputs("else;", fd); break;
-    case jump_elseif:        fputs("else", fd); break;
-    case case_else:          fputs("case else;", fd); break;
+    case exception_try:      sink_puts(out, "try;"); break;
+    case exception_end_try:  sink_puts(out, "end try;"); break;
+    case jump_loop:          sink_puts(out, "loop;"); break;
+    case jump_next:          sink_puts(out, "next;"); break;
+    case jump_exit:          sink_puts(out, "exit;"); break;
+    case jump_continue:      sink_puts(out, "continue;"); break;
+    case jump_else:          sink_puts(out, "else;"); break;
+    case jump_elseif:        sink_puts(out, "else"); break;
+    case case_else:          sink_puts(out, "case else;"); break;
     case choose_case:{
-      struct instruction *rhs = statement->end->stack[0];
-      fputs("choose case ", fd);
-      printf_instruction(fd, disassembly, rhs, 0);
-      fputc(';', fd);
+      struct instruction *rhs = operand(disassembly, statement->end, 0);
+      sink_puts(out, "choose case ");
+      printf_instruction(out, disassembly, rhs, 0);
+      sink_putc(out, ';');
     }break;
     case case_if:
-      fputs("case ", fd);
-      printf_case(fd, disassembly, statement->end->stack[0]);
-      fputc(';', fd);
+      sink_puts(out, "case ");
+      printf_case(out, disassembly, operand(disassembly, statement->end, 0));
+      sink_putc(out, ';');
       break;
     case if_then:
-      fputs("if ", fd);
-      printf_instruction(fd, disassembly, statement->end->stack[0], 0);
-      fputs(" then ", fd);
+      sink_puts(out, "if ");
+      printf_instruction(out, disassembly, operand(disassembly, statement->end, 0), 0);
+      sink_puts(out, " then ");
       break;
     case do_while:
-      fputs("do while ", fd);
-      printf_instruction(fd, disassembly, statement->end->stack[0], 0);
-      fputs(";", fd);
+      sink_puts(out, "do while ");
+      printf_instruction(out, disassembly, operand(disassembly, statement->end, 0), 0);
+      sink_putc(out, ';');
       break;
     case do_until:
-      fputs("do until ", fd);
-      printf_instruction(fd, disassembly, statement->end->stack[0], 0);
-      fputs(";", fd);
+      sink_puts(out, "do until ");
+      printf_instruction(out, disassembly, operand(disassembly, statement->end, 0), 0);
+      sink_putc(out, ';');
       break;
     case loop_while:
-      fputs("loop while ", fd);
-      printf_instruction(fd, disassembly, statement->end->stack[0], 0);
-      fputs(";", fd);
+      sink_puts(out, "loop while ");
+      printf_instruction(out, disassembly, operand(disassembly, statement->end, 0), 0);
+      sink_putc(out, ';');
       break;
     case loop_until:
-      fputs("loop until ", fd);
-      printf_instruction(fd, disassembly, statement->end->stack[0], 0);
-      fputs(";", fd);
+      sink_puts(out, "loop until ");
+      printf_instruction(out, disassembly, operand(disassembly, statement->end, 0), 0);
+      sink_putc(out, ';');
       break;
     case exception_catch:{
-      struct instruction *inst = statement->end->stack[0]->stack[0];
+      struct instruction *inst = operand(disassembly, operand(disassembly, statement->end, 0), 0);
       unsigned var = inst->args[0];
       struct variable_definition *variable = disassembly->script->local_variables[var];
-      fprintf(fd, "catch (%s %s);", variable->type, variable->name);
+      sink_printf(out, "catch (%s %s);", variable->type, variable->name);
     }break;
     case for_init:{
       struct statement *incr = statement->next->next;
       struct statement *cmp = incr->next;
-      fputs("for ", fd);
+      sink_puts(out, "for ");
       // TODO without the ';'
-      printf_instruction(fd, disassembly, statement->end, 0);
-      fputs(" to ", fd);
-      printf_instruction(fd, disassembly, cmp->end->stack[0]->stack[1], 0);
+      printf_instruction(out, disassembly, statement->end, 0);
+      sink_puts(out, " to ");
+      printf_instruction(out, disassembly, operand(disassembly, operand(disassembly, cmp->end, 0), 1), 0);
       if (incr->end->definition->operation == OP_ASSIGNADD){
-	fputs(" step ", fd);
-	printf_instruction(fd, disassembly, incr->end->stack[0], 0);
+	sink_puts(out, " step ");
+	printf_instruction(out, disassembly, operand(disassembly, incr->end, 0), 0);
       }
-      fputs("; ", fd);
+      sink_puts(out, "; ");
       return cmp->next;
     }break;
     case mem_append:{
-      struct instruction *lhs = statement->end->stack[1];
-      struct instruction *rhs = statement->end->stack[0]->stack[0];
-      printf_instruction(fd, disassembly, lhs, 0);
-      fputs(" += ", fd);
-      printf_instruction(fd, disassembly, rhs, 0);
-      fputc(';', fd);
+      struct instruction *lhs = operand(disassembly, statement->end, 1);
+      struct instruction *rhs = operand(disassembly, operand(disassembly, statement->end, 0), 0);
+      printf_instruction(out, disassembly, lhs, 0);
+      sink_puts(out, " += ");
+      printf_instruction(out, disassembly, rhs, 0);
+      sink_putc(out, ';');
     }break;
     default:
-      printf_instruction(fd, disassembly, statement->end, 0);
+      printf_instruction(out, disassembly, statement->end, 0);
       break;
   }
   return statement->next;
 }
 
-void dump_raw_pcode(FILE *fd, struct script_definition *script){
+// same rows as _dump, without the ascii column
+static void dump_hex(struct sink *out, const uint8_t *data, size_t len){
+  size_t i;
+  unsigned row=0;
+  for(i = 0; i < len; i += 16) {
+    sink_printf(out, "%04zx (%u):", i, row++);
+    unsigned j;
+    for (j = 0; j < 16 && i + j < len; j++)
+      sink_printf(out, " %02x", data[i + j]);
+    sink_putc(out, '\n');
+  }
+}
+
+void dump_raw_pcode(struct sink *out, struct script_definition *script){
   struct script_def_private *script_def = (struct script_def_private *)script;
 
   if (!script_def || !script_def->body || !script_def->body->code)
@@ -1347,49 +1410,51 @@ void dump_raw_pcode(FILE *fd, struct script_definition *script){
   for (i=0;i<script_def->body->debugline_count -1;i++){
     uint16_t start = script_def->body->debug_lines[i].pcode_offset;
     uint16_t end = script_def->body->debug_lines[i+1].pcode_offset;
-    fprintf(fd, "Line_%u:\n", script_def->body->debug_lines[i].line_number);
-    _dump(fd, NULL, 0, &code[start], end - start, 16, 0);
+    sink_printf(out, "Line_%u:\n", script_def->body->debug_lines[i].line_number);
+    dump_hex(out, &code[start], end - start);
   }
 
   uint16_t start = 0;
   if (script_def->body->debugline_count){
     i = script_def->body->debugline_count - 1;
     start = script_def->body->debug_lines[i].pcode_offset;
-    fprintf(fd, "Line_%u:\n", script_def->body->debug_lines[i].line_number);
+    sink_printf(out, "Line_%u:\n", script_def->body->debug_lines[i].line_number);
   }
   uint16_t end = script_def->body->code_size;
-  _dump(fd, NULL, 0, &code[start], end - start, 16, 0);
+  dump_hex(out, &code[start], end - start);
 }
 
-void dump_statements(FILE *fd, struct disassembly *disassembly){
-  if (IFDEBUG(DISASSEMBLY))
-    dump_script_resources(fd, disassembly->group, disassembly->script);
+void dump_statements(struct sink *out, struct disassembly *disassembly){
+  if (IFDEBUG(DISASSEMBLY)){
+    sink_flush(out);
+    dump_script_resources(stderr, disassembly->group, disassembly->script);
+  }
 
   struct print_state state = {.line=1, .indent=0};
   struct statement *statement = disassembly->statements[0];
 
   if (statement && statement->start_line_number > 20){
-    fprintf(fd, "Line_%u:", statement->start_line_number);
-    fputeol(fd, &state);
+    sink_printf(out, "Line_%u:", statement->start_line_number);
+    fputeol(out, &state);
     state.line = statement->start_line_number;
   }
 
   while(statement){
     state.statement = statement;
-    state.scope_count = begin_scope(fd, &state, statement->scope);
+    state.scope_count = begin_scope(out, &state, statement->scope);
 
     if (statement->classified_count < statement->destination_count){
-      fprintf(fd, "Offset_%u:", statement->start->offset);
+      sink_printf(out, "Offset_%u:", statement->start->offset);
       if (state.line < statement->start_line_number)
-	fputeol(fd, &state);
+	fputeol(out, &state);
     }
 
     struct statement *nxt;
     if (IFDEBUG(DISASSEMBLY) || statement->type != generated){
       while (state.line < statement->start_line_number)
-	fputeol(fd, &state);
+	fputeol(out, &state);
 
-      nxt = printf_statement(fd, disassembly, statement);
+      nxt = printf_statement(out, disassembly, statement);
     }else{
       nxt = statement->next;
     }
@@ -1399,15 +1464,15 @@ void dump_statements(FILE *fd, struct disassembly *disassembly){
       if (scope->indent_end == statement){
 	state.indent--;
 	if (state.indent < 0){
-	  fflush(fd);
+	  sink_flush(out);
 	  DEBUGF(DISASSEMBLY, "Negative indent???");
 	}
       }
       if (scope->end == statement && scope->end_label){
 	if (!statement->next || state.line < statement->next->start_line_number)
-	  fputeol(fd, &state);
+	  fputeol(out, &state);
 	// TODO if there's no room for an end of line here, we should have popped all indents first.... somehow...
-	fprintf(fd, "%s;", scope->end_label);
+	sink_printf(out, "%s;", scope->end_label);
       }
       scope = scope->parent;
     }
@@ -8,15 +8,20 @@
 struct script_definition;
 struct pcode_def;
 struct pool;
+struct cfg;
+
+// operands refer to other instructions by their index
+#define NO_INSTRUCTION ((uint32_t)-1)
 
 struct instruction{
-  unsigned offset;
-  uint16_t opcode;
-  unsigned line_number;
   struct pcode_def *definition;
   const uint16_t *args;
-  unsigned stack_count;
-  struct instruction **stack;
+  uint32_t offset;
+  uint32_t line_number;
+  // first operand in disassembly->operands
+  uint32_t stack;
+  uint16_t opcode;
+  uint16_t stack_count;
   uint8_t begin:1;
   uint8_t end:1;
 };
@@ -83,9 +88,13 @@ struct statement{
   struct statement *branch;
   unsigned destination_count;
   unsigned classified_count;
+  // basic block, see cfg.h
+  unsigned block;
 };
 
 enum token_types{
+  // literal text, only in emit steps
+  TEXT = 0,
   STACK = 1,
   STACK_CSV,
   STACK_DOT_CSV,
@@ -205,6 +214,16 @@ enum stack_kind{
   stack_tweak_indirect1, // SM_FREE_REF_PAK_N (sigh)
 };
 
+// one piece of an instruction's source text, decoded from the tokens of a pcode_def
+struct emit_step{
+  // 0 for literal text
+  enum token_types kind;
+  // argument or stack index, for token kinds that take one
+  unsigned index;
+  const char *text;
+  size_t length;
+};
+
 struct pcode_def{
   unsigned id;
   const char *name;
@@ -214,6 +233,9 @@ struct pcode_def{
   enum operation operation;
   enum stack_kind stack_kind;
   unsigned stack_arg;
+  // built from tokens by pcode_steps_init
+  unsigned step_count;
+  const struct emit_step *steps;
   const char *tokens[];
 };
 
@@ -223,32 +245,44 @@ struct disassembly{
   struct class_definition *class_def;
   struct script_definition *script;
   unsigned instruction_count;
-  struct instruction **instructions;
+  struct instruction *instructions;
+  unsigned operand_count;
+  unsigned operand_allocated;
+  uint32_t *operands;
   unsigned statement_count;
   struct statement **statements;
+  // statements by start offset / 2
+  unsigned statement_index_size;
+  struct statement **statement_index;
+  struct cfg *cfg;
 };
 
-extern struct pcode_def *PB50_opcodes[];
-extern struct pcode_def *PB80_opcodes[];
-extern struct pcode_def *PB90_opcodes[];
-extern struct pcode_def *PB100_opcodes[];
-extern struct pcode_def *PB105_opcodes[];
-extern struct pcode_def *PB120_opcodes[];
-extern struct pcode_def *PB150_opcodes[];
-
-extern unsigned PB50_maxcode;
-extern unsigned PB80_maxcode;
-extern unsigned PB90_maxcode;
-extern unsigned PB100_maxcode;
-extern unsigned PB105_maxcode;
-extern unsigned PB120_maxcode;
-extern unsigned PB150_maxcode;
+// every pcode_def, indexed by id
+extern struct pcode_def *pcode_defs[MAX_ID];
+
+// decode the tokens of every pcode_def, safe to call more than once
+void pcode_steps_init();
+
+// maps the raw opcodes of a range of compiler versions to pcode_def ids
+struct opcode_table{
+  unsigned first_version;
+  unsigned count;
+  const uint16_t *ids;
+};
+
+// the table for any compiler version
+const struct opcode_table *opcode_table(unsigned compiler_version);
+
+struct sink;
 
 // this should probably be in a different header....
 struct disassembly *disassemble(struct class_group *group, struct class_definition *class_def, struct script_definition *script);
 void dump_pcode(FILE *fd, struct disassembly *disassembly);
-void dump_statements(FILE *fd, struct disassembly *disassembly);
-void dump_raw_pcode(FILE *fd, struct script_definition *script);
+// source text of the statements
+void dump_statements(struct sink *out, struct disassembly *disassembly);
+void dump_raw_pcode(struct sink *out, struct script_definition *script);
 void disassembly_free(struct disassembly *disassembly);
+// the statement starting at this pcode offset, or NULL
+struct statement *statement_at(struct disassembly *disassembly, unsigned offset);
 
 #endif
@@ -0,0 +1,353 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "export.h"
+#include "lib.h"
+#include "class.h"
+#include "output.h"
+#include "snapshot.h"
+#include "recover.h"
+#include "workers.h"
+#include "sink.h"
+#include "util.h"
+#include "debug.h"
+
+// what the last export saw of each entry, kept in out_dir
+#define MANIFEST_NAME ".pb_export"
+#define MANIFEST_HEADER "pb_thingy export manifest 2"
+
+struct manifest_record{
+  char *name;
+  size_t length;
+  // of the raw entry data
+  uint64_t hash;
+  // still in the library
+  int seen;
+};
+
+struct manifest{
+  unsigned count;
+  struct manifest_record *records;
+};
+
+struct export_entry{
+  struct lib_entry *entry;
+  struct manifest_record *previous;
+  uint64_t hash;
+  char error[512];
+  int failed;
+  int unchanged;
+  size_t length;
+  // thread time spent on each stage
+  uint64_t parse_ns;
+  uint64_t source_ns;
+  uint64_t write_ns;
+};
+
+struct export{
+  const char *out_dir;
+  const char *cache_dir;
+  struct library *lib;
+  struct export_entry *entries;
+  struct manifest manifest;
+  unsigned count;
+  unsigned failed;
+  unsigned unchanged;
+  size_t length;
+  uint64_t parse_ns;
+  uint64_t source_ns;
+  uint64_t write_ns;
+  struct export_entry *slowest;
+};
+
+struct export_work{
+  struct export *export;
+  struct export_entry *item;
+  struct sink out;
+};
+
+static uint64_t now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const char *source_extension(const char *entry_name){
+  const char *extension = class_source_extension(entry_name);
+  return extension ? extension : ".txt";
+}
+
+// out_dir/n_object.sru for n_object.udo
+static const char *source_path(const char *out_dir, const char *entry_name, char *path, size_t size){
+  size_t len = strlen(entry_name);
+  const char *dot = strrchr(entry_name, '.');
+  if (dot)
+    len = dot - entry_name;
+  int ret = snprintf(path, size, "%s/%.*s%s", out_dir, (int)len, entry_name, source_extension(entry_name));
+  if (ret < 0 || (size_t)ret >= size)
+    return NULL;
+  return path;
+}
+
+// each file is written with one call, then renamed into place so a failed export never leaves half a file
+static int write_source(const char *path, const char *data, size_t length){
+  char tmp_path[PATH_MAX+8];
+  int fd = temp_open(path, tmp_path, sizeof tmp_path);
+  if (fd<0)
+    return -1;
+  int ret = write_all(fd, data, length);
+  return temp_commit(fd, tmp_path, path, ret);
+}
+
+static int record_compare(const void *a, const void *b){
+  return strcmp(((const struct manifest_record *)a)->name, ((const struct manifest_record *)b)->name);
+}
+
+static void manifest_load(struct manifest *manifest, const char *out_dir){
+  char path[PATH_MAX];
+  snprintf(path, sizeof path, "%s/" MANIFEST_NAME, out_dir);
+  FILE *fd = fopen(path, "r");
+  if (!fd)
+    return;
+
+  char *line = NULL;
+  size_t size = 0;
+  unsigned allocated = 0;
+  unsigned version;
+  ssize_t len = getline(&line, &size, fd);
+  // sources written by another version of the decompiler are all written again
+  if (len <= 0 || sscanf(line, MANIFEST_HEADER ", output %u\n", &version) != 1 || version != OUTPUT_VERSION){
+    DEBUGF(OUTPUT, "Ignoring manifest %s, unknown format or output version", path);
+    len = -1;
+  }
+  while(len > 0 && (len = getline(&line, &size, fd)) > 0){
+    // name, length, hash
+    char *tab = strchr(line, '\t');
+    size_t length;
+    unsigned long long hash;
+    if (!tab || sscanf(tab+1, "%zu\t%llx", &length, &hash) != 2)
+      continue;
+    if (manifest->count == allocated){
+      allocated = allocated ? allocated*2 : 256;
+      manifest->records = realloc(manifest->records, allocated * sizeof(struct manifest_record));
+      assert(manifest->records);
+    }
+    struct manifest_record *record = &manifest->records[manifest->count++];
+    record->name = strndup(line, tab - line);
+    assert(record->name);
+    record->length = length;
+    record->hash = hash;
+    record->seen = 0;
+  }
+  free(line);
+  fclose(fd);
+  if (manifest->count)
+    qsort(manifest->records, manifest->count, sizeof(struct manifest_record), record_compare);
+  DEBUGF(OUTPUT, "Loaded %u manifest records from %s", manifest->count, path);
+}
+
+static struct manifest_record *manifest_find(struct manifest *manifest, const char *name){
+  if (!manifest->count)
+    return NULL;
+  struct manifest_record key = {.name = (char *)name};
+  return bsearch(&key, manifest->records, manifest->count, sizeof(struct manifest_record), record_compare);
+}
+
+static void manifest_free(struct manifest *manifest){
+  unsigned i;
+  for (i=0;i<manifest->count;i++)
+    free(manifest->records[i].name);
+  free(manifest->records);
+}
+
+static int manifest_write(struct export *export){
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX+8];
+  snprintf(path, sizeof path, "%s/" MANIFEST_NAME, export->out_dir);
+  int tmp_fd = temp_open(path, tmp_path, sizeof tmp_path);
+  if (tmp_fd<0)
+    return -1;
+  FILE *fd = fdopen(tmp_fd, "w");
+  if (!fd)
+    return temp_commit(tmp_fd, tmp_path, path, 1);
+  fprintf(fd, MANIFEST_HEADER ", output %u\n", OUTPUT_VERSION);
+  unsigned i;
+  // failed entries are left out, so they are tried again next time
+  for (i=0;i<export->count;i++){
+    struct export_entry *item = &export->entries[i];
+    if (!item->failed)
+      fprintf(fd, "%s\t%zu\t%016llx\n", item->entry->name,
+	item->entry->length, (unsigned long long)item->hash);
+  }
+  int failed = ferror(fd);
+  if (fclose(fd))
+    failed = 1;
+  return temp_commit(-1, tmp_path, path, failed);
+}
+
+// remove the source of entries that are no longer in the library
+static unsigned remove_stale(struct export *export){
+  unsigned i, removed = 0;
+  for (i=0;i<export->manifest.count;i++){
+    struct manifest_record *record = &export->manifest.records[i];
+    char path[PATH_MAX];
+    if (record->seen || !source_path(export->out_dir, record->name, path, sizeof path))
+      continue;
+    if (unlink(path) == 0 || errno == ENOENT){
+      DEBUGF(OUTPUT, "Removed %s", path);
+      removed++;
+    }
+  }
+  return removed;
+}
+
+static void export_decompile(void *context){
+  struct export_work *work = context;
+  struct export *export = work->export;
+  uint64_t start = now_ns();
+  struct class_group *class_group = export->cache_dir ?
+    class_parse_cached(export->cache_dir, export->lib, work->item->entry) : class_parse(work->item->entry);
+  uint64_t parsed = now_ns();
+  work->item->parse_ns = parsed - start;
+  write_group(&work->out, class_group);
+  class_free(class_group);
+  work->item->source_ns = now_ns() - parsed;
+}
+
+static void export_work(unsigned index, void *context){
+  struct export *export = context;
+  struct export_work work = {
+    .export = export,
+    .item = &export->entries[index],
+  };
+  struct export_entry *item = work.item;
+  struct manifest_record *previous = item->previous;
+  char path[PATH_MAX];
+  if (!source_path(export->out_dir, item->entry->name, path, sizeof path)){
+    snprintf(item->error, sizeof item->error, "Output path is too long");
+    item->failed = 1;
+    return;
+  }
+
+  // always hash the raw bytes, the manifest may have been written from another library
+  // where the same entry has the same timestamp and length
+  item->hash = lib_entry_hash(item->entry);
+  if (previous
+    && previous->length == item->entry->length
+    && previous->hash == item->hash
+    && access(path, F_OK) == 0){
+    item->unchanged = 1;
+    return;
+  }
+
+  sink_open_memory(&work.out);
+  item->failed = recover_run(export_decompile, &work, item->error, sizeof item->error) != 0;
+
+  if (!item->failed){
+    uint64_t start = now_ns();
+    if (write_source(path, work.out.data, work.out.length)){
+      snprintf(item->error, sizeof item->error, "Failed to write the source, %s", strerror(errno));
+      item->failed = 1;
+    }
+    item->length = work.out.length;
+    item->write_ns = now_ns() - start;
+  }
+  sink_close(&work.out);
+}
+
+static void export_deliver(unsigned index, void *context){
+  struct export *export = context;
+  struct export_entry *item = &export->entries[index];
+  if (item->failed){
+    export->failed++;
+    return;
+  }
+  if (item->unchanged){
+    export->unchanged++;
+    return;
+  }
+  DEBUGF(OUTPUT, "Exported %s, %zu bytes", item->entry->name, item->length);
+  export->length += item->length;
+  export->parse_ns += item->parse_ns;
+  export->source_ns += item->source_ns;
+  export->write_ns += item->write_ns;
+  if (!export->slowest
+    || item->parse_ns + item->source_ns > export->slowest->parse_ns + export->slowest->source_ns)
+    export->slowest = item;
+}
+
+static void export_add(struct lib_entry *entry, void *context){
+  struct export *export = context;
+  if (!class_is_compiled_entry(entry->name))
+    return;
+  struct export_entry *item = &export->entries[export->count++];
+  item->entry = entry;
+  item->previous = manifest_find(&export->manifest, entry->name);
+  if (item->previous)
+    item->previous->seen = 1;
+}
+
+static void export_count(struct lib_entry *entry, void *context){
+  unsigned *count = context;
+  if (class_is_compiled_entry(entry->name))
+    (*count)++;
+}
+
+#define SECONDS(NS) ((NS) / 1e9)
+
+int export_library(const char *filename, const char *out_dir, const char *cache_dir, unsigned thread_count){
+  uint64_t start = now_ns();
+  if (mkdir(out_dir, 0777) && errno != EEXIST){
+    fprintf(stderr, "Failed to create %s, %s\n", out_dir, strerror(errno));
+    return 1;
+  }
+  struct library *lib = lib_open(filename);
+  if (!lib){
+    fprintf(stderr, "Failed to open %s\n", filename);
+    return 1;
+  }
+  unsigned count = 0;
+  lib_enumerate(lib, export_count, &count);
+
+  struct export export = {
+    .out_dir = out_dir,
+    .cache_dir = cache_dir,
+    .lib = lib,
+    .entries = calloc(count ? count : 1, sizeof(struct export_entry)),
+  };
+  assert(export.entries);
+  manifest_load(&export.manifest, out_dir);
+  lib_enumerate(lib, export_add, &export);
+  if (!thread_count)
+    thread_count = workers_default_count();
+  workers_run(thread_count, export.count, export_work, export_deliver, &export);
+
+  unsigned removed = remove_stale(&export);
+  if (manifest_write(&export))
+    fprintf(stderr, "Failed to write the manifest in %s, %s\n", out_dir, strerror(errno));
+
+  fprintf(stderr, "Exported %u of %u entries from %s to %s in %.2fs, on %u threads\n",
+    export.count - export.failed - export.unchanged, export.count, filename, out_dir, SECONDS(now_ns() - start), thread_count);
+  fprintf(stderr, "  %u unchanged, %u removed\n", export.unchanged, removed);
+  fprintf(stderr, "  parse %.2fs, source %.2fs, write %.2fs, %zu bytes\n",
+    SECONDS(export.parse_ns), SECONDS(export.source_ns), SECONDS(export.write_ns), export.length);
+  if (export.slowest)
+    fprintf(stderr, "  slowest %s, %.3fs\n",
+      export.slowest->entry->name, SECONDS(export.slowest->parse_ns + export.slowest->source_ns));
+  unsigned i;
+  for (i=0;i<export.count;i++)
+    if (export.entries[i].failed)
+      fprintf(stderr, "  %s: %s\n", export.entries[i].entry->name, export.entries[i].error);
+  manifest_free(&export.manifest);
+  free(export.entries);
+  lib_close(lib);
+  return export.failed ? 2 : 0;
+}
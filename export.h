@@ -0,0 +1,15 @@
+
+#ifndef export_header
+#define export_header
+
+/* Export decompiles every compiled entry of a library into a directory of source files,
+ * one file per entry named for its source extension, eg n_object.udo -> n_object.sru
+ *
+ * A manifest in the directory records the timestamp, length and hash of each entry that was exported.
+ * Entries with the same bytes as last time are skipped, and the sources of entries that left the library are deleted.
+ */
+
+// returns 0 if every entry was written, 2 if some failed, or 1 if the export couldn't start
+int export_library(const char *filename, const char *out_dir, const char *cache_dir, unsigned thread_count);
+
+#endif
@@ -0,0 +1,130 @@
+#include <string.h>
+#include "hash.h"
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, unsigned r){
+  return (x << r) | (x >> (64 - r));
+}
+
+// the format is little endian, as are the libraries
+static uint64_t read64(const uint8_t *p){
+  uint64_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static uint32_t read32(const uint8_t *p){
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input){
+  acc += input * P2;
+  acc = rotl(acc, 31);
+  return acc * P1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t value){
+  acc ^= round64(0, value);
+  return acc * P1 + P4;
+}
+
+static void stripes(struct hash_state *state, const uint8_t *p, size_t count){
+  uint64_t a0 = state->acc[0], a1 = state->acc[1], a2 = state->acc[2], a3 = state->acc[3];
+  while(count--){
+    a0 = round64(a0, read64(p));
+    a1 = round64(a1, read64(p+8));
+    a2 = round64(a2, read64(p+16));
+    a3 = round64(a3, read64(p+24));
+    p += 32;
+  }
+  state->acc[0] = a0;
+  state->acc[1] = a1;
+  state->acc[2] = a2;
+  state->acc[3] = a3;
+}
+
+void hash_init(struct hash_state *state, uint64_t seed){
+  memset(state, 0, sizeof *state);
+  state->seed = seed;
+  state->acc[0] = seed + P1 + P2;
+  state->acc[1] = seed + P2;
+  state->acc[2] = seed;
+  state->acc[3] = seed - P1;
+}
+
+void hash_update(struct hash_state *state, const void *data, size_t length){
+  const uint8_t *p = data;
+  state->total += length;
+
+  if (state->buffered){
+    size_t fill = 32 - state->buffered;
+    if (fill > length)
+      fill = length;
+    memcpy(state->buffer + state->buffered, p, fill);
+    state->buffered += fill;
+    p += fill;
+    length -= fill;
+    if (state->buffered < 32)
+      return;
+    stripes(state, state->buffer, 1);
+    state->buffered = 0;
+  }
+
+  stripes(state, p, length / 32);
+  p += length & ~(size_t)31;
+  length &= 31;
+
+  memcpy(state->buffer, p, length);
+  state->buffered = length;
+}
+
+uint64_t hash_final(const struct hash_state *state){
+  uint64_t h;
+  if (state->total >= 32){
+    h = rotl(state->acc[0], 1) + rotl(state->acc[1], 7) + rotl(state->acc[2], 12) + rotl(state->acc[3], 18);
+    unsigned i;
+    for (i=0;i<4;i++)
+      h = merge64(h, state->acc[i]);
+  }else{
+    h = state->seed + P5;
+  }
+  h += state->total;
+
+  const uint8_t *p = state->buffer;
+  unsigned length = state->buffered;
+  for (;length >= 8; length -= 8, p += 8){
+    h ^= round64(0, read64(p));
+    h = rotl(h, 27) * P1 + P4;
+  }
+  if (length >= 4){
+    h ^= (uint64_t)read32(p) * P1;
+    h = rotl(h, 23) * P2 + P3;
+    p += 4;
+    length -= 4;
+  }
+  while(length--){
+    h ^= (*p++) * P5;
+    h = rotl(h, 11) * P1;
+  }
+
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+uint64_t hash_bytes(const void *data, size_t length, uint64_t seed){
+  struct hash_state state;
+  hash_init(&state, seed);
+  hash_update(&state, data, length);
+  return hash_final(&state);
+}
@@ -0,0 +1,27 @@
+
+#ifndef hash_header
+#define hash_header
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* XXH64, a fast non-cryptographic hash, for spotting unchanged content.
+ * Data can be hashed in one call, or streamed through a hash_state in pieces of any size,
+ * both give the same result.
+ */
+
+struct hash_state{
+  uint64_t seed;
+  uint64_t total;
+  uint64_t acc[4];
+  uint8_t buffer[32];
+  unsigned buffered;
+};
+
+void hash_init(struct hash_state *state, uint64_t seed);
+void hash_update(struct hash_state *state, const void *data, size_t length);
+uint64_t hash_final(const struct hash_state *state);
+
+uint64_t hash_bytes(const void *data, size_t length, uint64_t seed);
+
+#endif
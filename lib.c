@@ -3,11 +3,19 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <unicode/ustring.h>
 #include "lib.h"
 #include "pbl_types.h"
 #include "pool_alloc.h"
+#include "hash.h"
+#include "recover.h"
+#include "util.h"
 #include "debug.h"
 
 struct library_private;
@@ -20,8 +28,11 @@ struct lib_entry_private{
   uint32_t start_offset;
   uint16_t comment_len;
   struct dat *dat;
+  uint8_t started;
   uint16_t block_offset;
   uint32_t remaining;
+  // the last refresh that found this entry in the directory
+  unsigned generation;
 };
 
 struct directory{
@@ -38,17 +49,32 @@ struct library_private{
   struct library pub;
   struct pool *pool;
   int fd;
+  // guards pool allocations made while reading entries, so entries can be read concurrently
+  pthread_mutex_t lock;
   uint32_t scc_info;
   uint32_t scc_length;
   struct directory root;
+  // the file as of the last refresh
+  struct stat st;
+  unsigned generation;
+  // bloom filter over entry names, so lib_find can reject most missing names without reading the directory
+  double filter_rate;
+  const char *filter_path;
+  uint8_t *filter_bits;
+  uint64_t filter_size;
+  unsigned filter_hashes;
+  unsigned long filter_probes;
+  unsigned long filter_rejected;
+  unsigned long filter_false_positives;
 };
 
-struct library *lib_open(const char *filename){
-  int fd = open(filename, O_RDONLY);
-  DEBUGF(LIB, "open(%s, O_RDONLY) = %d", filename, fd);
-  if (fd<0)
-    return NULL;
+union file_header{
+  struct file_header_a ansi;
+  struct file_header_u unicode;
+};
 
+// find the HDR block via the TRL block at the end of the file, and read it
+static off_t read_header(int fd, union file_header *header){
   off_t header_offset = -1;
   off_t len = lseek(fd, 0, SEEK_END);
   assert(len>=0);
@@ -80,16 +106,44 @@ struct library *lib_open(const char *filename){
   // no block header?
   assert(header_offset>=0);
 
-  lseek(fd, header_offset, SEEK_SET);
-  union{
-    struct file_header_a ansi;
-    struct file_header_u unicode;
-  }header;
-
   // read the HDR block
-  read(fd, &header, sizeof(header));
+  pread(fd, header, sizeof(*header), header_offset);
+
+  assert(strncmp(header->ansi.type, HDR, 4)==0);
+  return header_offset;
+}
+
+static void set_header(struct library_private *lib, union file_header *header, off_t header_offset){
+  if (lib->pub.unicode){
+    lib->pub.timestamp = header->unicode.timestamp;
+    lib->pub.filetype = header->unicode.filetype;
+    lib->scc_info = header->unicode.scc_info;
+    lib->scc_length = header->unicode.scc_length;
+    lib->root.offset = header_offset+0x600;
+  }else{
+    lib->pub.timestamp = header->ansi.timestamp;
+    lib->pub.filetype = header->ansi.filetype;
+    lib->scc_info = header->ansi.scc_info;
+    lib->scc_length = header->ansi.scc_length;
+    lib->root.offset = header_offset+0x400;
+  }
+}
+
+static void close_fd(void *context){
+  close(*(int *)context);
+}
+
+struct library *lib_open(const char *filename){
+  int fd = open(filename, O_RDONLY);
+  DEBUGF(LIB, "open(%s, O_RDONLY) = %d", filename, fd);
+  if (fd<0)
+    return NULL;
+  // the pool goes with a failed scope, the file must too
+  struct recover_cleanup cleanup;
+  recover_push(&cleanup, close_fd, &fd);
 
-  assert(strncmp(header.ansi.type, HDR, 4)==0);
+  union file_header header;
+  off_t header_offset = read_header(fd, &header);
 
   uint8_t unicode;
   if (strncmp(header.ansi.pb, "PowerBuilder", 14)==0){
@@ -110,25 +164,24 @@ struct library *lib_open(const char *filename){
   memset(&lib->root, 0, sizeof(lib->root));
   lib->pool = pool;
   lib->fd = fd;
+  pthread_mutex_init(&lib->lock, NULL);
   lib->pub.unicode = unicode;
   if (unicode){
     lib->pub.comment = pool_dup_u(pool, header.unicode.comment);
     lib->pub.version = pool_dup_u(pool, header.unicode.version);
-    lib->pub.timestamp = header.unicode.timestamp;
-    lib->pub.filetype = header.unicode.filetype;
-    lib->scc_info = header.unicode.scc_info;
-    lib->scc_length = header.unicode.scc_length;
-    lib->root.offset = header_offset+0x600;
   }else{
     lib->pub.comment = pool_dup(pool, header.ansi.comment);
     lib->pub.version = pool_dup(pool, header.ansi.version);
-    lib->pub.timestamp = header.ansi.timestamp;
-    lib->pub.filetype = header.ansi.filetype;
-    lib->scc_info = header.ansi.scc_info;
-    lib->scc_length = header.ansi.scc_length;
-    lib->root.offset = header_offset+0x400;
   }
+  set_header(lib, &header, header_offset);
   lib->pub.filename = pool_dup(pool, filename);
+  fstat(fd, &lib->st);
+  lib->generation = 0;
+  lib->filter_rate = 0;
+  lib->filter_path = NULL;
+  lib->filter_bits = NULL;
+  lib->filter_probes = lib->filter_rejected = lib->filter_false_positives = 0;
+  recover_pop(&cleanup);
   return (struct library *)lib;
 }
 
@@ -136,18 +189,12 @@ void lib_close(struct library *library){
   assert(library);
   struct library_private *lib = (struct library_private *)library;
   close(lib->fd);
+  pthread_mutex_destroy(&lib->lock);
+  free(lib->filter_bits);
   pool_release(lib->pool);
 }
 
-static void read_dir(struct library_private *lib, struct directory *dir){
-  if (dir->nod)
-    return;
-
-  dir->nod = pool_alloc_type(lib->pool, struct nod);
-  lseek(lib->fd, dir->offset, SEEK_SET);
-  read(lib->fd, dir->nod, sizeof(struct nod));
-  assert(strncmp(dir->nod->type, NOD, 4)==0);
-
+static void dir_names(struct library_private *lib, struct directory *dir){
   if (dir->nod->no_entries){
     if (lib->pub.unicode){
       dir->first = pool_dup_u(lib->pool, (const UChar *)&dir->nod->raw[dir->nod->first_name]);
@@ -161,6 +208,16 @@ static void read_dir(struct library_private *lib, struct directory *dir){
     dir->offset, dir->nod->no_entries, dir->first, dir->last);
 }
 
+static void read_dir(struct library_private *lib, struct directory *dir){
+  if (dir->nod)
+    return;
+
+  dir->nod = pool_alloc_type(lib->pool, struct nod);
+  pread(lib->fd, dir->nod, sizeof(struct nod), dir->offset);
+  assert(strncmp(dir->nod->type, NOD, 4)==0);
+  dir_names(lib, dir);
+}
+
 static struct directory * dir_left(struct library_private *lib, struct directory *dir){
   read_dir(lib, dir);
   if (!dir->left && dir->nod->left_offset){
@@ -198,6 +255,7 @@ static void read_ents(struct library_private *lib, struct directory *dir){
     ptr = &entry->next;
 
     entry->lib = lib;
+    entry->generation = lib->generation;
     if (lib->pub.unicode){
       struct ent_u *ent = (struct ent_u *)data;
       assert(strncmp(ent->type, ENT, 4)==0);
@@ -235,9 +293,8 @@ static void read_ents(struct library_private *lib, struct directory *dir){
 static void read_ent_comment(struct lib_entry_private *ent){
   if (!ent->comment_len || ent->pub.comment)
     return;
-  lseek(ent->lib->fd, ent->start_offset, SEEK_SET);
   struct dat dat;
-  read(ent->lib->fd, &dat, sizeof(dat));
+  pread(ent->lib->fd, &dat, sizeof(dat), ent->start_offset);
   assert(strncmp(dat.type, DAT, 4)==0);
   if (ent->lib->pub.unicode){
     ent->pub.comment = pool_dupn_u(ent->lib->pool, (UChar*)dat.data, ent->comment_len);
@@ -246,27 +303,203 @@ static void read_ent_comment(struct lib_entry_private *ent){
   }
 }
 
-static void dir_enum(struct library_private *lib, struct directory *dir, entry_callback callback, void *context){
+static void dir_enum(struct library_private *lib, struct directory *dir, int comments, entry_callback callback, void *context){
   if (!dir)
     return;
-  dir_enum(lib, dir_left(lib, dir), callback, context);
+  dir_enum(lib, dir_left(lib, dir), comments, callback, context);
   read_ents(lib, dir);
   struct lib_entry_private *entry = dir->first_ent;
   while(entry){
-    read_ent_comment(entry);
+    if (comments)
+      read_ent_comment(entry);
     callback((struct lib_entry *)entry, context);
     entry = entry->next;
   }
-  dir_enum(lib, dir_right(lib, dir), callback, context);
+  dir_enum(lib, dir_right(lib, dir), comments, callback, context);
+}
+
+
+#define FILTER_MAGIC "PBBLOOM1"
+
+struct filter_file_header{
+  char magic[8];
+  // the library file the filter was built from
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  double rate;
+  uint64_t filter_size;
+  uint32_t hashes;
+  uint32_t padding;
+};
+
+// bit indexes come from two halves of one hash, h1 + i*h2
+static int filter_probe(struct library_private *lib, const char *name, int set){
+  uint64_t hash = hash_bytes(name, strlen(name), 0);
+  uint64_t h1 = (uint32_t)hash, h2 = (hash >> 32) | 1;
+  unsigned i;
+  for (i=0;i<lib->filter_hashes;i++){
+    uint64_t bit = (h1 + i*h2) % lib->filter_size;
+    if (set)
+      lib->filter_bits[bit >> 3] |= 1 << (bit & 7);
+    else if (!(lib->filter_bits[bit >> 3] & (1 << (bit & 7))))
+      return 0;
+  }
+  return 1;
+}
+
+static void filter_walk(struct library_private *lib, struct directory *dir, unsigned *count){
+  if (!dir)
+    return;
+  filter_walk(lib, dir_left(lib, dir), count);
+  read_ents(lib, dir);
+  struct lib_entry_private *entry;
+  for (entry = dir->first_ent; entry; entry = entry->next){
+    if (lib->filter_bits)
+      filter_probe(lib, entry->pub.name, 1);
+    (*count)++;
+  }
+  filter_walk(lib, dir_right(lib, dir), count);
+}
+
+static void filter_save(struct library_private *lib){
+  struct filter_file_header header;
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, FILTER_MAGIC, sizeof header.magic);
+  header.size = lib->st.st_size;
+  header.mtime_sec = lib->st.st_mtim.tv_sec;
+  header.mtime_nsec = lib->st.st_mtim.tv_nsec;
+  header.rate = lib->filter_rate;
+  header.filter_size = lib->filter_size;
+  header.hashes = lib->filter_hashes;
+
+  char tmp_path[PATH_MAX+8];
+  int fd = temp_open(lib->filter_path, tmp_path, sizeof tmp_path);
+  if (fd<0)
+    return;
+  size_t bytes = (lib->filter_size + 7) / 8;
+  int ret = write_all(fd, &header, sizeof header)
+    || write_all(fd, lib->filter_bits, bytes) ? -1 : 0;
+  ret = temp_commit(fd, tmp_path, lib->filter_path, ret);
+  DEBUGF(LIB, "Saved filter %s = %d", lib->filter_path, ret);
+}
+
+static int filter_load(struct library_private *lib){
+  int fd = open(lib->filter_path, O_RDONLY);
+  if (fd<0)
+    return 0;
+  struct filter_file_header header;
+  struct stat st;
+  int ret = 0;
+  // the bits must be exactly the rest of the file, so a damaged header can't ask for a huge allocation
+  if (fstat(fd, &st)==0 && (size_t)st.st_size >= sizeof header
+    && read(fd, &header, sizeof header) == sizeof header
+    && memcmp(header.magic, FILTER_MAGIC, sizeof header.magic)==0
+    && header.size == lib->st.st_size
+    && header.mtime_sec == lib->st.st_mtim.tv_sec
+    && header.mtime_nsec == lib->st.st_mtim.tv_nsec
+    && header.rate == lib->filter_rate
+    && header.filter_size && header.hashes && header.hashes <= 16
+    && header.filter_size <= ((uint64_t)st.st_size - sizeof header) * 8
+    && (header.filter_size + 7) / 8 == (uint64_t)st.st_size - sizeof header){
+    size_t bytes = (header.filter_size + 7) / 8;
+    lib->filter_bits = malloc(bytes);
+    assert(lib->filter_bits);
+    if (read(fd, lib->filter_bits, bytes) == (ssize_t)bytes){
+      lib->filter_size = header.filter_size;
+      lib->filter_hashes = header.hashes;
+      ret = 1;
+    }else{
+      free(lib->filter_bits);
+      lib->filter_bits = NULL;
+    }
+  }
+  close(fd);
+  DEBUGF(LIB, "Loaded filter %s = %d", lib->filter_path, ret);
+  return ret;
+}
+
+// size the filter for the entries in the directory, then add them all
+static void filter_build(struct library_private *lib){
+  free(lib->filter_bits);
+  lib->filter_bits = NULL;
+  unsigned count = 0;
+  filter_walk(lib, &lib->root, &count);
+
+  // an optimal filter has log2(1/rate) hashes and 1.44 bits per entry for each of them.
+  // a rough log2 is close enough
+  double inverse = 1 / lib->filter_rate;
+  unsigned log2 = 0;
+  while(inverse >= 2){
+    inverse /= 2;
+    log2++;
+  }
+  double bits_per_hash = log2 + (inverse - 1);
+  lib->filter_hashes = bits_per_hash < 1 ? 1 : bits_per_hash > 16 ? 16 : (unsigned)(bits_per_hash + 0.5);
+  lib->filter_size = (uint64_t)(count * bits_per_hash * 1.4427) + 64;
+  lib->filter_bits = calloc((lib->filter_size + 7) / 8, 1);
+  assert(lib->filter_bits);
+  count = 0;
+  filter_walk(lib, &lib->root, &count);
+  DEBUGF(LIB, "Filter of %s, %u entries, %llu bits, %u hashes", lib->pub.filename,
+    count, (unsigned long long)lib->filter_size, lib->filter_hashes);
+  if (lib->filter_path)
+    filter_save(lib);
+}
+
+void lib_use_filter(struct library *library, double false_positive_rate, const char *sidecar){
+  struct library_private *lib = (struct library_private *)library;
+  assert(false_positive_rate > 0 && false_positive_rate < 1);
+  lib->filter_rate = false_positive_rate;
+  lib->filter_path = sidecar ? pool_dup(lib->pool, sidecar) : NULL;
+  free(lib->filter_bits);
+  lib->filter_bits = NULL;
+  if (!lib->filter_path || !filter_load(lib))
+    filter_build(lib);
+}
+
+void lib_filter_stats(struct library *library, struct lib_filter_stats *stats){
+  struct library_private *lib = (struct library_private *)library;
+  stats->active = lib->filter_bits != NULL;
+  stats->probes = lib->filter_probes;
+  stats->rejected = lib->filter_rejected;
+  stats->false_positives = lib->filter_false_positives;
+}
+
+void entry_list_add(struct lib_entry *entry, void *context){
+  struct entry_list *list = context;
+  if (list->count == list->allocated){
+    list->allocated = list->allocated ? list->allocated*2 : 64;
+    list->entries = realloc(list->entries, list->allocated * sizeof(struct lib_entry *));
+    assert(list->entries);
+  }
+  list->entries[list->count++] = entry;
 }
 
 void lib_enumerate(struct library *library, entry_callback callback, void *context){
   struct library_private *lib = (struct library_private *)library;
-  dir_enum(lib, &lib->root, callback, context);
+  dir_enum(lib, &lib->root, 1, callback, context);
+}
+
+void lib_walk(struct library *library, entry_callback callback, void *context){
+  struct library_private *lib = (struct library_private *)library;
+  dir_enum(lib, &lib->root, 0, callback, context);
+}
+
+const char *lib_entry_comment(struct lib_entry *entry){
+  read_ent_comment((struct lib_entry_private *)entry);
+  return entry->comment;
 }
 
 struct lib_entry *lib_find(struct library *library, const char *entry_name){
   struct library_private *lib = (struct library_private *)library;
+  if (lib->filter_bits){
+    lib->filter_probes++;
+    if (!filter_probe(lib, entry_name, 0)){
+      lib->filter_rejected++;
+      return NULL;
+    }
+  }
   struct directory *dir = &lib->root;
   while(dir){
     read_dir(lib, dir);
@@ -288,31 +521,221 @@ struct lib_entry *lib_find(struct library *library, const char *entry_name){
 	entry = entry->next;
       }
       DEBUGF(LIB, "%s NOT FOUND", entry_name);
+      if (lib->filter_bits)
+	lib->filter_false_positives++;
       return NULL;
     }
   }
   DEBUGF(LIB, "%s NOT FOUND", entry_name);
+  if (lib->filter_bits)
+    lib->filter_false_positives++;
   return NULL;
 }
 
-size_t lib_entry_read(struct lib_entry *entry, uint8_t *buffer, size_t len){
-  assert(entry);
-  assert(buffer);
+struct refresh{
+  struct library_private *lib;
+  int fd;
+  struct nod *scratch;
+  // directories and entries read before the refresh, sorted by offset and name
+  struct ptr_list old_dirs;
+  struct ptr_list old_entries;
+  // directories read by this refresh, and whether each one is the same as before
+  struct ptr_list dirs;
+  struct ptr_list same;
+  // false if the file was replaced, and nothing can be kept
+  int reuse;
+};
 
-  struct lib_entry_private *ent = (struct lib_entry_private *)entry;
+static void collect_dirs(struct refresh *refresh, struct directory *dir){
+  if (!dir || !dir->nod)
+    return;
+  ptr_list_push(&refresh->old_dirs, dir);
+  struct lib_entry_private *entry;
+  for (entry = dir->first_ent; entry; entry = entry->next)
+    ptr_list_push(&refresh->old_entries, entry);
+  collect_dirs(refresh, dir->left);
+  collect_dirs(refresh, dir->right);
+}
+
+static int dir_compare(const void *a, const void *b){
+  uint32_t x = (*(struct directory * const *)a)->offset, y = (*(struct directory * const *)b)->offset;
+  return x < y ? -1 : x > y;
+}
+
+static int entry_compare(const void *a, const void *b){
+  return strcmp((*(struct lib_entry_private * const *)a)->pub.name, (*(struct lib_entry_private * const *)b)->pub.name);
+}
+
+// read the new directory tree into new structures, copying directories that haven't changed.
+// this may fail part way through on a file that is still being written, so nothing old is modified
+static struct directory *refresh_dir(struct refresh *refresh, uint32_t offset){
+  struct library_private *lib = refresh->lib;
+  pread(refresh->fd, refresh->scratch, sizeof(struct nod), offset);
+  assert(strncmp(refresh->scratch->type, NOD, 4)==0);
+
+  struct directory key = {.offset = offset}, *key_ptr = &key;
+  struct directory **found = refresh->reuse && refresh->old_dirs.count ?
+    bsearch(&key_ptr, refresh->old_dirs.items, refresh->old_dirs.count, sizeof(struct directory *), dir_compare) : NULL;
+  int same = found && memcmp((*found)->nod, refresh->scratch, sizeof(struct nod))==0;
+
+  struct directory *dir = pool_alloc_type(lib->pool, struct directory);
+  memset(dir, 0, sizeof(struct directory));
+  dir->offset = offset;
+  if (same){
+    dir->nod = (*found)->nod;
+    dir->first = (*found)->first;
+    dir->last = (*found)->last;
+    dir->first_ent = (*found)->first_ent;
+  }else{
+    DEBUGF(LIB, "Dir @%x changed", offset);
+    dir->nod = pool_alloc_type(lib->pool, struct nod);
+    memcpy(dir->nod, refresh->scratch, sizeof(struct nod));
+    dir_names(lib, dir);
+    read_ents(lib, dir);
+  }
+  ptr_list_push(&refresh->dirs, dir);
+  ptr_list_push(&refresh->same, same ? dir : NULL);
+
+  if (dir->nod->left_offset)
+    dir->left = refresh_dir(refresh, dir->nod->left_offset);
+  if (dir->nod->right_offset)
+    dir->right = refresh_dir(refresh, dir->nod->right_offset);
+  return dir;
+}
+
+// swap in the entries we already had, if nothing about them changed
+static void keep_entries(struct refresh *refresh, struct directory *dir){
+  struct lib_entry_private **ptr = &dir->first_ent, *entry;
+  while((entry = *ptr)){
+    struct lib_entry_private **old = refresh->reuse && refresh->old_entries.count ?
+      bsearch(&entry, refresh->old_entries.items, refresh->old_entries.count, sizeof(struct lib_entry_private *), entry_compare) : NULL;
+    if (old
+      && (*old)->pub.timestamp == entry->pub.timestamp
+      && (*old)->pub.length == entry->pub.length
+      && (*old)->start_offset == entry->start_offset
+      && (*old)->comment_len == entry->comment_len){
+      (*old)->next = entry->next;
+      *ptr = *old;
+    }
+    (*ptr)->generation = refresh->lib->generation;
+    ptr = &(*ptr)->next;
+  }
+}
+
+static void do_refresh(void *context){
+  struct refresh *refresh = context;
+  struct library_private *lib = refresh->lib;
+  union file_header header;
+  off_t header_offset = read_header(refresh->fd, &header);
+  uint32_t root_offset = header_offset + (lib->pub.unicode ? 0x600 : 0x400);
+  struct directory *root = refresh_dir(refresh, root_offset);
+
+  // everything has been read, now switch over
+  unsigned i;
+  lib->generation++;
+  for (i=0;i<refresh->dirs.count;i++){
+    struct directory *dir = refresh->dirs.items[i];
+    struct lib_entry_private *entry;
+    if (refresh->same.items[i]){
+      for (entry = dir->first_ent; entry; entry = entry->next)
+	entry->generation = lib->generation;
+    }else{
+      keep_entries(refresh, dir);
+    }
+  }
+  if (refresh->fd != lib->fd){
+    close(lib->fd);
+    lib->fd = refresh->fd;
+  }
+  set_header(lib, &header, header_offset);
+  lib->root = *root;
+}
+
+int lib_refresh(struct library *library, entry_callback changed, void *context){
+  struct library_private *lib = (struct library_private *)library;
+  struct stat st;
+  if (stat(lib->pub.filename, &st))
+    return -1;
+
+  int replaced = st.st_dev != lib->st.st_dev || st.st_ino != lib->st.st_ino;
+  if (!replaced
+    && st.st_size == lib->st.st_size
+    && st.st_mtim.tv_sec == lib->st.st_mtim.tv_sec
+    && st.st_mtim.tv_nsec == lib->st.st_mtim.tv_nsec)
+    return 0;
+
+  struct refresh refresh = {
+    .lib = lib,
+    .fd = lib->fd,
+    .reuse = !replaced,
+  };
+  if (replaced){
+    // written to a new file and renamed over the old one, none of the old offsets mean anything
+    refresh.fd = open(lib->pub.filename, O_RDONLY);
+    if (refresh.fd<0)
+      return -1;
+  }
 
-  if (!ent->dat){
+  collect_dirs(&refresh, &lib->root);
+  if (refresh.old_dirs.count)
+    qsort(refresh.old_dirs.items, refresh.old_dirs.count, sizeof(void *), dir_compare);
+  if (refresh.old_entries.count)
+    qsort(refresh.old_entries.items, refresh.old_entries.count, sizeof(void *), entry_compare);
+  refresh.scratch = malloc(sizeof(struct nod));
+  assert(refresh.scratch);
+
+  char message[256];
+  int ret = recover_run(do_refresh, &refresh, message, sizeof message);
+  if (ret){
+    // probably caught part way through a write, the next refresh will try again
+    DEBUGF(LIB, "Refresh of %s failed, %s", lib->pub.filename, message);
+    if (refresh.fd != lib->fd)
+      close(refresh.fd);
+  }else{
+    lib->st = st;
+    // names may have been added, the whole directory is in memory now so this doesn't read anything
+    if (lib->filter_rate)
+      filter_build(lib);
+    // anything we handed out before that isn't in the directory any more
+    unsigned i;
+    for (i=0;i<refresh.old_entries.count;i++){
+      struct lib_entry_private *entry = refresh.old_entries.items[i];
+      if (entry->generation != lib->generation){
+	DEBUGF(LIB, "%s changed", entry->pub.name);
+	if (changed)
+	  changed((struct lib_entry *)entry, context);
+	ret++;
+      }
+    }
+  }
+  free(refresh.scratch);
+  free(refresh.old_dirs.items);
+  free(refresh.old_entries.items);
+  free(refresh.dirs.items);
+  free(refresh.same.items);
+  return ret;
+}
+
+// copy the next len bytes into buffer, or discard them if buffer is NULL
+static size_t entry_read(struct lib_entry_private *ent, uint8_t *buffer, size_t len){
+
+  if (!ent->started){
 
     if (!ent->pub.length)
       return 0;
 
-    ent->dat = pool_alloc_type(ent->lib->pool, struct dat);
+    if (!ent->dat){
+      struct recover_cleanup cleanup;
+      recover_lock(&ent->lib->lock, &cleanup);
+      ent->dat = pool_alloc_type(ent->lib->pool, struct dat);
+      recover_unlock(&ent->lib->lock, &cleanup);
+    }
     assert(ent->dat);
+    ent->started = 1;
     // read the first block
 
     assert(ent->start_offset);
-    lseek(ent->lib->fd, ent->start_offset, SEEK_SET);
-    read(ent->lib->fd, ent->dat, sizeof(struct dat));
+    pread(ent->lib->fd, ent->dat, sizeof(struct dat), ent->start_offset);
     ent->remaining = ent->pub.length;
     assert(strncmp(ent->dat->type, DAT, 4)==0);
     assert(ent->remaining >= ent->dat->length);
@@ -330,7 +753,8 @@ size_t lib_entry_read(struct lib_entry *entry, uint8_t *buffer, size_t len){
       if (remain > (len - bytes_read))
 	remain = len - bytes_read;
 
-      memcpy(&buffer[bytes_read], &ent->dat->data[ent->block_offset], remain);
+      if (buffer)
+	memcpy(&buffer[bytes_read], &ent->dat->data[ent->block_offset], remain);
 
       ent->block_offset += remain;
       bytes_read += remain;
@@ -340,8 +764,7 @@ size_t lib_entry_read(struct lib_entry *entry, uint8_t *buffer, size_t len){
     } else {
       // read more data
       assert(ent->dat->next_offset);
-      lseek(ent->lib->fd, ent->dat->next_offset, SEEK_SET);
-      read(ent->lib->fd, ent->dat, sizeof(struct dat));
+      pread(ent->lib->fd, ent->dat, sizeof(struct dat), ent->dat->next_offset);
       assert(strncmp(ent->dat->type, DAT, 4)==0);
       assert(ent->remaining >= ent->dat->length);
       ent->block_offset = 0;
@@ -349,6 +772,53 @@ size_t lib_entry_read(struct lib_entry *entry, uint8_t *buffer, size_t len){
     }
   }
 
+  return bytes_read;
+}
+
+size_t lib_entry_read(struct lib_entry *entry, uint8_t *buffer, size_t len){
+  assert(entry);
+  assert(buffer);
+  size_t bytes_read = entry_read((struct lib_entry_private *)entry, buffer, len);
   DUMP(RAWREAD, buffer, bytes_read);
   return bytes_read;
 }
+
+void lib_entry_rewind(struct lib_entry *entry){
+  assert(entry);
+  ((struct lib_entry_private *)entry)->started = 0;
+}
+
+size_t lib_entry_skip(struct lib_entry *entry, size_t len){
+  assert(entry);
+  return entry_read((struct lib_entry_private *)entry, NULL, len);
+}
+
+uint64_t lib_entry_hash(struct lib_entry *entry){
+  assert(entry);
+  struct lib_entry_private *ent = (struct lib_entry_private *)entry;
+  if (ent->pub.hashed)
+    return ent->pub.hash;
+
+  // a walk of the block chain of it's own, so a read in progress isn't disturbed
+  struct hash_state state;
+  hash_init(&state, 0);
+  struct dat dat;
+  uint32_t offset = ent->start_offset;
+  uint32_t remaining = ent->pub.length;
+  // skip the file comment
+  uint16_t skip = ent->comment_len;
+  while(remaining){
+    assert(offset);
+    pread(ent->lib->fd, &dat, sizeof(struct dat), offset);
+    assert(strncmp(dat.type, DAT, 4)==0);
+    assert(dat.length <= DAT_SIZE && skip <= dat.length);
+    assert(remaining >= dat.length);
+    hash_update(&state, &dat.data[skip], dat.length - skip);
+    remaining -= dat.length;
+    offset = dat.next_offset;
+    skip = 0;
+  }
+  ent->pub.hash = hash_final(&state);
+  ent->pub.hashed = 1;
+  return ent->pub.hash;
+}
@@ -19,6 +19,9 @@ struct lib_entry{
   uint32_t timestamp;
   const char *name;
   const char *comment;
+  // XXH64 of the entry data, set by lib_entry_hash
+  uint64_t hash;
+  uint8_t hashed;
 };
 
 struct library *lib_open(const char *filename);
@@ -28,7 +31,47 @@ typedef void (*entry_callback) (struct lib_entry *entry, void *context);
 
 struct lib_entry *lib_find(struct library *lib, const char *entry_name);
 void lib_enumerate(struct library *lib, entry_callback callback, void *context);
+// the same, reading only the directory. each comment is a read of its own, so they're left NULL until
+// lib_entry_comment asks for them
+void lib_walk(struct library *lib, entry_callback callback, void *context);
+const char *lib_entry_comment(struct lib_entry *entry);
 
+struct entry_list{
+  struct lib_entry **entries;
+  unsigned count;
+  unsigned allocated;
+};
+
+// an entry_callback that appends each entry to the entry_list in context
+void entry_list_add(struct lib_entry *entry, void *context);
+
+// re-read the header and directory after the file has been written. Entries found before that have since changed or
+// been removed are passed to changed, they stay allocated until the library is closed but won't be found again.
+// returns how many there were, or -1 if the file is gone or couldn't be read, eg part way through a write, in which case
+// the library is left as it was. Nothing else may use the library at the same time
+int lib_refresh(struct library *lib, entry_callback changed, void *context);
+
+struct lib_filter_stats{
+  int active;
+  // lib_find calls checked against the filter, how many it answered alone, and how many it let through that weren't there
+  unsigned long probes;
+  unsigned long rejected;
+  unsigned long false_positives;
+};
+
+// keep a bloom filter of entry names, so lib_find can reject most missing names without reading the directory.
+// the filter is read from sidecar if it was written for the file as it is now, otherwise it is built from every
+// directory block and written to sidecar. sidecar may be NULL
+void lib_use_filter(struct library *lib, double false_positive_rate, const char *sidecar);
+void lib_filter_stats(struct library *lib, struct lib_filter_stats *stats);
+
+// different entries may be read from different threads at the same time
 size_t lib_entry_read(struct lib_entry *entry, uint8_t *buffer, size_t len);
+// start reading from the beginning of the entry again
+void lib_entry_rewind(struct lib_entry *entry);
+// advance past len bytes without copying them
+size_t lib_entry_skip(struct lib_entry *entry, size_t len);
+// hash the entry data the first time it's asked for. reads the blocks on it's own, a read in progress carries on
+uint64_t lib_entry_hash(struct lib_entry *entry);
 
 #endif
@@ -0,0 +1,162 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "library_list.h"
+#include "lib.h"
+#include "recover.h"
+#include "workers.h"
+#include "util.h"
+#include "debug.h"
+
+struct list_slot{
+  uint32_t hash;
+  unsigned library;
+  struct lib_entry *entry;
+};
+
+struct list_library{
+  const char *filename;
+  struct library *lib;
+  // in directory order
+  struct entry_list entries;
+  char error[512];
+  int failed;
+};
+
+struct library_list_private{
+  struct library_list pub;
+  struct list_library *items;
+  // open addressing, by entry name
+  struct list_slot *slots;
+  unsigned slot_size;
+  unsigned slot_count;
+};
+
+static void open_library(void *context){
+  struct list_library *item = context;
+  item->lib = lib_open(item->filename);
+  if (!item->lib)
+    recover_fail("Failed to open library");
+}
+
+// names are all the index needs, comments are read when someone asks for them
+static void walk_library(void *context){
+  struct list_library *item = context;
+  lib_walk(item->lib, entry_list_add, &item->entries);
+}
+
+static void open_work(unsigned index, void *context){
+  struct library_list_private *list = context;
+  struct list_library *item = &list->items[index];
+  item->failed = recover_run(open_library, item, item->error, sizeof item->error) != 0;
+  if (item->failed)
+    return;
+  // a separate scope, so the library is still ours to close if its directory is damaged
+  if (recover_run(walk_library, item, item->error, sizeof item->error) != 0){
+    lib_close(item->lib);
+    item->failed = 1;
+  }
+}
+
+// merged in list order, so an earlier library's entry is already there when a later one has the same name
+static void merge_library(struct library_list_private *list, unsigned index){
+  struct list_library *item = &list->items[index];
+  if (item->failed){
+    fprintf(stderr, "%s: %s\n", item->filename, item->error);
+    item->lib = NULL;
+    item->entries.count = 0;
+    return;
+  }
+  list->pub.libraries[index] = item->lib;
+
+  unsigned i;
+  for (i=0;i<item->entries.count;i++){
+    struct lib_entry *entry = item->entries.entries[i];
+    uint32_t hash = string_hash(entry->name);
+    unsigned slot = hash & (list->slot_size-1);
+    while(list->slots[slot].entry){
+      if (list->slots[slot].hash == hash && strcmp(list->slots[slot].entry->name, entry->name)==0)
+	break;
+      slot = (slot+1) & (list->slot_size-1);
+    }
+    if (list->slots[slot].entry){
+      DEBUGF(LIB, "%s in %s is hidden", entry->name, item->filename);
+      continue;
+    }
+    list->slots[slot] = (struct list_slot){.hash = hash, .library = index, .entry = entry};
+    list->slot_count++;
+  }
+}
+
+struct library_list *library_list_open(const char *filenames[], unsigned count, unsigned thread_count){
+  struct library_list_private *list = calloc(1, sizeof(struct library_list_private));
+  assert(list);
+  list->pub.count = count;
+  list->pub.libraries = calloc(count ? count : 1, sizeof(struct library *));
+  list->items = calloc(count ? count : 1, sizeof(struct list_library));
+  assert(list->pub.libraries && list->items);
+  unsigned i;
+  for (i=0;i<count;i++)
+    list->items[i].filename = filenames[i];
+
+  // directories are read before anything is merged, but the table can't be sized until then
+  workers_run(thread_count ? thread_count : workers_default_count(), count, open_work, NULL, list);
+  unsigned total = 0;
+  for (i=0;i<count;i++)
+    if (!list->items[i].failed)
+      total += list->items[i].entries.count;
+  list->slot_size = 64;
+  while(list->slot_size < total*2)
+    list->slot_size *= 2;
+  list->slots = calloc(list->slot_size, sizeof(struct list_slot));
+  assert(list->slots);
+  for (i=0;i<count;i++)
+    merge_library(list, i);
+
+  DEBUGF(LIB, "%u entries in %u libraries, %u visible", total, count, list->slot_count);
+  return (struct library_list *)list;
+}
+
+void library_list_close(struct library_list *library_list){
+  struct library_list_private *list = (struct library_list_private *)library_list;
+  unsigned i;
+  for (i=0;i<list->pub.count;i++){
+    if (list->pub.libraries[i])
+      lib_close(list->pub.libraries[i]);
+    free(list->items[i].entries.entries);
+  }
+  free(list->slots);
+  free(list->items);
+  free(list->pub.libraries);
+  free(list);
+}
+
+struct lib_entry *library_list_find(struct library_list *library_list, const char *entry_name, struct library **lib){
+  struct library_list_private *list = (struct library_list_private *)library_list;
+  uint32_t hash = string_hash(entry_name);
+  unsigned slot = hash & (list->slot_size-1);
+  while(list->slots[slot].entry){
+    if (list->slots[slot].hash == hash && strcmp(list->slots[slot].entry->name, entry_name)==0){
+      if (lib)
+	*lib = list->pub.libraries[list->slots[slot].library];
+      return list->slots[slot].entry;
+    }
+    slot = (slot+1) & (list->slot_size-1);
+  }
+  return NULL;
+}
+
+void library_list_enumerate(struct library_list *library_list, list_entry_callback callback, void *context){
+  struct library_list_private *list = (struct library_list_private *)library_list;
+  unsigned i, j;
+  for (i=0;i<list->pub.count;i++){
+    struct list_library *item = &list->items[i];
+    for (j=0;j<item->entries.count;j++){
+      // only the winning copy of each name
+      if (library_list_find(library_list, item->entries.entries[j]->name, NULL) == item->entries.entries[j])
+	callback(item->lib, item->entries.entries[j], context);
+    }
+  }
+}
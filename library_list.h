@@ -0,0 +1,30 @@
+
+#ifndef library_list_header
+#define library_list_header
+
+/* An ordered list of libraries, searched the way PowerBuilder searches a library list.
+ * The libraries are opened and their directories read in parallel, then merged into a single name index,
+ * when more than one library has an entry of the same name the first library in the list wins.
+ */
+
+struct library;
+struct lib_entry;
+
+struct library_list{
+  unsigned count;
+  // in list order, NULL where a library couldn't be opened
+  struct library **libraries;
+};
+
+typedef void (*list_entry_callback) (struct library *lib, struct lib_entry *entry, void *context);
+
+// libraries that fail to open are reported on stderr and skipped
+struct library_list *library_list_open(const char *filenames[], unsigned count, unsigned thread_count);
+void library_list_close(struct library_list *list);
+
+// the entry the list resolves the name to, and optionally the library it came from
+struct lib_entry *library_list_find(struct library_list *list, const char *entry_name, struct library **lib);
+// every visible entry, library by library in directory order, skipping names hidden by an earlier library
+void library_list_enumerate(struct library_list *list, list_entry_callback callback, void *context);
+
+#endif
@@ -4,10 +4,24 @@
 #include <stdlib.h>
 #include <execinfo.h>
 #include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <pthread.h>
 #include "lib.h"
+#include "library_list.h"
 #include "debug.h"
 #include "class.h"
 #include "output.h"
+#include "snapshot.h"
+#include "symbols.h"
+#include "universe.h"
+#include "recover.h"
+#include "workers.h"
+#include "export.h"
+#include "diff.h"
+#include "server.h"
+#include "sink.h"
 
 static void trace(){
   void *array[64];
@@ -20,7 +34,16 @@ static void trace(){
   backtrace_symbols_fd(array, size, STDERR_FILENO);
 }
 
+// buffered source going to stdout, written out before an assert or signal ends the process
+static struct sink *stdout_sink;
+
 void __assert_fail(const char * assertion, const char * file, unsigned int line, const char * function) {
+  char message[512];
+  snprintf(message, sizeof message, "(%s) failed at %s:%d in function %s", assertion, file, line, function);
+  // inside a batch, only this entry fails
+  recover_fail(message);
+  if (stdout_sink)
+    sink_flush(stdout_sink);
   fflush(stdout);
   fprintf(stderr, "Assert: (%s) failed at %s:%d in function %s\n", assertion, file, line, function);
   raise(SIGSEGV);
@@ -32,35 +55,560 @@ static void callback(struct lib_entry *entry, void *UNUSED(context)){
 }
 
 static void handler(int sig) {
+  if (stdout_sink)
+    sink_flush(stdout_sink);
   fflush(stdout);
   fprintf(stderr, "Error: signal %d:\n", sig);
   trace();
   exit(-1);
 }
 
-int main(int argc, const char **argv){
+static void usage(const char *name){
+  fprintf(stderr, "Usage %s [-c cache_dir] [-j threads] [-l ancestor_library ...] \"filename\" [\"Object name\"]\n", name);
+  fprintf(stderr, "      %s [-c cache_dir] [-j threads] [-l ancestor_library ...] \"filename\" \"Object name or pattern\"|- ...\n", name);
+  fprintf(stderr, "      %s -a [-c cache_dir] [-j threads] \"filename\"\n", name);
+  fprintf(stderr, "      %s -x out_dir [-c cache_dir] [-j threads] \"filename\"\n", name);
+  fprintf(stderr, "      %s -i index_file \"filename\" ...\n", name);
+  fprintf(stderr, "      %s -H [-j threads] \"filename\" ...\n", name);
+  fprintf(stderr, "      %s -d [-j threads] \"old filename\" \"new filename\"\n", name);
+  fprintf(stderr, "      %s -s socket [-m cached_groups] [-b filter_rate] [-c cache_dir] [\"filename\" ...]\n", name);
+  fprintf(stderr, "      %s -q index_file \"Symbol name\" ...\n", name);
+}
+
+static const char *symbol_kinds[]={NULL, "class", "function", "event", "variable"};
+
+static void print_symbol(const struct symbol *symbol, void *UNUSED(context)){
+  // the kind comes from a file, it may be anything
+  unsigned kind = symbol->kind;
+  const char *kind_name = kind < sizeof symbol_kinds / sizeof symbol_kinds[0] && symbol_kinds[kind] ? symbol_kinds[kind] : "unknown";
+  printf("%s\t%s\t%s\t%s\t%s(%s)\n",
+    kind_name,
+    symbol->owner ? symbol->owner : "",
+    symbol->name,
+    symbol->declaration ? symbol->declaration : "",
+    symbol->library ? symbol->library : "",
+    symbol->entry ? symbol->entry : "");
+}
+
+static int query_index(const char *filename, int argc, char * const *argv){
+  struct symbol_index *index = symbols_open(filename);
+  if (!index){
+    fprintf(stderr, "Failed to open index %s\n", filename);
+    return 1;
+  }
+  int i;
+  for (i=0;i<argc;i++)
+    if (!symbols_find(index, argv[i], print_symbol, NULL))
+      printf("%s not found\n", argv[i]);
+  symbols_close(index);
+  return 0;
+}
+
+// a universe of this library followed by the ancestor libraries, or NULL if there are none
+static struct universe *open_universe(struct library *lib, const char **link_libraries, unsigned link_count){
+  if (!link_count)
+    return NULL;
+  // this library first, so it's own classes win
+  struct universe *universe = universe_create();
+  universe_add_library(universe, lib, 0);
+  unsigned i;
+  for (i=0;i<link_count;i++){
+    struct library *link_lib = lib_open(link_libraries[i]);
+    if (!link_lib){
+      fprintf(stderr, "Failed to open %s\n", link_libraries[i]);
+      continue;
+    }
+    universe_add_library(universe, link_lib, 0);
+    lib_close(link_lib);
+  }
+  return universe;
+}
+
+struct batch_entry{
+  struct lib_entry *entry;
+  // the library the entry is from, when it isn't batch->lib
+  struct library *lib;
+  char *output;
+  size_t output_length;
+  char error[512];
+  int failed;
+};
+
+struct batch{
+  const char *cache_dir;
+  struct library *lib;
+  struct batch_entry *entries;
+  unsigned count;
+  unsigned failed;
+  struct sink *out;
+  // optional, linking isn't thread safe
+  struct universe *universe;
+  pthread_mutex_t universe_lock;
+  // entry headers carry the output length, and failures are reported in line
+  int delimited;
+};
+
+struct batch_work{
+  struct batch *batch;
+  struct batch_entry *item;
+  struct sink out;
+};
+
+static void batch_decompile(void *context){
+  struct batch_work *work = context;
+  struct batch *batch = work->batch;
+  struct library *lib = work->item->lib ? work->item->lib : batch->lib;
+  struct class_group *class_group = batch->cache_dir ?
+    class_parse_cached(batch->cache_dir, lib, work->item->entry) : class_parse(work->item->entry);
+  if (batch->universe){
+    struct recover_cleanup cleanup;
+    recover_lock(&batch->universe_lock, &cleanup);
+    universe_link(batch->universe, class_group);
+    recover_unlock(&batch->universe_lock, &cleanup);
+  }
+  write_group(&work->out, class_group);
+  class_free(class_group);
+}
+
+static void batch_work(unsigned index, void *context){
+  struct batch *batch = context;
+  struct batch_work work = {
+    .batch = batch,
+    .item = &batch->entries[index],
+  };
+  // buffered, so a failure part way through doesn't leave half an entry in the output
+  sink_open_memory(&work.out);
+  work.item->failed = recover_run(batch_decompile, &work, work.item->error, sizeof work.item->error) != 0;
+  work.item->output = sink_take(&work.out, &work.item->output_length);
+}
+
+static void batch_deliver(unsigned index, void *context){
+  struct batch *batch = context;
+  struct batch_entry *item = &batch->entries[index];
+  if (item->failed){
+    batch->failed++;
+    if (batch->delimited)
+      sink_printf(batch->out, "Failed %s: %s\n", item->entry->name, item->error);
+  }else if (batch->delimited){
+    sink_printf(batch->out, "Entry %s %zu\n", item->entry->name, item->output_length);
+    sink_write(batch->out, item->output, item->output_length);
+  }else{
+    sink_printf(batch->out, "Entry %s\n", item->entry->name);
+    sink_write(batch->out, item->output, item->output_length);
+  }
+  free(item->output);
+  item->output = NULL;
+}
+
+static void batch_add(struct lib_entry *entry, void *context){
+  struct batch *batch = context;
+  if (class_is_compiled_entry(entry->name))
+    batch->entries[batch->count++].entry = entry;
+}
+
+static void batch_count(struct lib_entry *entry, void *context){
+  unsigned *count = context;
+  if (class_is_compiled_entry(entry->name))
+    (*count)++;
+}
+
+// decompile every compiled entry, reporting failures at the end instead of stopping
+static int batch_run(const char *filename, const char *cache_dir, unsigned thread_count){
+  struct library *lib = lib_open(filename);
+  if (!lib){
+    fprintf(stderr, "Failed to open %s\n", filename);
+    return 1;
+  }
+  unsigned count = 0;
+  lib_enumerate(lib, batch_count, &count);
+
+  struct sink out;
+  fflush(stdout);
+  sink_open_fd(&out, STDOUT_FILENO);
+  struct batch batch = {
+    .cache_dir = cache_dir,
+    .lib = lib,
+    .out = &out,
+    .entries = calloc(count ? count : 1, sizeof(struct batch_entry)),
+  };
+  assert(batch.entries);
+  lib_enumerate(lib, batch_add, &batch);
+  workers_run(thread_count ? thread_count : workers_default_count(), batch.count, batch_work, batch_deliver, &batch);
+
+  sink_close(&out);
+  fprintf(stderr, "%u entries, %u failed\n", batch.count, batch.failed);
+  unsigned i;
+  for (i=0;i<batch.count;i++)
+    if (batch.entries[i].failed)
+      fprintf(stderr, "  %s: %s\n", batch.entries[i].entry->name, batch.entries[i].error);
+  free(batch.entries);
+  lib_close(lib);
+  return batch.failed ? 2 : 0;
+}
+
+struct request_run{
+  struct batch batch;
+  struct library_list *list;
+  unsigned thread_count;
+  // every visible compiled entry, listed the first time a pattern is used
+  struct batch_entry *compiled;
+  unsigned compiled_count;
+  int listed;
+  unsigned missing;
+};
+
+static void request_list(struct library *lib, struct lib_entry *entry, void *context){
+  struct request_run *run = context;
+  if (!class_is_compiled_entry(entry->name))
+    return;
+  if ((run->compiled_count & (run->compiled_count - 1)) == 0){
+    run->compiled = realloc(run->compiled, (run->compiled_count ? run->compiled_count*2 : 1) * sizeof(struct batch_entry));
+    assert(run->compiled);
+  }
+  run->compiled[run->compiled_count++] = (struct batch_entry){.entry = entry, .lib = lib};
+}
+
+// decompile every entry matching an entry name or glob pattern
+static void request_one(struct request_run *run, const char *request){
+  struct batch *batch = &run->batch;
+  batch->count = 0;
+  if (strpbrk(request, "*?[")){
+    if (!run->listed){
+      library_list_enumerate(run->list, request_list, run);
+      run->listed = 1;
+    }
+    batch->entries = calloc(run->compiled_count ? run->compiled_count : 1, sizeof(struct batch_entry));
+    assert(batch->entries);
+    unsigned i;
+    for (i=0;i<run->compiled_count;i++)
+      if (fnmatch(request, run->compiled[i].entry->name, 0)==0)
+	batch->entries[batch->count++] = run->compiled[i];
+  }else{
+    batch->entries = calloc(1, sizeof(struct batch_entry));
+    assert(batch->entries);
+    struct library *lib;
+    struct lib_entry *entry = library_list_find(run->list, request, &lib);
+    if (entry && class_is_compiled_entry(entry->name))
+      batch->entries[batch->count++] = (struct batch_entry){.entry = entry, .lib = lib};
+  }
+
+  if (batch->count){
+    workers_run(run->thread_count, batch->count, batch_work, batch_deliver, batch);
+  }else{
+    sink_printf(batch->out, "Missing %s\n", request);
+    run->missing++;
+  }
+  free(batch->entries);
+  batch->entries = NULL;
+}
+
+// answer each line of stdin as it arrives, so another process can drive us through a pipe
+static void request_stream(struct request_run *run){
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  while((len = getline(&line, &size, stdin)) >= 0){
+    while(len>0 && (line[len-1]=='\n' || line[len-1]=='\r'))
+      line[--len] = 0;
+    if (!len)
+      continue;
+    request_one(run, line);
+    sink_printf(run->batch.out, "Done %s\n", line);
+    sink_flush(run->batch.out);
+  }
+  free(line);
+}
+
+// decompile many entries, named, matched by patterns, or read from stdin when the name is "-".
+// names are resolved through the library and then the ancestor libraries, like a library list
+static int request_run(const char *filename, char * const *names, unsigned name_count,
+    const char *cache_dir, const char **link_libraries, unsigned link_count, unsigned thread_count){
+  const char *filenames[link_count + 1];
+  filenames[0] = filename;
+  memcpy(filenames + 1, link_libraries, link_count * sizeof(const char *));
+  struct library_list *list = library_list_open(filenames, link_count + 1, thread_count);
+  struct library *lib = list->libraries[0];
+  if (!lib){
+    library_list_close(list);
+    return 1;
+  }
+
+  // every library in the list, in the same order
+  struct universe *universe = NULL;
+  unsigned i;
+  if (link_count){
+    universe = universe_create();
+    for (i=0;i<list->count;i++)
+      if (list->libraries[i])
+	universe_add_library(universe, list->libraries[i], 0);
+  }
+
+  struct sink out;
+  fflush(stdout);
+  sink_open_fd(&out, STDOUT_FILENO);
+  struct request_run run = {
+    .batch = {
+      .cache_dir = cache_dir,
+      .lib = lib,
+      .out = &out,
+      .universe = universe,
+      .delimited = 1,
+    },
+    .list = list,
+    .thread_count = thread_count ? thread_count : workers_default_count(),
+  };
+  pthread_mutex_init(&run.batch.universe_lock, NULL);
+
+  for (i=0;i<name_count;i++){
+    if (strcmp(names[i], "-")==0)
+      request_stream(&run);
+    else
+      request_one(&run, names[i]);
+  }
+
+  sink_close(&out);
+  if (run.batch.failed || run.missing)
+    fprintf(stderr, "%u failed, %u not found\n", run.batch.failed, run.missing);
+  pthread_mutex_destroy(&run.batch.universe_lock);
+  universe_free(run.batch.universe);
+  free(run.compiled);
+  library_list_close(list);
+  return run.batch.failed || run.missing ? 2 : 0;
+}
+
+struct hash_library{
+  const char *filename;
+  struct sink out;
+  unsigned count;
+  uint64_t *hashes;
+  char error[512];
+  int failed;
+};
+
+struct hash_run{
+  struct hash_library *libraries;
+  uint64_t *hashes;
+  unsigned count;
+  unsigned failed;
+};
+
+static void hash_entry(struct lib_entry *entry, void *context){
+  struct hash_library *item = context;
+  uint64_t hash = lib_entry_hash(entry);
+  sink_printf(&item->out, "%016llx\t%zu\t%s(%s)\n", (unsigned long long)hash, entry->length, item->filename, entry->name);
+  if ((item->count & (item->count - 1)) == 0){
+    item->hashes = realloc(item->hashes, (item->count ? item->count*2 : 1) * sizeof(uint64_t));
+    assert(item->hashes);
+  }
+  item->hashes[item->count++] = hash;
+}
+
+static void close_library(void *context){
+  lib_close(context);
+}
+
+static void hash_library(void *context){
+  struct hash_library *item = context;
+  struct library *lib = lib_open(item->filename);
+  if (!lib)
+    recover_fail("Failed to open library");
+  struct recover_cleanup cleanup;
+  recover_push(&cleanup, close_library, lib);
+  lib_enumerate(lib, hash_entry, item);
+  recover_pop(&cleanup);
+  lib_close(lib);
+}
+
+static void hash_work(unsigned index, void *context){
+  struct hash_run *run = context;
+  struct hash_library *item = &run->libraries[index];
+  sink_open_memory(&item->out);
+  item->failed = recover_run(hash_library, item, item->error, sizeof item->error) != 0;
+}
+
+static void hash_deliver(unsigned index, void *context){
+  struct hash_run *run = context;
+  struct hash_library *item = &run->libraries[index];
+  if (item->failed){
+    run->failed++;
+  }else{
+    fwrite(item->out.data, 1, item->out.length, stdout);
+    run->hashes = realloc(run->hashes, (run->count + item->count + 1) * sizeof(uint64_t));
+    assert(run->hashes);
+    memcpy(run->hashes + run->count, item->hashes, item->count * sizeof(uint64_t));
+    run->count += item->count;
+  }
+  sink_close(&item->out);
+  free(item->hashes);
+  item->hashes = NULL;
+}
+
+static int hash_compare(const void *a, const void *b){
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// hash every entry of each library, one library per worker
+static int hash_run(int argc, char * const *argv, unsigned thread_count){
+  struct hash_run run = {
+    .libraries = calloc(argc, sizeof(struct hash_library)),
+  };
+  assert(run.libraries);
+  int i;
+  for (i=0;i<argc;i++)
+    run.libraries[i].filename = argv[i];
+  workers_run(thread_count ? thread_count : workers_default_count(), argc, hash_work, hash_deliver, &run);
+  fflush(stdout);
+
+  unsigned distinct = 0, j;
+  if (run.count)
+    qsort(run.hashes, run.count, sizeof(uint64_t), hash_compare);
+  for (j=0;j<run.count;j++)
+    if (j==0 || run.hashes[j] != run.hashes[j-1])
+      distinct++;
+  fprintf(stderr, "%u entries in %d libraries, %u distinct\n", run.count, argc - (int)run.failed, distinct);
+  for (i=0;i<argc;i++)
+    if (run.libraries[i].failed)
+      fprintf(stderr, "  %s: %s\n", run.libraries[i].filename, run.libraries[i].error);
+  free(run.hashes);
+  free(run.libraries);
+  return run.failed ? 2 : 0;
+}
+
+int main(int argc, char * const *argv){
   signal(SIGSEGV, handler);
 
-  if (argc<2){
-    fprintf(stderr, "Usage %s \"filename\" [\"Object name\"]\n", argv[0]);
+  const char *cache_dir = NULL;
+  const char *index_file = NULL;
+  const char *query_file = NULL;
+  const char *export_dir = NULL;
+  const char *socket_path = NULL;
+  unsigned cache_size = 0;
+  double filter_rate = 0;
+  int batch = 0;
+  int hash = 0;
+  int diff = 0;
+  unsigned thread_count = 0;
+  const char *link_libraries[argc];
+  unsigned link_count = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "ab:c:dHi:j:m:q:l:s:x:")) != -1){
+    switch(opt){
+      case 'a':
+	batch = 1;
+	break;
+      case 'b':
+	filter_rate = atof(optarg);
+	if (filter_rate <= 0 || filter_rate >= 1){
+	  fprintf(stderr, "The filter rate must be between 0 and 1\n");
+	  return 1;
+	}
+	break;
+      case 'c':
+	cache_dir = optarg;
+	break;
+      case 'd':
+	diff = 1;
+	break;
+      case 'H':
+	hash = 1;
+	break;
+      case 'i':
+	index_file = optarg;
+	break;
+      case 'j':
+	thread_count = atoi(optarg);
+	break;
+      case 'm':
+	cache_size = atoi(optarg);
+	break;
+      case 'q':
+	query_file = optarg;
+	break;
+      case 'l':
+	link_libraries[link_count++] = optarg;
+	break;
+      case 's':
+	socket_path = optarg;
+	break;
+      case 'x':
+	export_dir = optarg;
+	break;
+      default:
+	usage(argv[0]);
+	return 1;
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  // libraries are optional, they can be named by each request
+  if (socket_path)
+    return server_run(socket_path, (const char **)argv, argc, cache_size, filter_rate, cache_dir);
+
+  if (argc<1){
+    usage(argv[-optind]);
     return 0;
   }
 
-  struct library *lib = lib_open(argv[1]);
+  if (query_file)
+    return query_index(query_file, argc, argv);
+
+  if (hash)
+    return hash_run(argc, argv, thread_count);
+
+  if (diff){
+    if (argc != 2){
+      usage(argv[-optind]);
+      return 2;
+    }
+    return diff_libraries(argv[0], argv[1], thread_count);
+  }
+
+  if (batch)
+    return batch_run(argv[0], cache_dir, thread_count);
+
+  if (export_dir)
+    return export_library(argv[0], export_dir, cache_dir, thread_count);
+
+  if (index_file){
+    if (symbols_build(index_file, (const char **)argv, argc, 0)!=0){
+      fprintf(stderr, "Failed to write index %s\n", index_file);
+      return 1;
+    }
+    return 0;
+  }
+
+  // more than one object, a pattern, or a stream of names
+  if (argc>2 || (argc==2 && (strpbrk(argv[1], "*?[") || strcmp(argv[1], "-")==0)))
+    return request_run(argv[0], argv+1, argc-1, cache_dir, link_libraries, link_count, thread_count);
+
+  struct library *lib = lib_open(argv[0]);
   if (lib){
     printf("opened %s (%s, comment %s)\n", lib->filename, lib->unicode?"unicode":"ansi", lib->comment);
-    if (argc>=3){
-      printf("Finding %s...\n", argv[2]);
-      struct lib_entry *entry = lib_find(lib, argv[2]);
+    if (argc>=2){
+      printf("Finding %s...\n", argv[1]);
+      struct lib_entry *entry = lib_find(lib, argv[1]);
       if (entry){
-	struct class_group *class_group = class_parse(entry);
-	write_group(stdout, class_group);
+	struct universe *universe = open_universe(lib, link_libraries, link_count);
+	struct class_group *class_group = cache_dir ? class_parse_cached(cache_dir, lib, entry) : class_parse(entry);
+	if (universe)
+	  universe_link(universe, class_group);
+	// scripts are only disassembled in parallel when asked to
+	struct sink out;
+	fflush(stdout);
+	sink_open_fd(&out, STDOUT_FILENO);
+	stdout_sink = &out;
+	write_group_threads(&out, class_group, thread_count ? thread_count : 1);
+	stdout_sink = NULL;
+	sink_close(&out);
 	class_free(class_group);
+	universe_free(universe);
       }else{
 	printf("Not found?\n");
       }
     }else{
-      printf("Enumerating %s...\n", argv[1]);
+      printf("Enumerating %s...\n", argv[0]);
       lib_enumerate(lib, callback, NULL);
     }
     printf("Closing...\n");
@@ -1,5 +1,8 @@
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "disassembly.h"
 #include "pool_alloc.h"
 #include "debug.h"
@@ -55,62 +58,213 @@
 #undef AFTER
 
 
-// 3) declare which pcode instruction numbers relate to which operations for each version of PB
+// 3) every definition once, indexed by id
 
+#define BEFORE(X) 1
+#define AFTER(X) 1
+#define __DEFINE(NAME,ARGS,...) & OP_##NAME##_##ARGS ,
+
+struct pcode_def *pcode_defs[MAX_ID] = {
+#include "opcodes.inc"
+};
+
+#undef __DEFINE
+#undef BEFORE
+#undef AFTER
+
+
+// 4) declare which pcode instruction numbers relate to which ids, for each range of PB versions
+// a range starts at each version that opcodes.inc tests, and runs until the next one
 
 #define BEFORE(X) (PBVERSION < X)
 #define AFTER(X) (PBVERSION >= X)
-#define __DEFINE(NAME,ARGS,...) & OP_##NAME##_##ARGS ,
+#define __DEFINE(NAME,ARGS,...) NAME##_##ARGS ,
 
 #define PBVERSION PB50
-struct pcode_def *PB50_opcodes[] = {
+static const uint16_t PB50_ids[] = {
+#include "opcodes.inc"
+};
+#undef PBVERSION
+
+#define PBVERSION PB60
+static const uint16_t PB60_ids[] = {
 #include "opcodes.inc"
 };
 #undef PBVERSION
 
 #define PBVERSION PB80
-struct pcode_def *PB80_opcodes[] = {
+static const uint16_t PB80_ids[] = {
 #include "opcodes.inc"
 };
 #undef PBVERSION
 
 #define PBVERSION PB90
-struct pcode_def *PB90_opcodes[] = {
+static const uint16_t PB90_ids[] = {
 #include "opcodes.inc"
 };
 #undef PBVERSION
 
 #define PBVERSION PB100
-struct pcode_def *PB100_opcodes[] = {
+static const uint16_t PB100_ids[] = {
 #include "opcodes.inc"
 };
 #undef PBVERSION
 
 #define PBVERSION PB105
-struct pcode_def *PB105_opcodes[] = {
+static const uint16_t PB105_ids[] = {
 #include "opcodes.inc"
 };
 #undef PBVERSION
 
 #define PBVERSION PB120
-struct pcode_def *PB120_opcodes[] = {
+static const uint16_t PB120_ids[] = {
 #include "opcodes.inc"
 };
 #undef PBVERSION
 
 #define PBVERSION PB150
-struct pcode_def *PB150_opcodes[] = {
+static const uint16_t PB150_ids[] = {
 #include "opcodes.inc"
 };
 #undef PBVERSION
 
+#undef __DEFINE
+#undef BEFORE
+#undef AFTER
+
 #define NELS(A) (sizeof (A) / sizeof *(A))
+#define RANGE(X) {X, NELS(X##_ids), X##_ids}
+
+// in version order
+static const struct opcode_table opcode_tables[] = {
+  RANGE(PB50),
+  RANGE(PB60),
+  RANGE(PB80),
+  RANGE(PB90),
+  RANGE(PB100),
+  RANGE(PB105),
+  RANGE(PB120),
+  RANGE(PB150),
+};
+
+#undef RANGE
+
+const struct opcode_table *opcode_table(unsigned compiler_version){
+  unsigned i = NELS(opcode_tables);
+  // PocketBuilder versions sit between PB80 and PB90, and share the PB80 table
+  while(i > 1 && opcode_tables[i-1].first_version > compiler_version)
+    i--;
+  return &opcode_tables[i-1];
+}
+
+static const char *operator_text(enum operation operation){
+  switch(operation){
+    case OP_EQ: return " = ";
+    case OP_NE: return " <> ";
+    case OP_GT: return " > ";
+    case OP_LT: return " < ";
+    case OP_GE: return " >= ";
+    case OP_LE: return " <= ";
+    case OP_CAT: return " + ";
+    case OP_ADD: return " + ";
+    case OP_SUB: return " - ";
+    case OP_MULT: return " * ";
+    case OP_DIV: return " / ";
+    case OP_POWER: return " ^ ";
+    case OP_NEGATE: return "-";
+    case OP_AND: return " and ";
+    case OP_OR: return " or ";
+    case OP_NOT: return "not ";
+    case OP_ASSIGN: return " = ";
+    case OP_ASSIGNINCR: return "++";
+    case OP_ASSIGNDECR: return "--";
+    case OP_ASSIGNADD: return " += ";
+    case OP_ASSIGNSUB: return " -= ";
+    case OP_ASSIGNMULT: return " *= ";
+    default: return NULL;
+  }
+}
+
+static int token_has_index(enum token_types kind){
+  switch(kind){
+    case STACK_CSV:
+    case STACK_DOT_CSV:
+    case ARG_CSV:
+    case OPERATOR:
+    case FUNC_CLASS:
+    case END:
+      return 0;
+    default:
+      return 1;
+  }
+}
+
+// tokens mix small integers with strings, sort that out once.
+// operators and statement ends become literal text, and adjacent text is merged
+static void decode_steps(struct pcode_def *def){
+  unsigned count = 0;
+  const char **tokens;
+  // an index may be 0, so skip them while counting
+  for (tokens = def->tokens; *tokens; tokens++){
+    if ((uintptr_t)*tokens < MAX_TOKEN && token_has_index((enum token_types)(uintptr_t)*tokens))
+      tokens++;
+    count++;
+  }
+  if (!count)
+    return;
+
+  // lives as long as the tables themselves
+  struct emit_step *steps = malloc(count * sizeof(struct emit_step));
+  assert(steps);
+  unsigned step_count = 0;
+  int merged_prev = 0;
+  for (tokens = def->tokens; *tokens; tokens++){
+    struct emit_step step = {0};
+    if ((uintptr_t)*tokens < MAX_TOKEN){
+      step.kind = (enum token_types)(uintptr_t)*tokens;
+      if (step.kind == OPERATOR && operator_text(def->operation)){
+	step.kind = TEXT;
+	step.text = operator_text(def->operation);
+      }else if (step.kind == END){
+	step.kind = TEXT;
+	step.text = ";";
+      }else if (token_has_index(step.kind)){
+	step.index = (unsigned)(uintptr_t)*(++tokens);
+      }
+    }else{
+      step.text = *tokens;
+    }
+
+    if (step.kind == TEXT){
+      step.length = strlen(step.text);
+      struct emit_step *prev = step_count ? &steps[step_count - 1] : NULL;
+      if (prev && prev->kind == TEXT){
+	char *merged = malloc(prev->length + step.length + 1);
+	assert(merged);
+	memcpy(merged, prev->text, prev->length);
+	memcpy(merged + prev->length, step.text, step.length + 1);
+	if (merged_prev)
+	  free((char *)prev->text);
+	merged_prev = 1;
+	prev->text = merged;
+	prev->length += step.length;
+	continue;
+      }
+    }
+    steps[step_count++] = step;
+    merged_prev = 0;
+  }
+  def->steps = steps;
+  def->step_count = step_count;
+}
 
-unsigned PB50_maxcode = NELS(PB50_opcodes);
-unsigned PB80_maxcode = NELS(PB80_opcodes);
-unsigned PB90_maxcode = NELS(PB90_opcodes);
-unsigned PB100_maxcode = NELS(PB100_opcodes);
-unsigned PB105_maxcode = NELS(PB105_opcodes);
-unsigned PB120_maxcode = NELS(PB120_opcodes);
-unsigned PB150_maxcode = NELS(PB150_opcodes);
+static void init_steps(){
+  unsigned i;
+  for (i=0;i<MAX_ID;i++)
+    decode_steps(pcode_defs[i]);
+}
 
+void pcode_steps_init(){
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, init_steps);
+}
@@ -1,47 +1,51 @@
+#include <stdlib.h>
+#include <assert.h>
 #include "output.h"
 #include "class.h"
 #include "debug.h"
 #include "disassembly.h"
+#include "workers.h"
+#include "sink.h"
 
-static void write_variable(FILE *fd, struct variable_definition *variable){
+void write_variable(struct sink *out, struct variable_definition *variable){
   if (variable->read_access || variable->write_access){
     if (variable->read_access == variable->write_access){
-      fprintf(fd, "%s ", variable->read_access);
+      sink_printf(out, "%s ", variable->read_access);
     }else{
       if (variable->read_access)
-	fprintf(fd, "%sread ", variable->read_access);
+	sink_printf(out, "%sread ", variable->read_access);
       if (variable->write_access)
-	fprintf(fd, "%swrite ", variable->write_access);
+	sink_printf(out, "%swrite ", variable->write_access);
     }
   }
   if (variable->constant)
-    fprintf(fd, "constant ");
+    sink_puts(out, "constant ");
   if (variable->indirect)
-    fprintf(fd, "indirect ");
-  fprintf(fd, "%s %s", variable->type, variable->name);
+    sink_puts(out, "indirect ");
+  sink_printf(out, "%s %s", variable->type, variable->name);
   if (variable->dimensions)
-    fprintf(fd, "%s", variable->dimensions);
+    sink_puts(out, variable->dimensions);
 
   if (variable->value_count && variable->initial_values){
-    fputs(" = ", fd);
+    sink_puts(out, " = ");
     if (variable->indirect || variable->dimensions || variable->value_count>1)
-      fputs("{", fd);
+      sink_putc(out, '{');
 
     unsigned i;
     for(i=0;i<variable->value_count;i++){
       if (i>0)
-	fputs(", ", fd);
+	sink_puts(out, ", ");
       if (variable->initial_values[i])
-	fputs(variable->initial_values[i], fd);
+	sink_puts(out, variable->initial_values[i]);
     }
 
     if (variable->indirect || variable->dimensions || variable->value_count>1)
-      fputs("}", fd);
+      sink_putc(out, '}');
   }
-  fprintf(fd, "\n");
+  sink_putc(out, '\n');
 }
 
-static void write_variables(FILE *fd, int user_defined, const char *type, struct variable_definition *variable[]){
+static void write_variables(struct sink *out, int user_defined, const char *type, struct variable_definition *variable[]){
   if (!variable)
     return;
   int found = 0;
@@ -51,142 +55,143 @@ static void write_variables(FILE *fd, int user_defined, const char *type, struct
       if (!found){
 	found = 1;
 	if (type)
-	  fprintf(fd, "%s variables\n", type);
+	  sink_printf(out, "%s variables\n", type);
       }
-      write_variable(fd, variable[i]);
+      write_variable(out, variable[i]);
     }
   }
 
   if (found && type)
-    fprintf(fd, "end variables\n\n");
+    sink_puts(out, "end variables\n\n");
 }
 
-static int write_type_dec(FILE *fd, struct type_definition *type_def){
+int write_type_dec(struct sink *out, struct type_definition *type_def){
   if (type_def->type != enum_type && type_def->type != class_type)
     return 0;
 
   // global?
   if (type_def->system)
-    fprintf(fd, "system ");
-  fprintf(fd, "type %s", type_def->name);
+    sink_puts(out, "system ");
+  sink_printf(out, "type %s", type_def->name);
 
   if (type_def->type == class_type){
     struct class_definition *class_def = type_def->class_definition;
     if (class_def->ancestor)
-      fprintf(fd, " from %s", class_def->ancestor);
+      sink_printf(out, " from %s", class_def->ancestor);
     if (class_def->parent)
-      fprintf(fd, " within %s", class_def->parent);
+      sink_printf(out, " within %s", class_def->parent);
     if (class_def->autoinstantiate)
-      fprintf(fd, " autoinstantiate");
+      sink_puts(out, " autoinstantiate");
   }else{
-    fprintf(fd, " enumerated");
+    sink_puts(out, " enumerated");
   }
-  fprintf(fd, "\n");
+  sink_putc(out, '\n');
   return 1;
 }
 
-static void write_forward(FILE *fd, struct class_group *group){
-  fprintf(fd, "forward\n");
+static void write_forward(struct sink *out, struct class_group *group){
+  sink_puts(out, "forward\n");
   // TODO this probably isn't quite right for nested classes, eg menu's
   unsigned i;
   for (i=0;i<group->type_count;i++){
-    if (!write_type_dec(fd, &group->types[i]))
+    if (!write_type_dec(out, &group->types[i]))
       continue;
 
     if (group->types[i].type == enum_type){
       struct enumeration *enum_def = group->types[i].enum_definition;
       unsigned j;
       for (j=0;j<enum_def->value_count;j++)
-	fprintf(fd, "%s! = %u\n", enum_def->values[j].name, enum_def->values[j].value);
+	sink_printf(out, "%s! = %u\n", enum_def->values[j].name, enum_def->values[j].value);
     }
 
-    fprintf(fd, "end type\n");
+    sink_puts(out, "end type\n");
   }
-  write_variables(fd, 0, NULL, group->global_variables);
-  fprintf(fd, "end forward\n\n");
+  write_variables(out, 0, NULL, group->global_variables);
+  sink_puts(out, "end forward\n\n");
 }
 
-static void write_method_header(FILE *fd, struct script_definition *script){
+void write_method_header(struct sink *out, struct script_definition *script){
   if (script->hidden){
     // not sure what the right syntax is for this undocumented flag
-    fprintf(fd, "/* Deprecated */ ");
+    sink_puts(out, "/* Deprecated */ ");
   }
   if (script->event_type){
-    fprintf(fd, "event %s %s", script->name+1, script->event_type);
+    sink_printf(out, "event %s %s", script->name+1, script->event_type);
     return;
   }else if(script->event){
     if (script->return_type)
-      fprintf(fd, "event type %s %s(", script->return_type, script->name);
+      sink_printf(out, "event type %s %s(", script->return_type, script->name);
     else
-      fprintf(fd, "event %s(", script->name);
+      sink_printf(out, "event %s(", script->name);
   } else if (script->return_type){
-    fprintf(fd, "%s function %s %s(",
+    sink_printf(out, "%s function %s %s(",
       script->access?script->access:"public",
       script->return_type,
       script->name);
   }else{
-    fprintf(fd, "%s subroutine %s(",
+    sink_printf(out, "%s subroutine %s(",
       script->access?script->access:"public",
       script->name);
   }
   unsigned i;
   for(i=0; i<script->argument_count; i++){
     if (i>0)
-      fprintf(fd, ", ");
+      sink_puts(out, ", ");
     struct argument_definition *arg = script->arguments[i];
     if (arg->access)
-      fprintf(fd, "%s ", arg->access);
-    fprintf(fd, "%s", arg->type);
+      sink_printf(out, "%s ", arg->access);
+    // no name for type 0, printf used to show "(null)"
+    sink_puts(out, arg->type ? arg->type : "(null)");
     if (arg->name)
-      fprintf(fd, " %s", arg->name);
+      sink_printf(out, " %s", arg->name);
     if (arg->dimensions)
-      fprintf(fd, "%s", arg->dimensions);
+      sink_puts(out, arg->dimensions);
   }
-  fprintf(fd,")");
+  sink_putc(out, ')');
   for (i=0; i<script->throws_count; i++){
     if (i==0)
-      fprintf(fd, " throws %s", script->throws[i]);
+      sink_printf(out, " throws %s", script->throws[i]);
     else
-      fprintf(fd, ", %s", script->throws[i]);
+      sink_printf(out, ", %s", script->throws[i]);
   }
   if (script->rpc)
-    fprintf(fd, " rpcfunc");
+    sink_puts(out, " rpcfunc");
   if (script->library){
     if (script->system)
-      fprintf(fd, " system");
-    fprintf(fd, " library \"%s\"", script->library);
+      sink_puts(out, " system");
+    sink_printf(out, " library \"%s\"", script->library);
   }
   if (script->external_name)
-    fprintf(fd, " alias for \"%s\"", script->external_name);
+    sink_printf(out, " alias for \"%s\"", script->external_name);
 }
 
-static void write_prototypes(FILE *fd, int external, struct class_definition *class_def){
+static void write_prototypes(struct sink *out, int external, struct class_definition *class_def){
   int found=0;
   unsigned i;
   for (i=0;class_def->scripts[i];i++){
     struct script_definition *script = class_def->scripts[i];
     if (!script->event && external == (script->library ? 1:0)){
       if (!found){
-	fprintf(fd, "%s prototypes\n", external?"type":"forward");
+	sink_printf(out, "%s prototypes\n", external?"type":"forward");
 	found = 1;
       }
-      write_method_header(fd, script);
-      fprintf(fd,"\n");
+      write_method_header(out, script);
+      sink_putc(out, '\n');
     }
   }
   if (found)
-    fprintf(fd, "end prototypes\n\n");
+    sink_puts(out, "end prototypes\n\n");
 }
 
-static void write_script_body(FILE *fd, struct class_group *group, struct class_definition *class_def, struct script_definition *script){
-  write_method_header(fd, script);
-  fprintf(fd, ";");
+void write_script(struct sink *out, struct class_group *group, struct class_definition *class_def, struct script_definition *script){
+  write_method_header(out, script);
+  sink_putc(out, ';');
   // variable declarations, skipping arguments
-  write_variables(fd, 0, NULL, script->local_variables + script->argument_count);
+  write_variables(out, 0, NULL, script->local_variables + script->argument_count);
   struct disassembly *code = disassemble(group, class_def, script);
   if (code){
 
-    dump_statements(fd, code);
+    dump_statements(out, code);
 
     //fprintf(fd, "/* Resource table;\n");
     //dump_script_resources(fd, group, script);
@@ -195,43 +200,111 @@ static void write_script_body(FILE *fd, struct class_group *group, struct class_
     //fprintf(fd, "*/\n");
     disassembly_free(code);
   }else{
-    dump_raw_pcode(fd, script);
+    dump_raw_pcode(out, script);
   }
 
   if (script->event)
-    fprintf(fd, "\nend event\n\n");
+    sink_puts(out, "\nend event\n\n");
   else if(script->return_type)
-    fprintf(fd, "\nend function\n\n");
+    sink_puts(out, "\nend function\n\n");
   else
-    fprintf(fd, "\nend subroutine\n\n");
+    sink_puts(out, "\nend subroutine\n\n");
 }
 
-static void write_class(FILE *fd, struct class_group *UNUSED(group), struct type_definition *type_def){
+struct script_bodies{
+  struct class_group *group;
+  struct class_definition *class_def;
+  struct script_definition **scripts;
+  struct sink *buffers;
+  struct sink *out;
+};
+
+static void script_body_work(unsigned index, void *context){
+  struct script_bodies *bodies = context;
+  sink_open_memory(&bodies->buffers[index]);
+  write_script(&bodies->buffers[index], bodies->group, bodies->class_def, bodies->scripts[index]);
+}
+
+static void script_body_deliver(unsigned index, void *context){
+  struct script_bodies *bodies = context;
+  sink_write(bodies->out, bodies->buffers[index].data, bodies->buffers[index].length);
+  sink_close(&bodies->buffers[index]);
+}
+
+// disassemble scripts on a pool of threads, writing them in the same order as write_class would
+static void write_script_bodies(struct sink *out, struct class_group *group, struct class_definition *class_def, unsigned thread_count){
+  unsigned count = 0;
+  unsigned i;
+  for (i=0;class_def->scripts[i];i++)
+    if (class_def->scripts[i]->implemented)
+      count++;
+  if (!count)
+    return;
+
+  struct script_bodies bodies = {
+    .group = group,
+    .class_def = class_def,
+    .scripts = malloc(count * sizeof(struct script_definition *)),
+    .buffers = calloc(count, sizeof(struct sink)),
+    .out = out,
+  };
+  assert(bodies.scripts && bodies.buffers);
+
+  // first the functions, then the events
+  count = 0;
+  for (i=0;class_def->scripts[i];i++)
+    if (class_def->scripts[i]->implemented && !class_def->scripts[i]->event)
+      bodies.scripts[count++] = class_def->scripts[i];
+  for (i=0;class_def->scripts[i];i++)
+    if (class_def->scripts[i]->implemented && class_def->scripts[i]->event)
+      bodies.scripts[count++] = class_def->scripts[i];
+
+  class_share(group);
+  workers_run(thread_count, count, script_body_work, script_body_deliver, &bodies);
+
+  free(bodies.scripts);
+  free(bodies.buffers);
+}
+
+// everything but the script bodies
+static void write_class_declarations(struct sink *out, struct type_definition *type_def){
   struct class_definition *class_def = type_def->class_definition;
 
-  write_type_dec(fd, type_def);
-  write_variables(fd, 0, NULL, class_def->instance_variables);
+  write_type_dec(out, type_def);
+  write_variables(out, 0, NULL, class_def->instance_variables);
 
   unsigned i;
   for (i=0;class_def->scripts[i];i++){
     if (class_def->scripts[i]->event && !class_def->scripts[i]->in_ancestor){
-      write_method_header(fd, class_def->scripts[i]);
-      fprintf(fd,"\n");
+      write_method_header(out, class_def->scripts[i]);
+      sink_putc(out, '\n');
     }
   }
 
-  fprintf(fd, "end type\n\n");
+  sink_puts(out, "end type\n\n");
 
   // TODO global variable goes here?
-  write_prototypes(fd, 1, class_def);
-  write_variables(fd, 1, "type", class_def->instance_variables);
-  write_prototypes(fd, 0, class_def);
+  write_prototypes(out, 1, class_def);
+  write_variables(out, 1, "type", class_def->instance_variables);
+  write_prototypes(out, 0, class_def);
+}
+
+static void write_class(struct sink *out, struct class_group *group, struct type_definition *type_def, unsigned thread_count){
+  struct class_definition *class_def = type_def->class_definition;
+  unsigned i;
+
+  write_class_declarations(out, type_def);
+
+  if (thread_count > 1){
+    write_script_bodies(out, group, class_def, thread_count);
+    return;
+  }
 
   // first the functions
   for (i=0;class_def->scripts[i];i++){
     struct script_definition *script = class_def->scripts[i];
     if (script->implemented && !script->event){
-      write_script_body(fd, group, class_def, script);
+      write_script(out, group, class_def, script);
     }
   }
 
@@ -239,21 +312,38 @@ static void write_class(FILE *fd, struct class_group *UNUSED(group), struct type
   for (i=0;class_def->scripts[i];i++){
     struct script_definition *script = class_def->scripts[i];
     if (script->implemented && script->event){
-      write_script_body(fd, group, class_def,script);
+      write_script(out, group, class_def,script);
     }
   }
 }
 
-void write_group(FILE *fd, struct class_group *group){
-  write_forward(fd, group);
+void write_group(struct sink *out, struct class_group *group){
+  write_group_threads(out, group, 1);
+}
+
+static void write_group_declarations(struct sink *out, struct class_group *group){
+  write_forward(out, group);
   // TODO structure definitions first, not last
-  write_variables(fd, 1, "shared", group->global_variables);
+  write_variables(out, 1, "shared", group->global_variables);
   // this works, but it's not exactly right...
-  write_variables(fd, 0, "global", group->global_variables);
+  write_variables(out, 0, "global", group->global_variables);
+}
+
+void write_declarations(struct sink *out, struct class_group *group){
+  write_group_declarations(out, group);
+  unsigned i;
+  for (i=0;i<group->type_count;i++){
+    if (group->types[i].type == class_type)
+      write_class_declarations(out, &group->types[i]);
+  }
+}
+
+void write_group_threads(struct sink *out, struct class_group *group, unsigned thread_count){
+  write_group_declarations(out, group);
 
   unsigned i;
   for (i=0;i<group->type_count;i++){
     if (group->types[i].type == class_type)
-      write_class(fd, group, &group->types[i]);
+      write_class(out, group, &group->types[i], thread_count);
   }
 }
@@ -2,9 +2,30 @@
 #ifndef output_header
 #define output_header
 
-#include <stdio.h>
+struct sink;
 struct class_group;
+struct type_definition;
+struct class_definition;
+struct script_definition;
+struct variable_definition;
 
-void write_group(FILE *fd, struct class_group *group);
+// bump whenever the generated source changes, so exported sources are written again
+#define OUTPUT_VERSION 1
+
+void write_group(struct sink *out, struct class_group *group);
+// disassemble the scripts of each class on up to thread_count threads, the output is identical to write_group.
+// only for decompiling a single object, batch, export and the server already keep every thread busy with
+// one entry or connection each, and splitting those again would only add overhead
+void write_group_threads(struct sink *out, struct class_group *group, unsigned thread_count);
+
+// the source without any script bodies; types, variables and prototypes
+void write_declarations(struct sink *out, struct class_group *group);
+
+// single declarations, as they appear in the source
+int write_type_dec(struct sink *out, struct type_definition *type_def);
+void write_method_header(struct sink *out, struct script_definition *script);
+void write_variable(struct sink *out, struct variable_definition *variable);
+// the header, local variables and body of one script
+void write_script(struct sink *out, struct class_group *group, struct class_definition *class_def, struct script_definition *script);
 
 #endif
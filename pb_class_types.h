@@ -64,9 +64,25 @@ struct pbfile_header{
   uint16_t unnamed4;
 };
 
+// known values of pbtable_info.structure_type
+enum pbstructure_type{
+  pbstruct_int = 1,
+  pbstruct_double = 4,
+  pbstruct_decimal = 5,
+  pbstruct_datetime = 6,
+  pbstruct_sql = 9,
+  pbstruct_prop_ref = 12,
+  pbstruct_method_ref = 13,
+  pbstruct_indirect_arg = 16,
+  pbstruct_indirect_func = 17,
+  pbstruct_create_ref = 18,
+  pbstruct_array = 19,
+  pbstruct_longlong = 23
+};
+
 struct pbtable_info{
   uint32_t offset;
-// TODO define structure type enum?
+  // enum pbstructure_type
   uint16_t structure_type;
   uint16_t count;
 };
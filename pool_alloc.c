@@ -5,7 +5,9 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "pool_alloc.h"
+#include "recover.h"
 #include "debug.h"
 
 #define BLOCK_SIZE (0x10000)
@@ -19,6 +21,8 @@ struct buffer{
 
 struct pool{
   struct buffer *current;
+  // only set once the pool is shared between threads
+  pthread_mutex_t *lock;
   struct buffer first;
 };
 
@@ -33,12 +37,17 @@ struct pool *pool_create(){
   assert(pool);
   DEBUGF(ALLOC,"malloc() = %p", pool);
   init(pool, &pool->first);
+  pool->lock = NULL;
   pool->first.remaining = BLOCK_SIZE - sizeof(struct pool);
   //DEBUGF(ALLOC,"Created pool @%p, remaining %zu", pool, pool->current->remaining);
+  recover_pool_created(pool);
   return pool;
 }
 
 void pool_release(struct pool *pool){
+  recover_pool_released(pool);
+  if (pool->lock)
+    pthread_mutex_destroy(pool->lock);
   while(pool->first.next){
     struct buffer *t = pool->first.next;
     pool->first.next = pool->first.next->next;
@@ -49,15 +58,43 @@ void pool_release(struct pool *pool){
   free(pool);
 }
 
+static void *alloc_locked(struct pool *pool, size_t size, unsigned alignment);
+
 void *pool_alloc(struct pool *pool, size_t size, unsigned alignment){
+  // alignment is in bytes, and must be a power of 2
+  assert((alignment & (alignment - 1)) == 0);
+  void *ret;
+  if (!pool->lock){
+    ret = alloc_locked(pool, size, alignment);
+  }else{
+    pthread_mutex_lock(pool->lock);
+    ret = alloc_locked(pool, size, alignment);
+    pthread_mutex_unlock(pool->lock);
+  }
+  // not while the lock is held, a recovered failure would leave it locked
+  assert(ret);
+  return ret;
+}
+
+void pool_share(struct pool *pool){
+  if (pool->lock)
+    return;
+  pthread_mutex_t *lock = alloc_locked(pool, sizeof(pthread_mutex_t), alignment_of(pthread_mutex_t));
+  assert(lock);
+  pthread_mutex_init(lock, NULL);
+  pool->lock = lock;
+}
+
+// the caller holds the lock, if there is one. returns NULL if out of memory
+static void *alloc_locked(struct pool *pool, size_t size, unsigned alignment){
   DEBUGF(ALLOC, "Allocating %zu", size);
 
-  int mask = ((1<<alignment)-1);
+  uintptr_t mask = alignment ? alignment-1 : 0;
   struct buffer *buff = pool->current;
 
   while(1){
     void *ret = buff->current;
-    int rounding = ((uintptr_t)ret & mask);
+    size_t rounding = ((uintptr_t)ret & mask);
     if (rounding){
       rounding = (mask + 1 - rounding);
       ret += rounding;
@@ -79,7 +116,8 @@ void *pool_alloc(struct pool *pool, size_t size, unsigned alignment){
       }
       struct buffer *b = malloc(alloc);
       DEBUGF(ALLOC,"malloc() = %p", b);
-      assert(b);
+      if (!b)
+	return NULL;
       init(pool, b);
       b->remaining = alloc - sizeof(struct buffer);
       buff->next = b;
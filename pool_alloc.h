@@ -11,6 +11,8 @@ struct pool;
 struct pool *pool_create();
 void pool_release(struct pool *pool);
 void *pool_alloc(struct pool *pool, size_t size, unsigned alignment);
+// allow allocations from multiple threads, this can't be undone
+void pool_share(struct pool *pool);
 
 const char *pool_dup(struct pool *pool, const char *str);
 const char *pool_dup_u(struct pool *pool, const UChar *str);
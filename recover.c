@@ -0,0 +1,142 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "recover.h"
+#include "pool_alloc.h"
+#include "debug.h"
+
+struct recover_scope{
+  jmp_buf jump;
+  struct recover_scope *outer;
+  // pools created in this scope that haven't been released
+  struct pool **pools;
+  unsigned pool_count;
+  unsigned pool_allocated;
+  // most recently pushed first
+  struct recover_cleanup *cleanups;
+  char *message;
+  size_t size;
+};
+
+static __thread struct recover_scope *current;
+// a failed scope while it's cleanups run, they may release pools it would otherwise release again
+static __thread struct recover_scope *unwinding;
+
+static void track(struct recover_scope *scope, struct pool *pool){
+  if (scope->pool_count >= scope->pool_allocated){
+    scope->pool_allocated = scope->pool_allocated ? scope->pool_allocated * 2 : 16;
+    scope->pools = realloc(scope->pools, scope->pool_allocated * sizeof(struct pool *));
+    if (!scope->pools)
+      abort();
+  }
+  scope->pools[scope->pool_count++] = pool;
+}
+
+void recover_pool_created(struct pool *pool){
+  if (current)
+    track(current, pool);
+}
+
+static int untrack(struct recover_scope *scope, struct pool *pool){
+  unsigned i;
+  // most recent first, pools are usually released in reverse order
+  for (i=scope->pool_count;i>0;i--){
+    if (scope->pools[i-1] == pool){
+      scope->pools[i-1] = scope->pools[--scope->pool_count];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void recover_pool_released(struct pool *pool){
+  if (unwinding && untrack(unwinding, pool))
+    return;
+  struct recover_scope *scope;
+  for (scope = current; scope; scope = scope->outer)
+    if (untrack(scope, pool))
+      return;
+}
+
+int recover_run(recover_callback fn, void *context, char *message, size_t size){
+  struct recover_scope scope;
+  memset(&scope, 0, sizeof scope);
+  scope.outer = current;
+  scope.message = message;
+  scope.size = size;
+
+  if (setjmp(scope.jump)){
+    current = scope.outer;
+    DEBUGF(RECOVER, "Recovered from %s, releasing %u pools", message, scope.pool_count);
+    // before the pools, a cleanup may still need memory from one of them
+    struct recover_scope *outer_unwinding = unwinding;
+    unwinding = &scope;
+    while(scope.cleanups){
+      struct recover_cleanup *cleanup = scope.cleanups;
+      scope.cleanups = cleanup->next;
+      cleanup->fn(cleanup->context);
+    }
+    unwinding = outer_unwinding;
+    unsigned i;
+    for (i=0;i<scope.pool_count;i++)
+      pool_release(scope.pools[i]);
+    free(scope.pools);
+    return -1;
+  }
+
+  current = &scope;
+  fn(context);
+  current = scope.outer;
+  // every push should have been popped by now
+  assert(!scope.cleanups);
+
+  // anything still alive now belongs to the outer scope
+  unsigned i;
+  for (i=0;scope.outer && i<scope.pool_count;i++)
+    track(scope.outer, scope.pools[i]);
+  free(scope.pools);
+  return 0;
+}
+
+void recover_push(struct recover_cleanup *cleanup, recover_callback fn, void *context){
+  cleanup->scope = current;
+  cleanup->fn = fn;
+  cleanup->context = context;
+  if (!current)
+    return;
+  cleanup->next = current->cleanups;
+  current->cleanups = cleanup;
+}
+
+void recover_pop(struct recover_cleanup *cleanup){
+  if (!cleanup->scope)
+    return;
+  assert(cleanup->scope == current && current->cleanups == cleanup);
+  current->cleanups = cleanup->next;
+}
+
+static void unlock(void *context){
+  pthread_mutex_unlock(context);
+}
+
+void recover_lock(pthread_mutex_t *mutex, struct recover_cleanup *cleanup){
+  pthread_mutex_lock(mutex);
+  recover_push(cleanup, unlock, mutex);
+}
+
+void recover_unlock(pthread_mutex_t *mutex, struct recover_cleanup *cleanup){
+  recover_pop(cleanup);
+  pthread_mutex_unlock(mutex);
+}
+
+void recover_fail(const char *message){
+  struct recover_scope *scope = current;
+  if (!scope)
+    return;
+  if (scope->message && scope->size){
+    strncpy(scope->message, message, scope->size - 1);
+    scope->message[scope->size - 1] = 0;
+  }
+  longjmp(scope->jump, 1);
+}
@@ -0,0 +1,46 @@
+
+#ifndef recover_header
+#define recover_header
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Recovery scopes turn a failed assertion into an error result, so one bad entry doesn't end a batch.
+ * Scopes are per thread. Pools created inside a scope are released if it fails, and that is the only memory that is
+ * reclaimed. Anything else acquired inside a scope, malloc'd memory, file descriptors or held locks, must either be
+ * owned by the caller or registered as a cleanup while it is held.
+ */
+
+struct pool;
+struct recover_scope;
+
+typedef void (*recover_callback) (void *context);
+
+// owned by the caller, usually on it's stack
+struct recover_cleanup{
+  struct recover_cleanup *next;
+  struct recover_scope *scope;
+  recover_callback fn;
+  void *context;
+};
+
+// run fn, returns 0 if it completed, or -1 if it failed and the failure message was copied into message
+int recover_run(recover_callback fn, void *context, char *message, size_t size);
+
+// unwind to the innermost scope on this thread, returns if there isn't one
+void recover_fail(const char *message);
+
+// fn(context) is run if the innermost scope fails before the cleanup is popped again.
+// cleanups are popped in the reverse order they were pushed. outside of any scope, nothing is run
+void recover_push(struct recover_cleanup *cleanup, recover_callback fn, void *context);
+void recover_pop(struct recover_cleanup *cleanup);
+
+// a mutex that is unlocked again if the scope fails while it is held
+void recover_lock(pthread_mutex_t *mutex, struct recover_cleanup *cleanup);
+void recover_unlock(pthread_mutex_t *mutex, struct recover_cleanup *cleanup);
+
+// called by the pool allocator
+void recover_pool_created(struct pool *pool);
+void recover_pool_released(struct pool *pool);
+
+#endif
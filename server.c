@@ -0,0 +1,597 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <endian.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "server.h"
+#include "lib.h"
+#include "class.h"
+#include "output.h"
+#include "recover.h"
+#include "sink.h"
+#include "hash.h"
+#include "watch.h"
+#include "snapshot.h"
+#include "debug.h"
+
+// larger requests are refused, and the connection closed
+#define MAX_REQUEST 4096
+// how long a library must go without being written before it is refreshed
+#define SETTLE_MS 100
+
+struct server;
+
+struct open_library{
+  struct open_library *next;
+  struct server *server;
+  struct library *lib;
+  // directory walks and entry reads of one library are not thread safe, take this first
+  pthread_mutex_t lock;
+};
+
+struct cached_group{
+  // most recently used first
+  struct cached_group *prev;
+  struct cached_group *next;
+  struct lib_entry *entry;
+  struct class_group *group;
+  unsigned refs;
+  // the entry changed while this was in use, free it once released
+  uint8_t stale;
+};
+
+struct server{
+  pthread_mutex_t lock;
+  struct open_library *libraries;
+  struct cached_group *first;
+  struct cached_group *last;
+  unsigned cached;
+  unsigned cache_size;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  unsigned long invalidated;
+  // bloom filters for lib_find, if the rate isn't zero
+  double filter_rate;
+  const char *filter_dir;
+  // NULL if inotify isn't available
+  struct watch *watch;
+};
+
+struct connection{
+  struct server *server;
+  int fd;
+};
+
+struct open_work{
+  const char *filename;
+  struct library *lib;
+  double filter_rate;
+  const char *filter_dir;
+};
+
+static void open_library(void *context){
+  struct open_work *work = context;
+  work->lib = lib_open(work->filename);
+  if (!work->lib || !work->filter_rate)
+    return;
+  // the sidecar is named for the full path of the library, like snapshots
+  char real[PATH_MAX], path[PATH_MAX];
+  const char *sidecar = NULL;
+  if (work->filter_dir){
+    const char *filename = realpath(work->filename, real) ? real : work->filename;
+    int len = snprintf(path, sizeof path, "%s/%016llx.bloom", work->filter_dir,
+      (unsigned long long)hash_bytes(filename, strlen(filename), 0));
+    if (len > 0 && (size_t)len < sizeof path)
+      sidecar = path;
+  }
+  lib_use_filter(work->lib, work->filter_rate, sidecar);
+}
+
+static struct open_library *find_library(struct server *server, const char *filename){
+  struct open_library *olib;
+  for (olib = server->libraries; olib; olib = olib->next)
+    if (strcmp(olib->lib->filename, filename)==0)
+      break;
+  return olib;
+}
+
+// an open library by file name, opening it the first time
+static struct open_library *server_library(struct server *server, const char *filename, char *error, size_t size){
+  pthread_mutex_lock(&server->lock);
+  struct open_library *olib = find_library(server, filename);
+  pthread_mutex_unlock(&server->lock);
+  if (olib)
+    return olib;
+
+  // reading the directory and building a filter can take a while, don't hold up other requests
+  struct open_work work = {
+    .filename = filename,
+    .filter_rate = server->filter_rate,
+    .filter_dir = server->filter_dir,
+  };
+  if (recover_run(open_library, &work, error, size) == 0 && !work.lib)
+    snprintf(error, size, "Failed to open %s", filename);
+  if (!work.lib)
+    return NULL;
+
+  pthread_mutex_lock(&server->lock);
+  // another request may have opened it in the meantime
+  olib = find_library(server, filename);
+  if (!olib){
+    olib = malloc(sizeof(struct open_library));
+    assert(olib);
+    olib->server = server;
+    olib->lib = work.lib;
+    pthread_mutex_init(&olib->lock, NULL);
+    olib->next = server->libraries;
+    server->libraries = olib;
+    work.lib = NULL;
+    DEBUGF(OUTPUT, "Opened %s", filename);
+    if (server->watch && watch_add(server->watch, filename, olib))
+      fprintf(stderr, "Can't watch %s for changes\n", filename);
+  }
+  pthread_mutex_unlock(&server->lock);
+  if (work.lib)
+    lib_close(work.lib);
+  return olib;
+}
+
+static void lru_unlink(struct server *server, struct cached_group *cached){
+  if (cached->prev)
+    cached->prev->next = cached->next;
+  else
+    server->first = cached->next;
+  if (cached->next)
+    cached->next->prev = cached->prev;
+  else
+    server->last = cached->prev;
+}
+
+static void lru_push(struct server *server, struct cached_group *cached){
+  cached->prev = NULL;
+  cached->next = server->first;
+  if (server->first)
+    server->first->prev = cached;
+  else
+    server->last = cached;
+  server->first = cached;
+}
+
+// drop the least recently used groups that aren't in use, until the cache fits. call with the server lock held
+static void lru_evict(struct server *server){
+  struct cached_group *cached = server->last;
+  while(server->cached > server->cache_size && cached){
+    struct cached_group *prev = cached->prev;
+    if (!cached->refs){
+      lru_unlink(server, cached);
+      class_free(cached->group);
+      free(cached);
+      server->cached--;
+      server->evictions++;
+    }
+    cached = prev;
+  }
+}
+
+struct parse_work{
+  struct library *lib;
+  const char *name;
+  struct lib_entry *entry;
+  struct class_group *group;
+};
+
+static void find_entry(void *context){
+  struct parse_work *work = context;
+  work->entry = lib_find(work->lib, work->name);
+}
+
+// decompile requests need every body
+static int keep_script(struct class_definition *class_def, struct script_definition *script, void *context){
+  (void)class_def; (void)script; (void)context;
+  return 1;
+}
+
+static void parse_entry(void *context){
+  struct parse_work *work = context;
+  // groups stay cached for a long time, keep one compact copy of what decompiling needs and let the read buffers go
+  work->group = class_compact(class_parse(work->entry), keep_script, NULL);
+  class_share(work->group);
+}
+
+// a parsed class group from the cache, parsing it if needed. release it with cache_put
+static struct cached_group *cache_get(struct server *server, struct open_library *olib, const char *name, char *error, size_t size){
+  struct parse_work work = {.lib = olib->lib, .name = name};
+  struct cached_group *cached = NULL;
+
+  // held while parsing, so each entry is only parsed once
+  pthread_mutex_lock(&olib->lock);
+  if (recover_run(find_entry, &work, error, size) != 0)
+    goto done;
+  if (!work.entry){
+    snprintf(error, size, "%s not found", name);
+    goto done;
+  }
+  if (!class_is_compiled_entry(work.entry->name)){
+    snprintf(error, size, "%s is not a compiled entry of %s", name, olib->lib->filename);
+    goto done;
+  }
+
+  pthread_mutex_lock(&server->lock);
+  for (cached = server->first; cached; cached = cached->next)
+    if (cached->entry == work.entry)
+      break;
+  if (cached){
+    server->hits++;
+    cached->refs++;
+    lru_unlink(server, cached);
+    lru_push(server, cached);
+  }else{
+    server->misses++;
+  }
+  pthread_mutex_unlock(&server->lock);
+  if (cached)
+    goto done;
+
+  if (recover_run(parse_entry, &work, error, size) != 0)
+    goto done;
+
+  cached = malloc(sizeof(struct cached_group));
+  assert(cached);
+  cached->entry = work.entry;
+  cached->group = work.group;
+  cached->refs = 1;
+  cached->stale = 0;
+  pthread_mutex_lock(&server->lock);
+  lru_push(server, cached);
+  server->cached++;
+  lru_evict(server);
+  pthread_mutex_unlock(&server->lock);
+
+done:
+  pthread_mutex_unlock(&olib->lock);
+  return cached;
+}
+
+static void cache_put(struct server *server, struct cached_group *cached){
+  pthread_mutex_lock(&server->lock);
+  cached->refs--;
+  if (cached->stale && !cached->refs){
+    class_free(cached->group);
+    free(cached);
+  }
+  lru_evict(server);
+  pthread_mutex_unlock(&server->lock);
+}
+
+// drop the cached group of an entry that has changed
+static void invalidate_entry(struct lib_entry *entry, void *context){
+  struct server *server = context;
+  struct cached_group *cached;
+  pthread_mutex_lock(&server->lock);
+  for (cached = server->first; cached; cached = cached->next)
+    if (cached->entry == entry)
+      break;
+  if (cached){
+    DEBUGF(OUTPUT, "Invalidated %s", entry->name);
+    lru_unlink(server, cached);
+    server->cached--;
+    server->invalidated++;
+    if (cached->refs){
+      cached->stale = 1;
+    }else{
+      class_free(cached->group);
+      free(cached);
+    }
+  }
+  pthread_mutex_unlock(&server->lock);
+}
+
+static void refresh_library(void *context){
+  struct open_library *olib = context;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_mutex_lock(&olib->lock);
+  int changed = lib_refresh(olib->lib, invalidate_entry, olib->server);
+  pthread_mutex_unlock(&olib->lock);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (changed<0)
+    fprintf(stderr, "Failed to refresh %s\n", olib->lib->filename);
+  else
+    fprintf(stderr, "Refreshed %s in %.1fms, %d entries changed\n", olib->lib->filename,
+      (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0, changed);
+}
+
+static void *watch_thread(void *context){
+  struct server *server = context;
+  while(watch_wait(server->watch, refresh_library, SETTLE_MS) == 0)
+    ;
+  perror("watch");
+  return NULL;
+}
+
+static void list_entry(struct lib_entry *entry, void *context){
+  struct sink *out = context;
+  sink_printf(out, "%s\t%u\t%zu\n", entry->name, entry->timestamp, entry->length);
+}
+
+struct list_work{
+  struct library *lib;
+  struct sink *out;
+};
+
+static void list_entries(void *context){
+  struct list_work *work = context;
+  lib_enumerate(work->lib, list_entry, work->out);
+}
+
+struct write_work{
+  struct sink *out;
+  struct class_group *group;
+};
+
+static void write_source(void *context){
+  struct write_work *work = context;
+  write_group(work->out, work->group);
+}
+
+static void write_signatures(void *context){
+  struct write_work *work = context;
+  struct class_group *group = work->group;
+  unsigned i, j;
+  for (i=0;i<group->type_count;i++){
+    if (group->types[i].type != class_type)
+      continue;
+    struct class_definition *class_def = group->types[i].class_definition;
+    write_type_dec(work->out, &group->types[i]);
+    for (j=0;j<class_def->instance_variable_count;j++)
+      if (!class_def->instance_variables[j]->user_defined)
+	write_variable(work->out, class_def->instance_variables[j]);
+    for (j=0;j<class_def->script_count;j++){
+      if (class_def->scripts[j]->in_ancestor)
+	continue;
+      write_method_header(work->out, class_def->scripts[j]);
+      sink_putc(work->out, '\n');
+    }
+    sink_puts(work->out, "end type\n");
+  }
+}
+
+// answer one request, the response is appended to out
+static void handle(struct server *server, char *request, struct sink *out){
+  char error[512] = "";
+  char *fields[3] = {NULL, NULL, NULL};
+  unsigned count = 0;
+  char *saveptr = NULL;
+  char *field = strtok_r(request, "\t\n", &saveptr);
+  while(field && count < 3){
+    fields[count++] = field;
+    field = strtok_r(NULL, "\t\n", &saveptr);
+  }
+  const char *command = fields[0] ? fields[0] : "";
+  DEBUGF(OUTPUT, "Request %s %s %s", command, fields[1], fields[2]);
+
+  sink_puts(out, "OK\n");
+
+  if (strcmp(command, "stats")==0){
+    pthread_mutex_lock(&server->lock);
+    sink_printf(out, "cached\t%u\nlimit\t%u\nhits\t%lu\nmisses\t%lu\nevictions\t%lu\ninvalidated\t%lu\n",
+      server->cached, server->cache_size, server->hits, server->misses, server->evictions, server->invalidated);
+    // libraries are only ever prepended, so the list from this head stays valid without server->lock.
+    // a library lock is never taken while holding server->lock
+    struct open_library *olib = server->libraries;
+    pthread_mutex_unlock(&server->lock);
+
+    // how many lookups the library filters answered without reading a directory
+    struct lib_filter_stats total = {0};
+    for (; olib; olib = olib->next){
+      struct lib_filter_stats stats;
+      pthread_mutex_lock(&olib->lock);
+      lib_filter_stats(olib->lib, &stats);
+      pthread_mutex_unlock(&olib->lock);
+      total.probes += stats.probes;
+      total.rejected += stats.rejected;
+      total.false_positives += stats.false_positives;
+    }
+    sink_printf(out, "filter_probes\t%lu\nfilter_rejected\t%lu\nfilter_false_positives\t%lu\n",
+      total.probes, total.rejected, total.false_positives);
+    return;
+  }
+
+  int takes_entry = strcmp(command, "find")==0 || strcmp(command, "decompile")==0 || strcmp(command, "signature")==0;
+  if (!takes_entry && strcmp(command, "list")!=0){
+    snprintf(error, sizeof error, "Unknown request \"%s\"", command);
+    goto failed;
+  }
+  if (!fields[1] || (takes_entry && !fields[2])){
+    snprintf(error, sizeof error, "Missing arguments for %s", command);
+    goto failed;
+  }
+
+  struct open_library *olib = server_library(server, fields[1], error, sizeof error);
+  if (!olib)
+    goto failed;
+
+  if (strcmp(command, "list")==0){
+    struct list_work work = {.lib = olib->lib, .out = out};
+    pthread_mutex_lock(&olib->lock);
+    int ret = recover_run(list_entries, &work, error, sizeof error);
+    pthread_mutex_unlock(&olib->lock);
+    if (ret)
+      goto failed;
+    return;
+  }
+
+  if (strcmp(command, "find")==0){
+    struct parse_work work = {.lib = olib->lib, .name = fields[2]};
+    pthread_mutex_lock(&olib->lock);
+    int ret = recover_run(find_entry, &work, error, sizeof error);
+    pthread_mutex_unlock(&olib->lock);
+    if (ret)
+      goto failed;
+    if (!work.entry){
+      snprintf(error, sizeof error, "%s not found", fields[2]);
+      goto failed;
+    }
+    list_entry(work.entry, out);
+    if (work.entry->comment)
+      sink_printf(out, "%s\n", work.entry->comment);
+    return;
+  }
+
+  struct cached_group *cached = cache_get(server, olib, fields[2], error, sizeof error);
+  if (!cached)
+    goto failed;
+  struct write_work work = {.out = out, .group = cached->group};
+  int ret = recover_run(strcmp(command, "decompile")==0 ? write_source : write_signatures, &work, error, sizeof error);
+  cache_put(server, cached);
+  if (ret)
+    goto failed;
+  return;
+
+failed:
+  out->length = 0;
+  sink_printf(out, "ERROR %s\n", error);
+}
+
+static int read_all(int fd, void *data, size_t length){
+  uint8_t *p = data;
+  while(length){
+    ssize_t r = read(fd, p, length);
+    if (r<0 && errno == EINTR)
+      continue;
+    if (r<=0)
+      return -1;
+    p += r;
+    length -= r;
+  }
+  return 0;
+}
+
+static void *connection_thread(void *context){
+  struct connection *conn = context;
+  struct sink out;
+  char request[MAX_REQUEST + 1];
+  sink_open_memory(&out);
+
+  while(1){
+    uint32_t length;
+    if (read_all(conn->fd, &length, sizeof length))
+      break;
+    length = le32toh(length);
+    if (length > MAX_REQUEST || read_all(conn->fd, request, length))
+      break;
+    request[length] = 0;
+
+    out.length = 0;
+    handle(conn->server, request, &out);
+
+    // the length and the response in one call
+    uint32_t header = htole32(out.length);
+    struct iovec iov[2] = {
+      {.iov_base = &header, .iov_len = sizeof header},
+      {.iov_base = out.data, .iov_len = out.length},
+    };
+    struct sink reply = {.fd = conn->fd};
+    size_t total = iov[0].iov_len + iov[1].iov_len;
+    ssize_t written = writev(conn->fd, iov, 2);
+    if (written < 0 || (size_t)written != total){
+      // short writes are rare on a socket, finish them through a file sink
+      if (written < 0 || (size_t)written < sizeof header)
+	break;
+      sink_open_fd(&reply, conn->fd);
+      sink_write(&reply, out.data + (written - sizeof header), total - written);
+      if (sink_close(&reply))
+	break;
+    }
+  }
+
+  DEBUGF(OUTPUT, "Connection %d closed", conn->fd);
+  sink_close(&out);
+  close(conn->fd);
+  free(conn);
+  return NULL;
+}
+
+int server_run(const char *socket_path, const char *libraries[], unsigned library_count, unsigned cache_size,
+    double filter_rate, const char *filter_dir){
+  // connection and watcher threads are detached and may still be using this when we return, so it's never freed
+  struct server *server = calloc(1, sizeof(struct server));
+  assert(server);
+  server->cache_size = cache_size ? cache_size : 64;
+  server->filter_rate = filter_rate;
+  server->filter_dir = filter_dir;
+  pthread_mutex_init(&server->lock, NULL);
+
+  // refresh libraries as they are written, rather than serving stale results
+  pthread_t watcher;
+  server->watch = watch_create();
+  if (!server->watch || pthread_create(&watcher, NULL, watch_thread, server)){
+    fprintf(stderr, "Can't watch libraries for changes\n");
+  }else{
+    pthread_detach(watcher);
+  }
+
+  unsigned i;
+  for (i=0;i<library_count;i++){
+    char error[512];
+    if (!server_library(server, libraries[i], error, sizeof error))
+      fprintf(stderr, "%s\n", error);
+  }
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof addr.sun_path){
+    fprintf(stderr, "Socket path %s is too long\n", socket_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd<0){
+    perror("socket");
+    return 1;
+  }
+  // a stale socket from a previous run
+  unlink(socket_path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof addr) || listen(fd, 16)){
+    perror(socket_path);
+    close(fd);
+    return 1;
+  }
+  // a client that goes away shouldn't take the server with it
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "Listening on %s\n", socket_path);
+
+  while(1){
+    int client = accept(fd, NULL, NULL);
+    if (client<0){
+      if (errno == EINTR || errno == ECONNABORTED)
+	continue;
+      perror("accept");
+      break;
+    }
+    struct connection *conn = malloc(sizeof(struct connection));
+    assert(conn);
+    conn->server = server;
+    conn->fd = client;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, connection_thread, conn)){
+      close(client);
+      free(conn);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  close(fd);
+  return 1;
+}
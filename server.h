@@ -0,0 +1,24 @@
+
+#ifndef server_header
+#define server_header
+
+/* A long running server, answering requests over a unix domain socket.
+ * Libraries stay open once used, and parsed class groups are kept in a least recently used cache.
+ * Open libraries are watched, when one is written its directory is refreshed and the groups of changed entries are dropped.
+ *
+ * Requests and responses are frames, a 4 byte little endian length followed by that many bytes.
+ * A request is tab separated text;
+ *   list <library>                 entry names, timestamps and lengths, one per line
+ *   find <library> <entry>         the same for a single entry, with its comment
+ *   decompile <library> <entry>    source of a compiled entry
+ *   signature <library> <entry>    type and method declarations of a compiled entry
+ *   stats                          cache and filter counters
+ * A response starts with "OK\n" followed by the result, or "ERROR <message>\n".
+ */
+
+// serve until killed, preloading the libraries listed. returns non-zero if the socket couldn't be created.
+// if filter_rate isn't zero each library gets a bloom filter with that false positive rate, saved in filter_dir if set
+int server_run(const char *socket_path, const char *libraries[], unsigned library_count, unsigned cache_size,
+  double filter_rate, const char *filter_dir);
+
+#endif
@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "sink.h"
+#include "debug.h"
+
+// file sinks flush in chunks of this size, appends at least half as big skip the buffer
+#define SINK_CHUNK (64*1024)
+
+void sink_open_fd(struct sink *sink, int fd){
+  sink->data = malloc(SINK_CHUNK);
+  assert(sink->data);
+  sink->length = 0;
+  sink->allocated = SINK_CHUNK;
+  sink->fd = fd;
+  sink->error = 0;
+}
+
+void sink_open_memory(struct sink *sink){
+  sink->data = NULL;
+  sink->length = 0;
+  sink->allocated = 0;
+  sink->fd = -1;
+  sink->error = 0;
+}
+
+static void write_iov(struct sink *sink, struct iovec *iov, int count){
+  while(count && !sink->error){
+    ssize_t written = writev(sink->fd, iov, count);
+    if (written < 0){
+      if (errno == EINTR)
+	continue;
+      sink->error = errno;
+      DEBUGF(OUTPUT, "Write to %d failed, %d", sink->fd, sink->error);
+      break;
+    }
+    // skip past anything fully written, and trim a partial write
+    while(count && (size_t)written >= iov->iov_len){
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count){
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+}
+
+void sink_flush(struct sink *sink){
+  if (sink->fd < 0 || !sink->length)
+    return;
+  struct iovec iov = {.iov_base = sink->data, .iov_len = sink->length};
+  write_iov(sink, &iov, 1);
+  sink->length = 0;
+}
+
+void sink_reserve(struct sink *sink, size_t size){
+  if (sink->allocated - sink->length >= size)
+    return;
+  if (sink->fd >= 0){
+    sink_flush(sink);
+    if (sink->allocated >= size)
+      return;
+  }
+  size_t allocated = sink->allocated ? sink->allocated : 256;
+  while(allocated - sink->length < size)
+    allocated *= 2;
+  sink->data = realloc(sink->data, allocated);
+  assert(sink->data);
+  sink->allocated = allocated;
+}
+
+void sink_write_slow(struct sink *sink, const void *data, size_t length){
+  if (sink->fd >= 0 && length >= SINK_CHUNK/2){
+    // one system call for the buffer and the new data
+    struct iovec iov[2] = {
+      {.iov_base = sink->data, .iov_len = sink->length},
+      {.iov_base = (void *)data, .iov_len = length},
+    };
+    write_iov(sink, sink->length ? iov : iov+1, sink->length ? 2 : 1);
+    sink->length = 0;
+    return;
+  }
+  sink_reserve(sink, length);
+  memcpy(sink->data + sink->length, data, length);
+  sink->length += length;
+}
+
+void sink_printf(struct sink *sink, const char *fmt, ...){
+  va_list ap;
+  // most output is short, so format straight into the buffer and only retry when it didn't fit
+  size_t available = sink->allocated - sink->length;
+  va_start(ap, fmt);
+  int len = vsnprintf(available ? sink->data + sink->length : NULL, available, fmt, ap);
+  va_end(ap);
+  assert(len >= 0);
+  if ((size_t)len >= available){
+    sink_reserve(sink, len + 1);
+    va_start(ap, fmt);
+    vsnprintf(sink->data + sink->length, len + 1, fmt, ap);
+    va_end(ap);
+  }
+  sink->length += len;
+}
+
+char *sink_take(struct sink *sink, size_t *length){
+  assert(sink->fd < 0);
+  sink_reserve(sink, 1);
+  sink->data[sink->length] = 0;
+  char *ret = sink->data;
+  if (length)
+    *length = sink->length;
+  sink_open_memory(sink);
+  return ret;
+}
+
+int sink_close(struct sink *sink){
+  sink_flush(sink);
+  free(sink->data);
+  sink->data = NULL;
+  sink->length = sink->allocated = 0;
+  return sink->error;
+}
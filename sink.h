@@ -0,0 +1,58 @@
+
+#ifndef sink_header
+#define sink_header
+
+#include <stddef.h>
+#include <string.h>
+
+/* An output sink is a growable byte buffer with cheap inline appends.
+ * A file sink hands the buffer to write / writev whenever it fills,
+ * a memory sink keeps everything, for the caller to take with sink_take.
+ */
+
+struct sink{
+  char *data;
+  size_t length;
+  size_t allocated;
+  // -1 for a memory sink
+  int fd;
+  // errno of the first failed write, later output is discarded
+  int error;
+};
+
+void sink_open_fd(struct sink *sink, int fd);
+void sink_open_memory(struct sink *sink);
+// write any buffered output, a no-op for memory sinks
+void sink_flush(struct sink *sink);
+// flush, then free the buffer. returns the error of any failed write
+int sink_close(struct sink *sink);
+// the contents of a memory sink, nul terminated, the caller must free() them. the sink is left empty
+char *sink_take(struct sink *sink, size_t *length);
+
+void sink_printf(struct sink *sink, const char *fmt, ...)
+   __attribute__ ((__format__(printf,2,3)));
+
+// slow paths of the inline helpers
+void sink_reserve(struct sink *sink, size_t size);
+void sink_write_slow(struct sink *sink, const void *data, size_t length);
+
+static inline void sink_write(struct sink *sink, const void *data, size_t length){
+  if (sink->allocated - sink->length < length){
+    sink_write_slow(sink, data, length);
+    return;
+  }
+  memcpy(sink->data + sink->length, data, length);
+  sink->length += length;
+}
+
+static inline void sink_puts(struct sink *sink, const char *str){
+  sink_write(sink, str, strlen(str));
+}
+
+static inline void sink_putc(struct sink *sink, char c){
+  if (sink->length == sink->allocated)
+    sink_reserve(sink, 1);
+  sink->data[sink->length++] = c;
+}
+
+#endif
@@ -0,0 +1,747 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "lib.h"
+#include "class_private.h"
+#include "pool_alloc.h"
+#include "util.h"
+#include "debug.h"
+
+#define SNAPSHOT_MAGIC "PBSNAP01"
+// bump whenever the meaning of any snapshotted structure changes
+#define SNAPSHOT_VERSION 3
+#define NONE ((size_t)-1)
+// a script body dropped while compacting
+#define DROPPED ((size_t)-2)
+
+struct snapshot_file_header{
+  char magic[8];
+  uint32_t layout;
+  uint32_t timestamp;
+  uint64_t length;
+  // "library path\0entry name\0"
+  uint64_t key_offset;
+  uint64_t key_length;
+  uint64_t data_offset;
+  uint64_t data_length;
+  uint64_t reloc_offset;
+  uint64_t reloc_count;
+  // offset of the struct class_group_private within data
+  uint64_t root;
+};
+
+static uint64_t fnv_hash(uint64_t hash, const void *data, size_t len){
+  const uint8_t *p = data;
+  while(len--){
+    hash ^= *p++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// any change to the size of a snapshotted structure invalidates old snapshots
+static uint32_t snapshot_layout(){
+  size_t sizes[]={
+    SNAPSHOT_VERSION,
+    sizeof(void*),
+    sizeof(struct class_group_private),
+    sizeof(struct class_def_private),
+    sizeof(struct script_def_private),
+    sizeof(struct script_implementation),
+    sizeof(struct variable_def_private),
+    sizeof(struct arg_def_private),
+    sizeof(struct type_definition),
+    sizeof(struct type_defs),
+    sizeof(struct data_table),
+    sizeof(struct table_record),
+  };
+  uint64_t hash = fnv_hash(0xcbf29ce484222325ULL, sizes, sizeof sizes);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// pointers are written as offsets from the start of the image, with the location of each pointer recorded
+struct range{
+  uintptr_t start;
+  size_t length;
+  size_t offset;
+};
+
+struct object{
+  uintptr_t ptr;
+  size_t offset;
+};
+
+struct writer{
+  uint8_t *data;
+  size_t length;
+  size_t allocated;
+  uint64_t *relocs;
+  size_t reloc_count;
+  size_t reloc_allocated;
+  struct range *ranges;
+  size_t range_count;
+  size_t range_allocated;
+  int ranges_sorted;
+  struct object *objects;
+  size_t object_count;
+  size_t object_allocated;
+  // compacting, pointers into raw blocks that weren't copied become NULL
+  int compact;
+  // compacting, raw tables are only needed if some pcode is kept
+  int keep_tables;
+};
+
+static size_t w_alloc(struct writer *w, size_t size, size_t alignment){
+  size_t offset = (w->length + alignment - 1) & ~(alignment - 1);
+  if (offset + size > w->allocated){
+    size_t allocated = w->allocated ? w->allocated : 0x10000;
+    while(allocated < offset + size)
+      allocated *= 2;
+    w->data = realloc(w->data, allocated);
+    assert(w->data);
+    w->allocated = allocated;
+  }
+  memset(&w->data[w->length], 0, offset + size - w->length);
+  w->length = offset + size;
+  return offset;
+}
+
+static size_t w_copy(struct writer *w, const void *src, size_t size, size_t alignment){
+  size_t offset = w_alloc(w, size, alignment);
+  memcpy(&w->data[offset], src, size);
+  return offset;
+}
+
+static size_t map_slot(struct writer *w, uintptr_t ptr){
+  size_t mask = w->object_allocated - 1;
+  size_t i = (size_t)((ptr >> 3) * 0x9E3779B97F4A7C15ULL) & mask;
+  while(w->objects[i].ptr && w->objects[i].ptr != ptr)
+    i = (i + 1) & mask;
+  return i;
+}
+
+static size_t map_get(struct writer *w, const void *ptr){
+  if (!w->object_allocated)
+    return NONE;
+  size_t i = map_slot(w, (uintptr_t)ptr);
+  return w->objects[i].ptr ? w->objects[i].offset : NONE;
+}
+
+static void map_put(struct writer *w, const void *ptr, size_t offset){
+  if ((w->object_count + 1) * 2 > w->object_allocated){
+    struct object *old = w->objects;
+    size_t old_allocated = w->object_allocated;
+    w->object_allocated = old_allocated ? old_allocated * 2 : 1024;
+    w->objects = calloc(w->object_allocated, sizeof(struct object));
+    assert(w->objects);
+    size_t i;
+    for (i=0;i<old_allocated;i++)
+      if (old[i].ptr)
+	w->objects[map_slot(w, old[i].ptr)] = old[i];
+    free(old);
+  }
+  size_t i = map_slot(w, (uintptr_t)ptr);
+  if (!w->objects[i].ptr)
+    w->object_count++;
+  w->objects[i].ptr = (uintptr_t)ptr;
+  w->objects[i].offset = offset;
+}
+
+// copy a raw block, pointers anywhere inside it will be relocated to the copy
+static size_t w_range(struct writer *w, const void *src, size_t length, size_t alignment){
+  if (!src || !length)
+    return NONE;
+  size_t offset = map_get(w, src);
+  if (offset != NONE)
+    return offset;
+  offset = w_copy(w, src, length, alignment);
+  map_put(w, src, offset);
+
+  if (w->range_count == w->range_allocated){
+    w->range_allocated = w->range_allocated ? w->range_allocated * 2 : 256;
+    w->ranges = realloc(w->ranges, w->range_allocated * sizeof(struct range));
+    assert(w->ranges);
+  }
+  w->ranges[w->range_count].start = (uintptr_t)src;
+  w->ranges[w->range_count].length = length;
+  w->ranges[w->range_count].offset = offset;
+  w->range_count++;
+  w->ranges_sorted = 0;
+  return offset;
+}
+
+static int compare_range(const void *a, const void *b){
+  const struct range *ra = a, *rb = b;
+  return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+static size_t w_find_range(struct writer *w, const void *ptr, int allow_end){
+  if (!w->range_count)
+    return NONE;
+  if (!w->ranges_sorted){
+    qsort(w->ranges, w->range_count, sizeof(struct range), compare_range);
+    w->ranges_sorted = 1;
+  }
+  uintptr_t p = (uintptr_t)ptr;
+  // last range starting at or before ptr
+  size_t lo=0, hi=w->range_count;
+  while(lo < hi){
+    size_t mid = lo + (hi - lo)/2;
+    if (w->ranges[mid].start <= p)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  if (lo==0)
+    return NONE;
+  struct range *range = &w->ranges[lo-1];
+  // get_table_ptr can return a pointer one past the end of a table
+  if (p > range->start + range->length || (p == range->start + range->length && !allow_end))
+    return NONE;
+  return range->offset + (p - range->start);
+}
+
+// a pointer into a raw block that must have already been copied, unless compacting
+static size_t w_interior(struct writer *w, const void *ptr){
+  if (!ptr)
+    return NONE;
+  size_t offset = w_find_range(w, ptr, 1);
+  assert(offset != NONE || w->compact);
+  return offset;
+}
+
+static size_t w_string(struct writer *w, const char *str){
+  if (!str)
+    return NONE;
+  size_t offset = w_find_range(w, str, 0);
+  if (offset != NONE)
+    return offset;
+  offset = map_get(w, str);
+  if (offset != NONE)
+    return offset;
+  offset = w_copy(w, str, strlen(str)+1, 1);
+  map_put(w, str, offset);
+  return offset;
+}
+
+// copy a single structure once
+static size_t w_object(struct writer *w, const void *src, size_t size, size_t alignment){
+  if (!src)
+    return NONE;
+  size_t offset = w_find_range(w, src, 0);
+  if (offset != NONE)
+    return offset;
+  offset = map_get(w, src);
+  if (offset != NONE)
+    return offset;
+  offset = w_copy(w, src, size, alignment);
+  map_put(w, src, offset);
+  return offset;
+}
+
+// store a pointer to target at position, and remember to relocate it
+static void w_pointer(struct writer *w, size_t position, size_t target){
+  uintptr_t value = 0;
+  if (target != NONE){
+    value = target;
+    if (w->reloc_count == w->reloc_allocated){
+      w->reloc_allocated = w->reloc_allocated ? w->reloc_allocated * 2 : 1024;
+      w->relocs = realloc(w->relocs, w->reloc_allocated * sizeof(uint64_t));
+      assert(w->relocs);
+    }
+    w->relocs[w->reloc_count++] = position;
+  }
+  memcpy(&w->data[position], &value, sizeof value);
+}
+
+#define PTR(OFFSET, TYPE, FIELD, TARGET) w_pointer(w, (OFFSET) + offsetof(TYPE, FIELD), (TARGET))
+
+static size_t w_string_array(struct writer *w, const char **strings, unsigned count, int terminated){
+  if (!strings)
+    return NONE;
+  size_t offset = w_alloc(w, (count + (terminated?1:0)) * sizeof(char *), alignment_of(char *));
+  unsigned i;
+  for (i=0;i<count;i++)
+    w_pointer(w, offset + i*sizeof(char *), w_string(w, strings[i]));
+  if (terminated)
+    w_pointer(w, offset + count*sizeof(char *), NONE);
+  return offset;
+}
+
+static void w_raw_table(struct writer *w, const struct data_table *table){
+  w_range(w, table->data, table->data_length, 8);
+  w_range(w, table->metadata, table->metadata_count * sizeof(struct pbtable_info), 4);
+}
+
+// variable definitions point to their type, so the types are always copied
+static void w_raw_type_defs(struct writer *w, const struct type_defs *type_defs, int table){
+  if (table)
+    w_raw_table(w, &type_defs->table);
+  w_range(w, type_defs->types, type_defs->count * sizeof(struct pbtype_def), 4);
+}
+
+// copy every raw table first, so all pointers into them can be relocated
+static void w_raw(struct writer *w, struct class_group_private *group){
+  int tables = !w->compact || w->keep_tables;
+  if (tables){
+    w_raw_table(w, &group->main_table);
+    w_raw_table(w, &group->function_name_table);
+    w_raw_table(w, &group->arguments_table);
+  }
+  w_raw_type_defs(w, &group->global_types, tables);
+  w_raw_type_defs(w, &group->type_list, tables);
+  w_raw_type_defs(w, &group->enum_values, tables);
+  w_range(w, group->external_refs, group->ext_ref_count * sizeof(struct pbext_reference), 4);
+  w_range(w, group->type_headers, group->pub.type_count * sizeof(struct pbtype_header), 4);
+
+  unsigned i;
+  for (i=0;i<group->pub.type_count;i++){
+    if (group->pub.types[i].type != class_type)
+      continue;
+    struct class_def_private *class_def = (struct class_def_private *)group->pub.types[i].class_definition;
+    w_raw_type_defs(w, &class_def->imports, tables);
+    w_raw_type_defs(w, &class_def->instance_variables, tables);
+    if (tables){
+      w_range(w, class_def->instance_values, class_def->header->variable_count * sizeof(struct pbvalue), 4);
+      w_range(w, class_def->indirect_refs, class_def->header->indirect_count * sizeof(struct pbindirect_ref), 4);
+    }
+
+    unsigned j;
+    for (j=0;j<class_def->pub.script_count;j++){
+      struct script_def_private *script_def = (struct script_def_private *)class_def->pub.scripts[j];
+      struct script_implementation *body = script_def->body;
+      if (!body)
+	continue;
+      int keep = map_get(w, body) != DROPPED;
+      if (keep){
+	w_range(w, body->code, body->code_size, 8);
+	w_range(w, body->debug_lines, body->debugline_count * sizeof(struct pbdebug_line_num), 4);
+	w_raw_table(w, &body->resources);
+      }
+      w_raw_type_defs(w, &body->local_variables, keep);
+    }
+  }
+}
+
+static void w_data_table(struct writer *w, size_t position, const struct data_table *src){
+  size_t data = w_interior(w, src->data);
+  if (src->data && data == NONE){
+    // dropped while compacting, leave an empty table
+    struct data_table *dst = (struct data_table *)&w->data[position];
+    memset(dst, 0, sizeof *dst);
+    return;
+  }
+  PTR(position, struct data_table, data, data);
+  PTR(position, struct data_table, metadata, w_interior(w, src->metadata));
+
+  size_t records = NONE;
+  if (src->records){
+    records = w_alloc(w, src->metadata_count * sizeof(struct table_record), alignment_of(struct table_record));
+    unsigned i;
+    for (i=0;i<src->metadata_count;i++){
+      size_t offset = records + i * sizeof(struct table_record);
+      memcpy(&w->data[offset], &src->records[i], sizeof(struct table_record));
+      PTR(offset, struct table_record, data, w_interior(w, src->records[i].data));
+      PTR(offset, struct table_record, text, w_string(w, src->records[i].text));
+      if (src->records[i].structure_type == pbstruct_array){
+	PTR(offset, struct table_record, array.dimensions, w_interior(w, src->records[i].array.dimensions));
+	PTR(offset, struct table_record, array.values, w_interior(w, src->records[i].array.values));
+      }
+    }
+  }
+  PTR(position, struct data_table, records, records);
+}
+
+static void w_type_defs(struct writer *w, size_t position, const struct type_defs *src){
+  w_data_table(w, position + offsetof(struct type_defs, table), &src->table);
+  PTR(position, struct type_defs, types, w_interior(w, src->types));
+  PTR(position, struct type_defs, names, w_string_array(w, src->names, src->count, 0));
+}
+
+static size_t w_variables(struct writer *w, struct variable_definition **variables, unsigned count){
+  if (!variables)
+    return NONE;
+  size_t pointers = w_alloc(w, (count+1) * sizeof(void *), alignment_of(void *));
+  size_t array = w_alloc(w, count * sizeof(struct variable_def_private), alignment_of(struct variable_def_private));
+  unsigned i;
+  for (i=0;i<count;i++){
+    const struct variable_def_private *src = (const struct variable_def_private *)variables[i];
+    size_t offset = array + i * sizeof(struct variable_def_private);
+    memcpy(&w->data[offset], src, sizeof *src);
+    PTR(offset, struct variable_def_private, pub.read_access, w_string(w, src->pub.read_access));
+    PTR(offset, struct variable_def_private, pub.write_access, w_string(w, src->pub.write_access));
+    PTR(offset, struct variable_def_private, pub.type, w_string(w, src->pub.type));
+    PTR(offset, struct variable_def_private, pub.name, w_string(w, src->pub.name));
+    PTR(offset, struct variable_def_private, pub.dimensions, w_string(w, src->pub.dimensions));
+    PTR(offset, struct variable_def_private, pub.initial_values,
+      w_string_array(w, src->pub.initial_values, src->pub.value_count, 1));
+    PTR(offset, struct variable_def_private, type, w_interior(w, src->type));
+    PTR(offset, struct variable_def_private, dimensions, w_interior(w, src->dimensions));
+    w_pointer(w, pointers + i * sizeof(void *), offset);
+  }
+  w_pointer(w, pointers + count * sizeof(void *), NONE);
+  return pointers;
+}
+
+static size_t w_arguments(struct writer *w, struct argument_definition **arguments, unsigned count){
+  if (!arguments || !count)
+    return NONE;
+  size_t pointers = w_alloc(w, (count+1) * sizeof(void *), alignment_of(void *));
+  size_t array = w_alloc(w, count * sizeof(struct arg_def_private), alignment_of(struct arg_def_private));
+  unsigned i;
+  for (i=0;i<count;i++){
+    const struct arg_def_private *src = (const struct arg_def_private *)arguments[i];
+    size_t offset = array + i * sizeof(struct arg_def_private);
+    memcpy(&w->data[offset], src, sizeof *src);
+    PTR(offset, struct arg_def_private, pub.access, w_string(w, src->pub.access));
+    PTR(offset, struct arg_def_private, pub.type, w_string(w, src->pub.type));
+    PTR(offset, struct arg_def_private, pub.name, w_string(w, src->pub.name));
+    PTR(offset, struct arg_def_private, pub.dimensions, w_string(w, src->pub.dimensions));
+    PTR(offset, struct arg_def_private, dimensions, w_interior(w, src->dimensions));
+    w_pointer(w, pointers + i * sizeof(void *), offset);
+  }
+  w_pointer(w, pointers + count * sizeof(void *), NONE);
+  return pointers;
+}
+
+static size_t w_body(struct writer *w, const struct script_implementation *src){
+  if (!src)
+    return NONE;
+  size_t offset = map_get(w, src);
+  if (offset == DROPPED)
+    return NONE;
+  if (offset != NONE)
+    return offset;
+  offset = w_copy(w, src, sizeof *src, alignment_of(struct script_implementation));
+  map_put(w, src, offset);
+  PTR(offset, struct script_implementation, code, w_interior(w, src->code));
+  PTR(offset, struct script_implementation, debug_lines, w_interior(w, src->debug_lines));
+  w_type_defs(w, offset + offsetof(struct script_implementation, local_variables), &src->local_variables);
+  w_data_table(w, offset + offsetof(struct script_implementation, resources), &src->resources);
+  return offset;
+}
+
+static size_t w_scripts(struct writer *w, struct script_definition **scripts, unsigned count){
+  if (!scripts)
+    return NONE;
+  size_t pointers = w_alloc(w, (count+1) * sizeof(void *), alignment_of(void *));
+  size_t array = w_alloc(w, count * sizeof(struct script_def_private), alignment_of(struct script_def_private));
+  unsigned i;
+  for (i=0;i<count;i++){
+    const struct script_def_private *src = (const struct script_def_private *)scripts[i];
+    size_t offset = array + i * sizeof(struct script_def_private);
+    memcpy(&w->data[offset], src, sizeof *src);
+    PTR(offset, struct script_def_private, pub.name, w_string(w, src->pub.name));
+    PTR(offset, struct script_def_private, pub.access, w_string(w, src->pub.access));
+    PTR(offset, struct script_def_private, pub.signature, w_string(w, src->pub.signature));
+    PTR(offset, struct script_def_private, pub.external_name, w_string(w, src->pub.external_name));
+    PTR(offset, struct script_def_private, pub.library, w_string(w, src->pub.library));
+    PTR(offset, struct script_def_private, pub.return_type, w_string(w, src->pub.return_type));
+    PTR(offset, struct script_def_private, pub.event_type, w_string(w, src->pub.event_type));
+    PTR(offset, struct script_def_private, pub.local_variables,
+      w_variables(w, src->pub.local_variables, src->pub.local_variable_count));
+    PTR(offset, struct script_def_private, pub.arguments,
+      w_arguments(w, src->pub.arguments, src->pub.argument_count));
+    PTR(offset, struct script_def_private, pub.throws,
+      w_string_array(w, src->pub.throws, src->pub.throws_count, 1));
+    PTR(offset, struct script_def_private, body, w_body(w, src->body));
+    PTR(offset, struct script_def_private, short_header,
+      w_object(w, src->short_header, sizeof(struct pbscript_short_header), 2));
+    PTR(offset, struct script_def_private, header,
+      w_object(w, src->header, sizeof(struct pbscript_header), 4));
+    PTR(offset, struct script_def_private, arguments, w_interior(w, src->arguments));
+    PTR(offset, struct script_def_private, argument_info, w_interior(w, src->argument_info));
+    PTR(offset, struct script_def_private, throw_types, w_interior(w, src->throw_types));
+    w_pointer(w, pointers + i * sizeof(void *), offset);
+  }
+  w_pointer(w, pointers + count * sizeof(void *), NONE);
+  return pointers;
+}
+
+static size_t w_class(struct writer *w, const struct class_def_private *src){
+  size_t offset = w_copy(w, src, sizeof *src, alignment_of(struct class_def_private));
+  map_put(w, src, offset);
+  PTR(offset, struct class_def_private, pub.ancestor, w_string(w, src->pub.ancestor));
+  PTR(offset, struct class_def_private, pub.parent, w_string(w, src->pub.parent));
+  PTR(offset, struct class_def_private, pub.scripts, w_scripts(w, src->pub.scripts, src->pub.script_count));
+  PTR(offset, struct class_def_private, pub.instance_variables,
+    w_variables(w, src->pub.instance_variables, src->pub.instance_variable_count));
+  PTR(offset, struct class_def_private, type_header, w_interior(w, src->type_header));
+  PTR(offset, struct class_def_private, header, w_object(w, src->header, sizeof(struct pbclass_header), 2));
+  w_type_defs(w, offset + offsetof(struct class_def_private, imports), &src->imports);
+  w_type_defs(w, offset + offsetof(struct class_def_private, instance_variables), &src->instance_variables);
+  PTR(offset, struct class_def_private, instance_values, w_interior(w, src->instance_values));
+  PTR(offset, struct class_def_private, indirect_refs, w_interior(w, src->indirect_refs));
+  return offset;
+}
+
+static size_t w_enum(struct writer *w, const struct enumeration *src){
+  size_t offset = w_copy(w, src, sizeof(struct enumeration) + src->value_count * sizeof(struct enum_value),
+    alignment_of(struct enumeration));
+  unsigned i;
+  for (i=0;i<src->value_count;i++)
+    PTR(offset + offsetof(struct enumeration, values) + i * sizeof(struct enum_value), struct enum_value, name,
+      w_string(w, src->values[i].name));
+  return offset;
+}
+
+static size_t w_group(struct writer *w, struct class_group_private *group){
+  w_raw(w, group);
+
+  size_t root = w_copy(w, group, sizeof *group, alignment_of(struct class_group_private));
+  PTR(root, struct class_group_private, pool, NONE);
+  PTR(root, struct class_group_private, mapping, NONE);
+  // a loaded snapshot hasn't been linked yet
+  PTR(root, struct class_group_private, linked_type_names, NONE);
+  PTR(root, struct class_group_private, opcodes, NONE);
+  ((struct class_group_private *)&w->data[root])->linked_type_count = 0;
+  PTR(root, struct class_group_private, pub.global_variables,
+    w_variables(w, group->pub.global_variables, group->pub.global_variable_count));
+
+  size_t types = w_alloc(w, group->pub.type_count * sizeof(struct type_definition), alignment_of(struct type_definition));
+  unsigned i;
+  for (i=0;i<group->pub.type_count;i++){
+    const struct type_definition *src = &group->pub.types[i];
+    size_t offset = types + i * sizeof(struct type_definition);
+    memcpy(&w->data[offset], src, sizeof *src);
+    PTR(offset, struct type_definition, name, w_string(w, src->name));
+    size_t definition = NONE;
+    if (src->type == class_type)
+      definition = w_class(w, (const struct class_def_private *)src->class_definition);
+    else if (src->type == enum_type)
+      definition = w_enum(w, src->enum_definition);
+    PTR(offset, struct type_definition, class_definition, definition);
+  }
+  PTR(root, struct class_group_private, pub.types, group->pub.type_count ? types : NONE);
+
+  PTR(root, struct class_group_private, external_refs, w_interior(w, group->external_refs));
+  w_data_table(w, root + offsetof(struct class_group_private, main_table), &group->main_table);
+  PTR(root, struct class_group_private, ref_names, w_string_array(w, group->ref_names, group->ext_ref_count, 0));
+  w_type_defs(w, root + offsetof(struct class_group_private, global_types), &group->global_types);
+  w_data_table(w, root + offsetof(struct class_group_private, function_name_table), &group->function_name_table);
+  w_data_table(w, root + offsetof(struct class_group_private, arguments_table), &group->arguments_table);
+  w_type_defs(w, root + offsetof(struct class_group_private, type_list), &group->type_list);
+  w_type_defs(w, root + offsetof(struct class_group_private, enum_values), &group->enum_values);
+  PTR(root, struct class_group_private, type_headers, w_interior(w, group->type_headers));
+
+  size_t class_index = NONE;
+  if (group->class_index){
+    class_index = w_alloc(w, group->type_list.count * sizeof(void *), alignment_of(void *));
+    for (i=0;i<group->type_list.count;i++)
+      w_pointer(w, class_index + i * sizeof(void *),
+	group->class_index[i] ? map_get(w, group->class_index[i]) : NONE);
+  }
+  PTR(root, struct class_group_private, class_index, class_index);
+  PTR(root, struct class_group_private, sys_type_names,
+    w_string_array(w, group->sys_type_names, group->sys_type_count, 0));
+  return root;
+}
+
+static void writer_free(struct writer *w){
+  free(w->data);
+  free(w->relocs);
+  free(w->ranges);
+  free(w->objects);
+}
+
+// library path, with the entry name appended after a nul
+static size_t snapshot_key(struct library *lib, struct lib_entry *entry, char *key, size_t size){
+  char path[PATH_MAX];
+  const char *filename = realpath(lib->filename, path) ? path : lib->filename;
+  int len = snprintf(key, size, "%s%c%s", filename, 0, entry->name);
+  if (len < 0 || (size_t)len >= size)
+    return 0;
+  return len+1;
+}
+
+static const char *snapshot_path(const char *cache_dir, const char *key, size_t key_length, char *path, size_t size){
+  uint64_t hash = fnv_hash(0xcbf29ce484222325ULL, key, key_length);
+  int len = snprintf(path, size, "%s/%016llx.snap", cache_dir, (unsigned long long)hash);
+  if (len < 0 || (size_t)len >= size)
+    return NULL;
+  return path;
+}
+
+int snapshot_save(const char *cache_dir, struct library *lib, struct lib_entry *entry, struct class_group *class_group){
+  struct class_group_private *group = (struct class_group_private *)class_group;
+  char key[PATH_MAX*2];
+  size_t key_length = snapshot_key(lib, entry, key, sizeof key);
+  char path[PATH_MAX];
+  if (!key_length || !snapshot_path(cache_dir, key, key_length, path, sizeof path))
+    return -1;
+
+  struct writer w;
+  memset(&w, 0, sizeof w);
+  size_t root = w_group(&w, group);
+
+  struct snapshot_file_header header;
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+  header.layout = snapshot_layout();
+  header.timestamp = entry->timestamp;
+  header.length = entry->length;
+  header.key_offset = sizeof header;
+  header.key_length = key_length;
+  header.data_offset = (header.key_offset + key_length + 15) & ~15ULL;
+  header.data_length = w.length;
+  header.reloc_offset = (header.data_offset + w.length + 7) & ~7ULL;
+  header.reloc_count = w.reloc_count;
+  header.root = root;
+
+  char tmp_path[PATH_MAX+32];
+  int fd = temp_open(path, tmp_path, sizeof tmp_path);
+  if (fd<0){
+    DEBUGF(SNAPSHOT, "Failed to create a temporary file for %s", path);
+    writer_free(&w);
+    return -1;
+  }
+
+  static const uint8_t padding[16];
+  int ret = write_all(fd, &header, sizeof header)
+    || write_all(fd, key, key_length)
+    || write_all(fd, padding, header.data_offset - header.key_offset - key_length)
+    || write_all(fd, w.data, w.length)
+    || write_all(fd, padding, header.reloc_offset - header.data_offset - w.length)
+    || write_all(fd, w.relocs, w.reloc_count * sizeof(uint64_t)) ? -1 : 0;
+  ret = temp_commit(fd, tmp_path, path, ret);
+
+  DEBUGF(SNAPSHOT, "Saved %s, %zu bytes, %zu relocations = %d", path, w.length, w.reloc_count, ret);
+  writer_free(&w);
+  return ret;
+}
+
+// turn image offsets back into pointers.
+// a relocation, or the offset it holds, outside the image means the file is damaged, returns -1
+static int relocate(uint8_t *data, size_t length, const uint64_t *relocs, uint64_t count){
+  uint64_t i;
+  for (i=0;i<count;i++){
+    if (length < sizeof(uintptr_t) || relocs[i] > length - sizeof(uintptr_t)
+      || relocs[i] % sizeof(uintptr_t))
+      return -1;
+    uintptr_t *ptr = (uintptr_t *)(data + relocs[i]);
+    // an empty array may point just past the end
+    if (*ptr > length)
+      return -1;
+    *ptr += (uintptr_t)data;
+  }
+  return 0;
+}
+
+struct class_group *snapshot_load(const char *cache_dir, struct library *lib, struct lib_entry *entry){
+  char key[PATH_MAX*2];
+  size_t key_length = snapshot_key(lib, entry, key, sizeof key);
+  char path[PATH_MAX];
+  if (!key_length || !snapshot_path(cache_dir, key, key_length, path, sizeof path))
+    return NULL;
+
+  int fd = open(path, O_RDONLY);
+  if (fd<0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st)!=0 || (size_t)st.st_size < sizeof(struct snapshot_file_header)){
+    close(fd);
+    return NULL;
+  }
+  size_t size = st.st_size;
+  uint8_t *mapping = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return NULL;
+
+  const struct snapshot_file_header *header = (const struct snapshot_file_header *)mapping;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof header->magic)!=0
+    || header->layout != snapshot_layout()
+    || header->timestamp != entry->timestamp
+    || header->length != entry->length
+    || header->key_length != key_length
+    || header->key_offset > size || key_length > size - header->key_offset
+    || memcmp(mapping + header->key_offset, key, key_length)!=0
+    || header->data_offset > size || header->data_length > size - header->data_offset
+    || header->data_offset % 16
+    || header->reloc_offset > size || header->reloc_offset % sizeof(uint64_t)
+    || header->reloc_count > (size - header->reloc_offset) / sizeof(uint64_t)
+    || header->data_length < sizeof(struct class_group_private)
+    || header->root > header->data_length - sizeof(struct class_group_private)){
+    DEBUGF(SNAPSHOT, "Ignoring stale snapshot %s", path);
+    munmap(mapping, size);
+    return NULL;
+  }
+
+  uint8_t *data = mapping + header->data_offset;
+  if (relocate(data, header->data_length, (const uint64_t *)(mapping + header->reloc_offset), header->reloc_count)){
+    DEBUGF(SNAPSHOT, "Ignoring damaged snapshot %s", path);
+    munmap(mapping, size);
+    return NULL;
+  }
+
+  struct class_group_private *group = (struct class_group_private *)(data + header->root);
+  // strings are still converted on demand, so we need a pool for them
+  group->pool = pool_create();
+  group->mapping = mapping;
+  group->mapping_length = size;
+  DEBUGF(SNAPSHOT, "Loaded %s, %llu relocations", path, (unsigned long long)header->reloc_count);
+  return (struct class_group *)group;
+}
+
+struct class_group *class_parse_cached(const char *cache_dir, struct library *lib, struct lib_entry *entry){
+  struct class_group *class_group = snapshot_load(cache_dir, lib, entry);
+  if (class_group)
+    return class_group;
+  class_group = class_parse(entry);
+  if (class_group)
+    snapshot_save(cache_dir, lib, entry, class_group);
+  return class_group;
+}
+
+struct class_group *class_compact(struct class_group *class_group, script_filter keep, void *context){
+  struct class_group_private *group = (struct class_group_private *)class_group;
+
+  struct writer w;
+  memset(&w, 0, sizeof w);
+  w.compact = 1;
+
+  // decide which bodies to keep before copying anything
+  unsigned i;
+  for (i=0;i<group->pub.type_count;i++){
+    if (group->pub.types[i].type != class_type)
+      continue;
+    struct class_definition *class_def = group->pub.types[i].class_definition;
+    unsigned j;
+    for (j=0;j<class_def->script_count;j++){
+      struct script_def_private *script_def = (struct script_def_private *)class_def->scripts[j];
+      if (!script_def->body || !script_def->body->code)
+	continue;
+      if (keep && keep(class_def, &script_def->pub, context))
+	w.keep_tables = 1;
+      else
+	map_put(&w, script_def->body, DROPPED);
+    }
+  }
+
+  size_t root = w_group(&w, group);
+
+  struct pool *pool = pool_create();
+  uint8_t *data = pool_alloc(pool, w.length, 16);
+  memcpy(data, w.data, w.length);
+  int ret = relocate(data, w.length, w.relocs, w.reloc_count);
+  assert(ret==0);
+
+  struct class_group_private *compacted = (struct class_group_private *)(data + root);
+  compacted->pool = pool;
+  compacted->linked_type_names = group->linked_type_names;
+  compacted->linked_type_count = group->linked_type_count;
+  DEBUGF(SNAPSHOT, "Compacted class group into %zu bytes, %zu relocations", w.length, w.reloc_count);
+
+  writer_free(&w);
+  class_free(class_group);
+  return (struct class_group *)compacted;
+}
@@ -0,0 +1,36 @@
+
+#ifndef snapshot_header
+#define snapshot_header
+
+struct library;
+struct lib_entry;
+struct class_group;
+struct class_definition;
+struct script_definition;
+
+/* A snapshot is a single position independent image of a fully linked class group.
+ * Pointers are stored as offsets from the start of the image, with a list of pointer locations.
+ * Loading maps the file privately and adds the mapped address to each pointer location,
+ * no parsing, transcoding or allocation is required.
+ *
+ * Snapshots are keyed by library path, entry name, entry timestamp and entry length.
+ */
+
+// load a snapshot from cache_dir, returns NULL if there is no current snapshot for this entry
+struct class_group *snapshot_load(const char *cache_dir, struct library *lib, struct lib_entry *entry);
+
+// save a snapshot of a class group parsed from this entry, returns 0 on success
+int snapshot_save(const char *cache_dir, struct library *lib, struct lib_entry *entry, struct class_group *class_group);
+
+// load a snapshot if one exists, otherwise parse the entry and save a new snapshot
+struct class_group *class_parse_cached(const char *cache_dir, struct library *lib, struct lib_entry *entry);
+
+// decide which script bodies survive compaction
+typedef int (*script_filter) (struct class_definition *class_def, struct script_definition *script, void *context);
+
+// copy the parsed model, and the pcode of scripts accepted by keep, into a single new allocation.
+// everything else, including raw tables that are only needed for pcode, is released along with the original group.
+// with no filter every script body is dropped
+struct class_group *class_compact(struct class_group *class_group, script_filter keep, void *context);
+
+#endif
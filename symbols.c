@@ -0,0 +1,395 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "symbols.h"
+#include "lib.h"
+#include "class.h"
+#include "output.h"
+#include "pool_alloc.h"
+#include "sink.h"
+#include "util.h"
+#include "debug.h"
+
+#define SYMBOLS_MAGIC "PBSYMS01"
+
+#pragma pack(push,1)
+
+struct symbols_file_header{
+  char magic[8];
+  uint32_t record_count;
+  uint32_t library_count;
+  uint32_t records_offset;
+  uint32_t libraries_offset;
+  uint32_t strings_offset;
+  uint32_t strings_length;
+};
+
+// all strings are offsets into the string table, 0 is NULL
+struct symbol_record{
+  uint32_t name;
+  uint32_t owner;
+  uint32_t type;
+  uint32_t declaration;
+  uint32_t entry;
+  uint16_t library;
+  uint16_t kind;
+};
+
+#pragma pack(pop)
+
+struct pending_symbol{
+  enum symbol_kind kind;
+  unsigned library;
+  const char *name;
+  const char *owner;
+  const char *type;
+  const char *declaration;
+  const char *entry;
+};
+
+struct builder{
+  struct pool *pool;
+  struct pending_symbol *symbols;
+  unsigned count;
+  unsigned allocated;
+  unsigned library;
+};
+
+// string table, with duplicates removed
+struct strings{
+  char *data;
+  uint32_t length;
+  uint32_t allocated;
+  uint32_t *slots;
+  unsigned slot_count;
+  unsigned used;
+};
+
+static const char *pool_dup_null(struct pool *pool, const char *str){
+  return str ? pool_dup(pool, str) : NULL;
+}
+
+// capture a single declaration from the output module, without the trailing new line
+static struct sink *capture_start(struct sink *capture){
+  sink_open_memory(capture);
+  return capture;
+}
+
+static const char *capture_end(struct pool *pool, struct sink *capture){
+  size_t size;
+  char *buffer = sink_take(capture, &size);
+  while(size && buffer[size-1]=='\n')
+    buffer[--size]=0;
+  const char *ret = pool_dupn(pool, buffer, size);
+  free(buffer);
+  return ret;
+}
+
+static void add_symbol(struct builder *builder, enum symbol_kind kind, const char *entry,
+  const char *name, const char *owner, const char *type, const char *declaration){
+  if (builder->count == builder->allocated){
+    builder->allocated = builder->allocated ? builder->allocated*2 : 1024;
+    builder->symbols = realloc(builder->symbols, builder->allocated * sizeof(struct pending_symbol));
+    assert(builder->symbols);
+  }
+  struct pending_symbol *symbol = &builder->symbols[builder->count++];
+  symbol->kind = kind;
+  symbol->library = builder->library;
+  symbol->entry = entry;
+  symbol->name = pool_dup_null(builder->pool, name);
+  symbol->owner = pool_dup_null(builder->pool, owner);
+  symbol->type = pool_dup_null(builder->pool, type);
+  symbol->declaration = declaration;
+}
+
+static void add_class(struct builder *builder, const char *entry, struct type_definition *type_def){
+  struct class_definition *class_def = type_def->class_definition;
+  struct sink capture;
+
+  write_type_dec(capture_start(&capture), type_def);
+  add_symbol(builder, symbol_class, entry, type_def->name, class_def->parent, class_def->ancestor,
+    capture_end(builder->pool, &capture));
+
+  unsigned i;
+  for (i=0;i<class_def->instance_variable_count;i++){
+    struct variable_definition *variable = class_def->instance_variables[i];
+    write_variable(capture_start(&capture), variable);
+    add_symbol(builder, symbol_variable, entry, variable->name, type_def->name, variable->type,
+      capture_end(builder->pool, &capture));
+  }
+
+  for (i=0;i<class_def->script_count;i++){
+    struct script_definition *script = class_def->scripts[i];
+    write_method_header(capture_start(&capture), script);
+    add_symbol(builder, script->event ? symbol_event : symbol_function, entry, script->name, type_def->name,
+      script->return_type, capture_end(builder->pool, &capture));
+  }
+}
+
+static void index_class_group(struct lib_entry *entry, struct class_group *class_group, void *context){
+  struct builder *builder = context;
+  const char *entry_name = pool_dup(builder->pool, entry->name);
+  unsigned i;
+  for (i=0;i<class_group->type_count;i++)
+    if (class_group->types[i].type == class_type)
+      add_class(builder, entry_name, &class_group->types[i]);
+  class_free(class_group);
+}
+
+static int compare_null(const char *a, const char *b){
+  return strcasecmp(a ? a : "", b ? b : "");
+}
+
+static int compare_pending(const void *a, const void *b){
+  const struct pending_symbol *sa = a;
+  const struct pending_symbol *sb = b;
+  int ret = compare_null(sa->name, sb->name);
+  if (ret)
+    return ret;
+  if (sa->kind != sb->kind)
+    return sa->kind < sb->kind ? -1 : 1;
+  ret = compare_null(sa->owner, sb->owner);
+  if (ret)
+    return ret;
+  if (sa->library != sb->library)
+    return sa->library < sb->library ? -1 : 1;
+  return compare_null(sa->entry, sb->entry);
+}
+
+static void strings_grow(struct strings *strings){
+  unsigned old_count = strings->slot_count;
+  uint32_t *old_slots = strings->slots;
+  strings->slot_count = old_count ? old_count*2 : 4096;
+  strings->slots = calloc(strings->slot_count, sizeof(uint32_t));
+  assert(strings->slots);
+  unsigned i;
+  for (i=0;i<old_count;i++){
+    if (!old_slots[i])
+      continue;
+    unsigned slot = string_hash(strings->data + old_slots[i]) & (strings->slot_count-1);
+    while(strings->slots[slot])
+      slot = (slot+1) & (strings->slot_count-1);
+    strings->slots[slot] = old_slots[i];
+  }
+  free(old_slots);
+}
+
+static uint32_t strings_add(struct strings *strings, const char *str){
+  if (!str)
+    return 0;
+  if ((strings->used+1)*2 > strings->slot_count)
+    strings_grow(strings);
+
+  unsigned slot = string_hash(str) & (strings->slot_count-1);
+  while(strings->slots[slot]){
+    if (strcmp(strings->data + strings->slots[slot], str)==0)
+      return strings->slots[slot];
+    slot = (slot+1) & (strings->slot_count-1);
+  }
+
+  size_t len = strlen(str)+1;
+  while(strings->length + len > strings->allocated){
+    strings->allocated = strings->allocated ? strings->allocated*2 : 65536;
+    strings->data = realloc(strings->data, strings->allocated);
+    assert(strings->data);
+  }
+  uint32_t offset = strings->length;
+  memcpy(strings->data + offset, str, len);
+  strings->length += len;
+  strings->slots[slot] = offset;
+  strings->used++;
+  return offset;
+}
+
+static int write_index(const char *filename, struct builder *builder, const char *libraries[], unsigned library_count){
+  qsort(builder->symbols, builder->count, sizeof(struct pending_symbol), compare_pending);
+
+  struct strings strings;
+  memset(&strings, 0, sizeof strings);
+  // offset 0 is reserved for NULL
+  strings_grow(&strings);
+  strings.allocated = 65536;
+  strings.data = malloc(strings.allocated);
+  assert(strings.data);
+  strings.data[0] = 0;
+  strings.length = 1;
+
+  struct symbol_record *records = malloc(builder->count * sizeof(struct symbol_record) + 1);
+  assert(records);
+  unsigned i;
+  for (i=0;i<builder->count;i++){
+    struct pending_symbol *symbol = &builder->symbols[i];
+    records[i].name = strings_add(&strings, symbol->name);
+    records[i].owner = strings_add(&strings, symbol->owner);
+    records[i].type = strings_add(&strings, symbol->type);
+    records[i].declaration = strings_add(&strings, symbol->declaration);
+    records[i].entry = strings_add(&strings, symbol->entry);
+    records[i].library = symbol->library;
+    records[i].kind = symbol->kind;
+  }
+  uint32_t library_names[library_count+1];
+  for (i=0;i<library_count;i++)
+    library_names[i] = strings_add(&strings, libraries[i]);
+
+  struct symbols_file_header header;
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, SYMBOLS_MAGIC, sizeof header.magic);
+  header.record_count = builder->count;
+  header.library_count = library_count;
+  header.records_offset = sizeof header;
+  header.libraries_offset = header.records_offset + builder->count * sizeof(struct symbol_record);
+  header.strings_offset = header.libraries_offset + library_count * sizeof(uint32_t);
+  header.strings_length = strings.length;
+
+  int ret = -1;
+  char tmp_path[strlen(filename)+8];
+  int fd = temp_open(filename, tmp_path, sizeof tmp_path);
+  if (fd>=0){
+    ret = write_all(fd, &header, sizeof header)
+      || write_all(fd, records, builder->count * sizeof(struct symbol_record))
+      || write_all(fd, library_names, library_count * sizeof(uint32_t))
+      || write_all(fd, strings.data, strings.length) ? -1 : 0;
+    ret = temp_commit(fd, tmp_path, filename, ret);
+  }
+
+  free(records);
+  free(strings.data);
+  free(strings.slots);
+  return ret;
+}
+
+int symbols_build(const char *filename, const char *libraries[], unsigned library_count, unsigned thread_count){
+  assert(library_count <= UINT16_MAX);
+  struct builder builder;
+  memset(&builder, 0, sizeof builder);
+  builder.pool = pool_create();
+
+  unsigned i;
+  for (i=0;i<library_count;i++){
+    struct library *lib = lib_open(libraries[i]);
+    if (!lib){
+      WARNF("Failed to open %s", libraries[i]);
+      continue;
+    }
+    struct entry_list list;
+    memset(&list, 0, sizeof list);
+    lib_enumerate(lib, class_collect_compiled, &list);
+
+    builder.library = i;
+    class_parse_many(lib, list.entries, list.count, thread_count, CLASS_PARSE_NO_PCODE, index_class_group, &builder);
+    free(list.entries);
+    lib_close(lib);
+  }
+
+  int ret = write_index(filename, &builder, libraries, library_count);
+  free(builder.symbols);
+  pool_release(builder.pool);
+  return ret;
+}
+
+struct symbol_index{
+  uint8_t *mapping;
+  size_t size;
+  const struct symbol_record *records;
+  uint32_t record_count;
+  const uint32_t *libraries;
+  uint32_t library_count;
+  const char *strings;
+  uint32_t strings_length;
+};
+
+struct symbol_index *symbols_open(const char *filename){
+  int fd = open(filename, O_RDONLY);
+  if (fd<0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st)!=0 || (size_t)st.st_size < sizeof(struct symbols_file_header)){
+    close(fd);
+    return NULL;
+  }
+  size_t size = st.st_size;
+  uint8_t *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return NULL;
+
+  const struct symbols_file_header *header = (const struct symbols_file_header *)mapping;
+  if (memcmp(header->magic, SYMBOLS_MAGIC, sizeof header->magic)!=0
+    || header->records_offset + (uint64_t)header->record_count * sizeof(struct symbol_record) > size
+    || header->libraries_offset + (uint64_t)header->library_count * sizeof(uint32_t) > size
+    || (uint64_t)header->strings_offset + header->strings_length > size
+    || header->strings_length == 0
+    || mapping[header->strings_offset + header->strings_length - 1] != 0){
+    WARNF("%s is not a symbol index", filename);
+    munmap(mapping, size);
+    return NULL;
+  }
+
+  struct symbol_index *index = malloc(sizeof(struct symbol_index));
+  assert(index);
+  index->mapping = mapping;
+  index->size = size;
+  index->records = (const struct symbol_record *)(mapping + header->records_offset);
+  index->record_count = header->record_count;
+  index->libraries = (const uint32_t *)(mapping + header->libraries_offset);
+  index->library_count = header->library_count;
+  index->strings = (const char *)(mapping + header->strings_offset);
+  index->strings_length = header->strings_length;
+  return index;
+}
+
+void symbols_close(struct symbol_index *index){
+  if (!index)
+    return;
+  munmap(index->mapping, index->size);
+  free(index);
+}
+
+static const char *index_string(struct symbol_index *index, uint32_t offset){
+  if (offset==0 || offset >= index->strings_length)
+    return NULL;
+  return index->strings + offset;
+}
+
+unsigned symbols_find(struct symbol_index *index, const char *name, symbol_callback callback, void *context){
+  assert(index);
+  assert(name);
+  // lower bound
+  uint32_t low = 0, high = index->record_count;
+  while(low < high){
+    uint32_t mid = low + (high - low)/2;
+    if (compare_null(index_string(index, index->records[mid].name), name) < 0)
+      low = mid+1;
+    else
+      high = mid;
+  }
+
+  unsigned found = 0;
+  for (;low < index->record_count;low++){
+    const struct symbol_record *record = &index->records[low];
+    const char *record_name = index_string(index, record->name);
+    if (compare_null(record_name, name)!=0)
+      break;
+    found++;
+    if (!callback)
+      continue;
+    struct symbol symbol = {
+      .kind = record->kind,
+      .name = record_name,
+      .owner = index_string(index, record->owner),
+      .type = index_string(index, record->type),
+      .declaration = index_string(index, record->declaration),
+      .library = record->library < index->library_count ? index_string(index, index->libraries[record->library]) : NULL,
+      .entry = index_string(index, record->entry),
+    };
+    callback(&symbol, context);
+  }
+  return found;
+}
@@ -0,0 +1,42 @@
+
+#ifndef symbols_header
+#define symbols_header
+
+/* A symbol index is a compact, sorted file of declarations from a set of libraries.
+ * Building it parses class groups without pcode, queries map the file and binary search it.
+ */
+
+enum symbol_kind{
+  symbol_class = 1,
+  symbol_function,
+  symbol_event,
+  symbol_variable
+};
+
+struct symbol{
+  enum symbol_kind kind;
+  const char *name;
+  // the class containing this member, or the parent of a nested class
+  const char *owner;
+  // ancestor of a class, return type of a method, or type of a variable
+  const char *type;
+  // the declaration, as it would appear in the source
+  const char *declaration;
+  const char *library;
+  const char *entry;
+};
+
+struct symbol_index;
+
+// parse every compiled entry in each library and write an index file, returns 0 on success
+int symbols_build(const char *filename, const char *libraries[], unsigned library_count, unsigned thread_count);
+
+struct symbol_index *symbols_open(const char *filename);
+void symbols_close(struct symbol_index *index);
+
+typedef void (*symbol_callback) (const struct symbol *symbol, void *context);
+
+// call back for every symbol with this name (case insensitive), returns the number of matches
+unsigned symbols_find(struct symbol_index *index, const char *name, symbol_callback callback, void *context);
+
+#endif
@@ -0,0 +1,368 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include "universe.h"
+#include "lib.h"
+#include "class_private.h"
+#include "pool_alloc.h"
+#include "util.h"
+#include "debug.h"
+
+// system types are numbered by the low 14 bits of a type
+#define SYSTEM_TYPE_MAX 0x4000
+
+// open addressing set of interned strings, compared by pointer
+struct key_set{
+  const char **slots;
+  unsigned size;
+  unsigned count;
+};
+
+struct universe_class{
+  const char *name;
+  const char *key;
+  const char *ancestor_name;
+  // ancestor system type, when the name couldn't be resolved while parsing
+  uint16_t ancestor_type;
+  // scripts declared in this class
+  struct key_set declared;
+  // memoized union of every script declared in all ancestors
+  struct key_set *inherited;
+  uint8_t resolving:1;
+};
+
+struct universe{
+  struct pool *pool;
+  // interned lower case strings
+  const char **strings;
+  unsigned string_size;
+  unsigned string_count;
+  // classes by interned key
+  struct universe_class **classes;
+  unsigned class_size;
+  unsigned class_count;
+  // system type names by (type & 0x3FFF)
+  const char **system_types;
+  unsigned system_type_count;
+  // set once any inherited sets have been memoized
+  uint8_t memoized:1;
+};
+
+static uint32_t pointer_hash(const void *ptr){
+  uint64_t value = (uintptr_t)ptr;
+  value *= 0x9E3779B97F4A7C15ULL;
+  return (uint32_t)(value >> 32);
+}
+
+// look for an interned copy of str, optionally adding one
+static const char *intern(struct universe *universe, const char *str, int add){
+  if (add && (universe->string_count+1)*2 > universe->string_size){
+    unsigned old_size = universe->string_size;
+    const char **old = universe->strings;
+    universe->string_size = old_size ? old_size*2 : 1024;
+    universe->strings = calloc(universe->string_size, sizeof(char *));
+    assert(universe->strings);
+    unsigned i;
+    for (i=0;i<old_size;i++){
+      if (!old[i])
+	continue;
+      unsigned slot = string_hash(old[i]) & (universe->string_size-1);
+      while(universe->strings[slot])
+	slot = (slot+1) & (universe->string_size-1);
+      universe->strings[slot] = old[i];
+    }
+    free(old);
+  }
+  if (!universe->string_size)
+    return NULL;
+
+  unsigned slot = string_hash(str) & (universe->string_size-1);
+  while(universe->strings[slot]){
+    if (strcmp(universe->strings[slot], str)==0)
+      return universe->strings[slot];
+    slot = (slot+1) & (universe->string_size-1);
+  }
+  if (!add)
+    return NULL;
+  universe->string_count++;
+  return universe->strings[slot] = pool_dup(universe->pool, str);
+}
+
+// names are case insensitive
+static const char *intern_name(struct universe *universe, const char *name, int add){
+  char lower[strlen(name)+1];
+  unsigned i;
+  for (i=0;name[i];i++)
+    lower[i] = tolower((unsigned char)name[i]);
+  lower[i] = 0;
+  return intern(universe, lower, add);
+}
+
+// functions may be overloaded, so include the argument types
+static const char *script_key(struct universe *universe, struct script_definition *script, int add){
+  char key[1024];
+  size_t len = snprintf(key, sizeof key, "%s", script->name);
+  if (!script->event){
+    len += snprintf(key+len, len < sizeof key ? sizeof key - len : 0, "(");
+    unsigned i;
+    for (i=0;i<script->argument_count && script->arguments[i];i++)
+      len += snprintf(key+len, len < sizeof key ? sizeof key - len : 0, "%s%s%s",
+	i ? "," : "",
+	script->arguments[i]->type ? script->arguments[i]->type : "",
+	script->arguments[i]->dimensions ? script->arguments[i]->dimensions : "");
+    len += snprintf(key+len, len < sizeof key ? sizeof key - len : 0, ")");
+  }
+  return intern_name(universe, key, add);
+}
+
+static void set_add(struct key_set *set, const char *key){
+  if ((set->count+1)*2 > set->size){
+    unsigned old_size = set->size;
+    const char **old = set->slots;
+    set->size = old_size ? old_size*2 : 16;
+    set->slots = calloc(set->size, sizeof(char *));
+    assert(set->slots);
+    set->count = 0;
+    unsigned i;
+    for (i=0;i<old_size;i++)
+      if (old[i])
+	set_add(set, old[i]);
+    free(old);
+  }
+  unsigned slot = pointer_hash(key) & (set->size-1);
+  while(set->slots[slot]){
+    if (set->slots[slot] == key)
+      return;
+    slot = (slot+1) & (set->size-1);
+  }
+  set->slots[slot] = key;
+  set->count++;
+}
+
+static int set_contains(const struct key_set *set, const char *key){
+  if (!set->size || !key)
+    return 0;
+  unsigned slot = pointer_hash(key) & (set->size-1);
+  while(set->slots[slot]){
+    if (set->slots[slot] == key)
+      return 1;
+    slot = (slot+1) & (set->size-1);
+  }
+  return 0;
+}
+
+static void set_add_all(struct key_set *set, const struct key_set *other){
+  unsigned i;
+  for (i=0;i<other->size;i++)
+    if (other->slots[i])
+      set_add(set, other->slots[i]);
+}
+
+static struct universe_class *find_class(struct universe *universe, const char *key){
+  if (!key || !universe->class_size)
+    return NULL;
+  unsigned slot = pointer_hash(key) & (universe->class_size-1);
+  while(universe->classes[slot]){
+    if (universe->classes[slot]->key == key)
+      return universe->classes[slot];
+    slot = (slot+1) & (universe->class_size-1);
+  }
+  return NULL;
+}
+
+static void insert_class(struct universe *universe, struct universe_class *class){
+  if ((universe->class_count+1)*2 > universe->class_size){
+    unsigned old_size = universe->class_size;
+    struct universe_class **old = universe->classes;
+    universe->class_size = old_size ? old_size*2 : 256;
+    universe->classes = calloc(universe->class_size, sizeof(struct universe_class *));
+    assert(universe->classes);
+    universe->class_count = 0;
+    unsigned i;
+    for (i=0;i<old_size;i++)
+      if (old[i])
+	insert_class(universe, old[i]);
+    free(old);
+  }
+  unsigned slot = pointer_hash(class->key) & (universe->class_size-1);
+  while(universe->classes[slot])
+    slot = (slot+1) & (universe->class_size-1);
+  universe->classes[slot] = class;
+  universe->class_count++;
+}
+
+// adding a class may change what any class inherits
+static void forget_inherited(struct universe *universe){
+  if (!universe->memoized)
+    return;
+  universe->memoized = 0;
+  unsigned i;
+  for (i=0;i<universe->class_size;i++){
+    struct universe_class *class = universe->classes[i];
+    if (!class || !class->inherited)
+      continue;
+    free(class->inherited->slots);
+    free(class->inherited);
+    class->inherited = NULL;
+  }
+}
+
+struct universe *universe_create(){
+  struct pool *pool = pool_create();
+  struct universe *universe = pool_alloc_type(pool, struct universe);
+  memset(universe, 0, sizeof *universe);
+  universe->pool = pool;
+  return universe;
+}
+
+void universe_free(struct universe *universe){
+  if (!universe)
+    return;
+  forget_inherited(universe);
+  unsigned i;
+  for (i=0;i<universe->class_size;i++)
+    if (universe->classes[i]){
+      free(universe->classes[i]->declared.slots);
+      free(universe->classes[i]);
+    }
+  free(universe->classes);
+  free(universe->strings);
+  pool_release(universe->pool);
+}
+
+static void add_system_types(struct universe *universe, struct class_group_private *class_group){
+  unsigned count = class_group->type_list.count;
+  if (count > SYSTEM_TYPE_MAX)
+    count = SYSTEM_TYPE_MAX;
+  // linked groups keep a pointer to this table, so it is allocated once at full size and never moves
+  if (!universe->system_types){
+    universe->system_types = pool_alloc_array(universe->pool, const char *, SYSTEM_TYPE_MAX);
+    memset(universe->system_types, 0, SYSTEM_TYPE_MAX * sizeof(char *));
+  }
+  if (count > universe->system_type_count)
+    universe->system_type_count = count;
+  unsigned i;
+  for (i=0;i<count;i++)
+    if (!universe->system_types[i] && class_group->type_list.names[i])
+      universe->system_types[i] = pool_dup(universe->pool, class_group->type_list.names[i]);
+}
+
+void universe_add_group(struct universe *universe, struct class_group *group){
+  struct class_group_private *class_group = (struct class_group_private *)group;
+  if (class_group->header.pb_type == 0)
+    add_system_types(universe, class_group);
+
+  unsigned i;
+  for (i=0;i<class_group->pub.type_count;i++){
+    struct type_definition *type_def = &class_group->pub.types[i];
+    if (type_def->type != class_type || !type_def->name)
+      continue;
+
+    const char *key = intern_name(universe, type_def->name, 1);
+    if (find_class(universe, key))
+      continue;
+
+    struct class_def_private *class_def = (struct class_def_private *)type_def->class_definition;
+    struct universe_class *class = malloc(sizeof(struct universe_class));
+    assert(class);
+    memset(class, 0, sizeof *class);
+    class->name = pool_dup(universe->pool, type_def->name);
+    class->key = key;
+    if (class_def->pub.ancestor && strcmp(class_def->pub.ancestor, TODO_SYS_TYPE)!=0)
+      class->ancestor_name = pool_dup(universe->pool, class_def->pub.ancestor);
+    else
+      class->ancestor_type = class_def->header->ancestor_type;
+
+    unsigned j;
+    for (j=0;j<class_def->pub.script_count;j++)
+      set_add(&class->declared, script_key(universe, class_def->pub.scripts[j], 1));
+
+    forget_inherited(universe);
+    insert_class(universe, class);
+  }
+}
+
+static void add_entry(struct lib_entry *entry, struct class_group *class_group, void *context){
+  struct universe *universe = context;
+  DEBUGF(PARSE, "Universe add %s", entry->name);
+  universe_add_group(universe, class_group);
+  class_free(class_group);
+}
+
+void universe_add_library(struct universe *universe, struct library *lib, unsigned thread_count){
+  struct entry_list list;
+  memset(&list, 0, sizeof list);
+  lib_enumerate(lib, class_collect_compiled, &list);
+  class_parse_many(lib, list.entries, list.count, thread_count, CLASS_PARSE_NO_PCODE, add_entry, universe);
+  free(list.entries);
+}
+
+static const char *ancestor_name(struct universe *universe, struct universe_class *class){
+  if (class->ancestor_name)
+    return class->ancestor_name;
+  uint16_t type = class->ancestor_type;
+  if ((type & 0xC000) == 0x4000 && (unsigned)(type & 0x3FFF) < universe->system_type_count)
+    return universe->system_types[type & 0x3FFF];
+  return NULL;
+}
+
+static struct universe_class *find_ancestor(struct universe *universe, struct universe_class *class){
+  const char *name = ancestor_name(universe, class);
+  return name ? find_class(universe, intern_name(universe, name, 0)) : NULL;
+}
+
+static const struct key_set *inherited(struct universe *universe, struct universe_class *class){
+  static const struct key_set empty;
+  if (class->inherited)
+    return class->inherited;
+  // inheritance should never be circular, but don't trust the input
+  if (class->resolving)
+    return &empty;
+  class->resolving = 1;
+
+  struct key_set *set = malloc(sizeof(struct key_set));
+  assert(set);
+  memset(set, 0, sizeof *set);
+  struct universe_class *ancestor = find_ancestor(universe, class);
+  if (ancestor){
+    set_add_all(set, inherited(universe, ancestor));
+    set_add_all(set, &ancestor->declared);
+  }
+  class->resolving = 0;
+  class->inherited = set;
+  universe->memoized = 1;
+  return set;
+}
+
+void universe_link(struct universe *universe, struct class_group *group){
+  struct class_group_private *class_group = (struct class_group_private *)group;
+  if (universe->system_type_count)
+    class_link_system_types(group, universe->system_types, universe->system_type_count);
+
+  unsigned i;
+  for (i=0;i<class_group->pub.type_count;i++){
+    struct type_definition *type_def = &class_group->pub.types[i];
+    if (type_def->type != class_type)
+      continue;
+    struct class_definition *class_def = type_def->class_definition;
+    if (!class_def->ancestor)
+      continue;
+    struct universe_class *ancestor = find_class(universe, intern_name(universe, class_def->ancestor, 0));
+    if (!ancestor)
+      continue;
+    const struct key_set *scripts = inherited(universe, ancestor);
+
+    unsigned j;
+    for (j=0;j<class_def->script_count;j++){
+      const char *key = script_key(universe, class_def->scripts[j], 0);
+      class_def->scripts[j]->in_ancestor = set_contains(&ancestor->declared, key) || set_contains(scripts, key);
+    }
+  }
+}
+
+const char *universe_ancestor(struct universe *universe, const char *class_name){
+  struct universe_class *class = find_class(universe, intern_name(universe, class_name, 0));
+  return class ? ancestor_name(universe, class) : NULL;
+}
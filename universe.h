@@ -0,0 +1,31 @@
+
+#ifndef universe_header
+#define universe_header
+
+/* A type universe collects every class declared across a list of libraries,
+ * so information that spans class groups can be resolved;
+ * - which scripts override or re-declare a script in an ancestor
+ * - names of system types, when a system type group (pb_type == 0) is part of the universe
+ *
+ * Classes are found by name, the first declaration wins, same as a library search path.
+ */
+
+struct universe;
+struct library;
+struct class_group;
+
+struct universe *universe_create();
+void universe_free(struct universe *universe);
+
+// parse the declarations of every compiled entry in the library
+void universe_add_library(struct universe *universe, struct library *lib, unsigned thread_count);
+// add the classes of a single class group, the group may be released afterwards
+void universe_add_group(struct universe *universe, struct class_group *class_group);
+
+// set script in_ancestor flags and resolve system type names, for a group parsed from any library
+void universe_link(struct universe *universe, struct class_group *class_group);
+
+// ancestor class name, or NULL
+const char *universe_ancestor(struct universe *universe, const char *class_name);
+
+#endif
@@ -0,0 +1,63 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "util.h"
+
+uint32_t string_hash(const char *str){
+  uint32_t hash = 0x811c9dc5;
+  while(*str){
+    hash ^= (uint8_t)*str++;
+    hash *= 0x01000193;
+  }
+  return hash;
+}
+
+int write_all(int fd, const void *data, size_t length){
+  const uint8_t *p = data;
+  while(length){
+    ssize_t r = write(fd, p, length);
+    if (r<0 && errno == EINTR)
+      continue;
+    if (r<=0)
+      return -1;
+    p += r;
+    length -= r;
+  }
+  return 0;
+}
+
+int temp_open(const char *path, char *tmp_path, size_t size){
+  int len = snprintf(tmp_path, size, "%s.XXXXXX", path);
+  if (len < 0 || (size_t)len >= size){
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int fd = mkstemp(tmp_path);
+  // mkstemp creates the file private to us, the real file shouldn't be
+  if (fd>=0)
+    fchmod(fd, 0644);
+  return fd;
+}
+
+int temp_commit(int fd, const char *tmp_path, const char *path, int failed){
+  if (fd>=0 && close(fd))
+    failed = 1;
+  if (!failed && rename(tmp_path, path)==0)
+    return 0;
+  int err = errno;
+  unlink(tmp_path);
+  errno = err;
+  return -1;
+}
+
+void ptr_list_push(struct ptr_list *list, void *item){
+  if (list->count == list->allocated){
+    list->allocated = list->allocated ? list->allocated*2 : 64;
+    list->items = realloc(list->items, list->allocated * sizeof(void *));
+    assert(list->items);
+  }
+  list->items[list->count++] = item;
+}
@@ -0,0 +1,34 @@
+
+#ifndef util_header
+#define util_header
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Small helpers shared by the modules that build indexes and write files.
+ */
+
+// FNV-1a, for open addressing tables keyed by name
+uint32_t string_hash(const char *str);
+
+// write every byte, retrying short writes. returns 0, or -1 with errno set
+int write_all(int fd, const void *data, size_t length);
+
+// files are written under a unique temporary name, then renamed over the real one,
+// so readers never see half a file and concurrent writers of the same file don't collide.
+// returns a descriptor open for writing with the temporary name in tmp_path, or -1
+int temp_open(const char *path, char *tmp_path, size_t size);
+// close fd (-1 if the caller already closed it), then rename the temporary file into place
+// if failed is zero, or remove it. returns 0, or -1 with errno set
+int temp_commit(int fd, const char *tmp_path, const char *path, int failed);
+
+// a growable array of pointers
+struct ptr_list{
+  void **items;
+  unsigned count;
+  unsigned allocated;
+};
+
+void ptr_list_push(struct ptr_list *list, void *item);
+
+#endif
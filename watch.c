@@ -0,0 +1,146 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <libgen.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include "watch.h"
+#include "debug.h"
+
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+
+struct watched{
+  struct watched *next;
+  int wd;
+  char *name;
+  void *context;
+  uint8_t pending;
+};
+
+struct watch{
+  int fd;
+  // guards the list, files may be added from other threads
+  pthread_mutex_t lock;
+  struct watched *files;
+};
+
+struct watch *watch_create(){
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd<0)
+    return NULL;
+  struct watch *watch = malloc(sizeof(struct watch));
+  assert(watch);
+  watch->fd = fd;
+  watch->files = NULL;
+  pthread_mutex_init(&watch->lock, NULL);
+  return watch;
+}
+
+void watch_close(struct watch *watch){
+  struct watched *file = watch->files;
+  while(file){
+    struct watched *next = file->next;
+    free(file->name);
+    free(file);
+    file = next;
+  }
+  close(watch->fd);
+  pthread_mutex_destroy(&watch->lock);
+  free(watch);
+}
+
+int watch_add(struct watch *watch, const char *filename, void *context){
+  char dir_buff[PATH_MAX], name_buff[PATH_MAX];
+  if (strlen(filename) >= PATH_MAX)
+    return -1;
+  // both may modify their argument
+  strcpy(dir_buff, filename);
+  strcpy(name_buff, filename);
+  const char *dir = dirname(dir_buff);
+  const char *name = basename(name_buff);
+
+  // the same directory always gives the same wd
+  int wd = inotify_add_watch(watch->fd, dir, WATCH_EVENTS);
+  DEBUGF(OUTPUT, "Watching %s in %s = %d", name, dir, wd);
+  if (wd<0)
+    return -1;
+
+  struct watched *file = malloc(sizeof(struct watched));
+  assert(file);
+  file->wd = wd;
+  file->name = strdup(name);
+  assert(file->name);
+  file->context = context;
+  file->pending = 0;
+  pthread_mutex_lock(&watch->lock);
+  file->next = watch->files;
+  watch->files = file;
+  pthread_mutex_unlock(&watch->lock);
+  return 0;
+}
+
+// read every queued event, marking the files they refer to
+static int read_events(struct watch *watch){
+  // aligned, as the kernel writes structs into it
+  char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t len = read(watch->fd, buffer, sizeof buffer);
+  if (len<0)
+    return errno == EINTR ? 0 : -1;
+
+  pthread_mutex_lock(&watch->lock);
+  char *ptr = buffer;
+  while(ptr < buffer + len){
+    const struct inotify_event *event = (const struct inotify_event *)ptr;
+    struct watched *file;
+    for (file = watch->files; file; file = file->next)
+      if (file->wd == event->wd && event->len && strcmp(file->name, event->name)==0)
+	file->pending = 1;
+    ptr += sizeof(struct inotify_event) + event->len;
+  }
+  pthread_mutex_unlock(&watch->lock);
+  return 0;
+}
+
+int watch_wait(struct watch *watch, watch_callback callback, unsigned settle_ms){
+  struct pollfd pfd = {.fd = watch->fd, .events = POLLIN};
+  // block for the first event
+  if (read_events(watch))
+    return -1;
+  // then keep reading until there's a gap
+  while(1){
+    int ret = poll(&pfd, 1, settle_ms);
+    if (ret<0 && errno == EINTR)
+      continue;
+    if (ret<0)
+      return -1;
+    if (ret==0)
+      break;
+    if (read_events(watch))
+      return -1;
+  }
+
+  // call back without holding the lock, so callbacks may add files
+  unsigned count = 0, i;
+  struct watched *file;
+  pthread_mutex_lock(&watch->lock);
+  for (file = watch->files; file; file = file->next)
+    count++;
+  void *contexts[count ? count : 1];
+  count = 0;
+  for (file = watch->files; file; file = file->next){
+    if (file->pending)
+      contexts[count++] = file->context;
+    file->pending = 0;
+  }
+  pthread_mutex_unlock(&watch->lock);
+
+  for (i=0;i<count;i++)
+    callback(contexts[i]);
+  return 0;
+}
@@ -0,0 +1,24 @@
+
+#ifndef watch_header
+#define watch_header
+
+/* Watch library files for changes with inotify.
+ * The directory holding each file is watched rather than the file itself, so a file that is replaced by a rename is still seen.
+ * An IDE save is many small writes, changes are collected until the files have been quiet for a moment.
+ */
+
+struct watch;
+
+typedef void (*watch_callback) (void *context);
+
+struct watch *watch_create();
+void watch_close(struct watch *watch);
+
+// changes to filename will be reported with context. may be called while another thread waits
+int watch_add(struct watch *watch, const char *filename, void *context);
+
+// wait for changes, then call back once for each file that changed, after nothing has been written for settle_ms.
+// returns 0, or -1 if the watch failed
+int watch_wait(struct watch *watch, watch_callback callback, unsigned settle_ms);
+
+#endif
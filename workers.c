@@ -0,0 +1,103 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "workers.h"
+#include "debug.h"
+
+struct workers{
+  pthread_mutex_t lock;
+  // signalled whenever an item completes, or the delivery window moves
+  pthread_cond_t changed;
+  unsigned count;
+  unsigned next;
+  unsigned delivered;
+  unsigned window;
+  uint8_t *done;
+  work_callback work;
+  void *context;
+};
+
+static void *worker_main(void *arg){
+  struct workers *workers = arg;
+  pthread_mutex_lock(&workers->lock);
+  while(1){
+    while(workers->next < workers->count
+      && workers->next >= workers->delivered + workers->window)
+      pthread_cond_wait(&workers->changed, &workers->lock);
+    if (workers->next >= workers->count)
+      break;
+    unsigned index = workers->next++;
+    pthread_mutex_unlock(&workers->lock);
+
+    workers->work(index, workers->context);
+
+    pthread_mutex_lock(&workers->lock);
+    workers->done[index] = 1;
+    pthread_cond_broadcast(&workers->changed);
+  }
+  pthread_mutex_unlock(&workers->lock);
+  return NULL;
+}
+
+unsigned workers_default_count(){
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? (unsigned)cpus : 1;
+}
+
+void workers_run(unsigned thread_count, unsigned count, work_callback work, deliver_callback deliver, void *context){
+  unsigned i;
+  if (thread_count > count)
+    thread_count = count;
+
+  if (thread_count <= 1){
+    for (i=0;i<count;i++){
+      work(i, context);
+      if (deliver)
+	deliver(i, context);
+    }
+    return;
+  }
+
+  struct workers workers;
+  memset(&workers, 0, sizeof workers);
+  pthread_mutex_init(&workers.lock, NULL);
+  pthread_cond_init(&workers.changed, NULL);
+  workers.count = count;
+  workers.window = thread_count * 4;
+  workers.done = calloc(count, 1);
+  assert(workers.done);
+  workers.work = work;
+  workers.context = context;
+
+  pthread_t threads[thread_count];
+  for (i=0;i<thread_count;i++){
+    int r = pthread_create(&threads[i], NULL, worker_main, &workers);
+    assert(r==0);
+  }
+  DEBUGF(WORKERS, "Started %u threads for %u items", thread_count, count);
+
+  for (i=0;i<count;i++){
+    pthread_mutex_lock(&workers.lock);
+    while(!workers.done[i])
+      pthread_cond_wait(&workers.changed, &workers.lock);
+    pthread_mutex_unlock(&workers.lock);
+
+    if (deliver)
+      deliver(i, context);
+
+    pthread_mutex_lock(&workers.lock);
+    workers.delivered = i+1;
+    pthread_cond_broadcast(&workers.changed);
+    pthread_mutex_unlock(&workers.lock);
+  }
+
+  for (i=0;i<thread_count;i++)
+    pthread_join(threads[i], NULL);
+
+  free(workers.done);
+  pthread_cond_destroy(&workers.changed);
+  pthread_mutex_destroy(&workers.lock);
+}
@@ -0,0 +1,16 @@
+
+#ifndef workers_header
+#define workers_header
+
+// called on a worker thread for each index
+typedef void (*work_callback) (unsigned index, void *context);
+// called on the calling thread for each index, in order, once the work for that index has finished
+typedef void (*deliver_callback) (unsigned index, void *context);
+
+// run work(0..count-1) on up to thread_count threads, delivering results in order.
+// at most (thread_count * 4) items will be completed but not yet delivered.
+void workers_run(unsigned thread_count, unsigned count, work_callback work, deliver_callback deliver, void *context);
+
+unsigned workers_default_count();
+
+#endif